@@ -0,0 +1,71 @@
+#include "async_writer.h"
+#include <memory>
+
+namespace {
+
+void writer_loop(AsyncWriter *writer) {
+  std::unique_lock<std::mutex> lock(writer->mutex);
+  while (true) {
+    writer->changed.wait(lock, [writer] {
+      return writer->stopping || !writer->jobs.empty();
+    });
+    if (writer->jobs.empty()) {
+      return;
+    }
+    std::function<void()> job = std::move(writer->jobs.front());
+    writer->jobs.pop_front();
+    writer->busy = true;
+    lock.unlock();
+    writer->changed.notify_all();
+    job();
+    lock.lock();
+    writer->busy = false;
+    writer->changed.notify_all();
+  }
+}
+
+} // namespace
+
+AsyncWriter *create_async_writer(size_t max_jobs) {
+  AsyncWriter *writer = new AsyncWriter();
+  writer->max_jobs = std::max<size_t>(max_jobs, 1);
+  writer->busy = false;
+  writer->stopping = false;
+  writer->thread = std::thread(writer_loop, writer);
+  return writer;
+}
+
+void dispose_async_writer(AsyncWriter *writer) {
+  {
+    std::lock_guard<std::mutex> lock(writer->mutex);
+    writer->stopping = true;
+  }
+  writer->changed.notify_all();
+  writer->thread.join();
+  delete writer;
+}
+
+void queue_job(AsyncWriter *writer, std::function<void()> job) {
+  {
+    std::unique_lock<std::mutex> lock(writer->mutex);
+    writer->changed.wait(lock, [writer] {
+      return writer->jobs.size() < writer->max_jobs;
+    });
+    writer->jobs.push_back(std::move(job));
+  }
+  writer->changed.notify_all();
+}
+
+void queue_image(AsyncWriter *writer, const std::string &filename, Image image) {
+  // std::function needs a copyable callable, so the image is shared rather
+  // than moved into the lambda
+  std::shared_ptr<Image> shared = std::make_shared<Image>(std::move(image));
+  queue_job(writer, [filename, shared] { write_image(filename.c_str(), *shared); });
+}
+
+void wait_idle(AsyncWriter *writer) {
+  std::unique_lock<std::mutex> lock(writer->mutex);
+  writer->changed.wait(lock, [writer] {
+    return writer->jobs.empty() && !writer->busy;
+  });
+}
@@ -0,0 +1,34 @@
+/*
+ * A background thread that runs file writes one at a time in the order they
+ * were queued, so image encoding and disk IO stay off the render loop. The
+ * queue is bounded: when the disk can not keep up, queueing blocks instead of
+ * piling up frames in memory.
+ */
+#pragma once
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include "image.h"
+
+struct AsyncWriter {
+  std::thread thread;
+  std::mutex mutex;
+  std::condition_variable changed;
+  std::deque<std::function<void()>> jobs;
+  size_t max_jobs;
+  bool busy;
+  bool stopping;
+};
+
+AsyncWriter *create_async_writer(size_t max_jobs = 8);
+// Finishes every queued job first
+void dispose_async_writer(AsyncWriter *writer);
+
+void queue_job(AsyncWriter *writer, std::function<void()> job);
+// Writes image in the format given by the extension of filename
+void queue_image(AsyncWriter *writer, const std::string &filename, Image image);
+// Blocks until every queued job has finished
+void wait_idle(AsyncWriter *writer);
@@ -0,0 +1,100 @@
+#version 330
+
+// One iteration of the edge-avoiding à-trous wavelet filter from SVGF
+// (Schied et al. 2017). A 5x5 B3 spline kernel is spread out by STEP pixels,
+// and taps are weighted down across differences in first-hit normal and
+// depth, and in luminance relative to the estimated noise level. The filter
+// works on illumination, i.e. radiance with the first-hit albedo divided out,
+// so texture and colour edges are not blurred.
+
+uniform sampler2D COLOUR;        // Radiance with the mean squared luminance of
+                                 // its samples in alpha on the first iteration,
+                                 // illumination and its variance after that
+uniform sampler2D NORMAL_DEPTH;
+uniform sampler2D ALBEDO;
+uniform int STEP;                // Pixels between taps, doubles every iteration
+uniform bool DEMODULATE;         // First iteration, divide out the albedo
+uniform bool REMODULATE;         // Last iteration, multiply the albedo back
+uniform float SAMPLE_COUNT;      // Samples averaged into COLOUR
+
+// How quickly the weights fall off with normal, depth and luminance
+// differences. The depth one is relative to the depth, per pixel of distance.
+const float SIGMA_NORMAL = 128.0;
+const float SIGMA_DEPTH = 0.05;
+const float SIGMA_LUMINANCE = 4.0;
+
+out vec4 out_colour;
+
+float luminance(vec3 c) {
+  return dot(c, vec3(0.2126, 0.7152, 0.0722));
+}
+
+// Illumination and variance at a pixel
+vec4 fetch_colour(ivec2 p) {
+  vec4 c = texelFetch(COLOUR, p, 0);
+  if (DEMODULATE) {
+    // Unbiased variance of the mean from the samples' first two moments. A
+    // single sample says nothing about the spread, so the second moment
+    // itself serves as a generous bound.
+    float l = luminance(c.rgb);
+    float variance = SAMPLE_COUNT > 1.0
+                         ? max(c.a - l * l, 0.0) / (SAMPLE_COUNT - 1.0)
+                         : c.a;
+    vec3 albedo = max(texelFetch(ALBEDO, p, 0).rgb, vec3(0.01));
+    c.rgb /= albedo;
+    c.a = variance / pow(max(luminance(albedo), 0.01), 2.0);
+  }
+  return c;
+}
+
+void main(void) {
+  ivec2 p = ivec2(gl_FragCoord.xy);
+  ivec2 size = textureSize(COLOUR, 0);
+  vec4 centre = fetch_colour(p);
+  vec4 normal_depth = texelFetch(NORMAL_DEPTH, p, 0);
+
+  // Slightly blurred variance gives a steadier luminance weight
+  float variance = 0.0;
+  float variance_weight = 0.0;
+  for (int y = -1; y <= 1; y++) {
+    for (int x = -1; x <= 1; x++) {
+      ivec2 q = p + ivec2(x, y);
+      if (any(lessThan(q, ivec2(0))) || any(greaterThanEqual(q, size))) continue;
+      float k = (x == 0 ? 0.5 : 0.25) * (y == 0 ? 0.5 : 0.25);
+      variance += k * fetch_colour(q).a;
+      variance_weight += k;
+    }
+  }
+  variance /= variance_weight;
+  float luminance_scale = SIGMA_LUMINANCE * sqrt(variance) + 1e-10;
+
+  const float kernel[3] = float[3](3.0 / 8.0, 1.0 / 4.0, 1.0 / 16.0);
+  vec3 sum = vec3(0.0);
+  float sum_variance = 0.0;
+  float sum_weight = 0.0;
+  for (int y = -2; y <= 2; y++) {
+    for (int x = -2; x <= 2; x++) {
+      ivec2 q = p + STEP * ivec2(x, y);
+      if (any(lessThan(q, ivec2(0))) || any(greaterThanEqual(q, size))) continue;
+      vec4 c = fetch_colour(q);
+      vec4 nd = texelFetch(NORMAL_DEPTH, q, 0);
+
+      float w_normal = pow(max(dot(normal_depth.xyz, nd.xyz), 0.0), SIGMA_NORMAL);
+      float depth_scale = SIGMA_DEPTH * abs(normal_depth.w) * length(vec2(STEP * ivec2(x, y)));
+      float w_depth = exp(-abs(normal_depth.w - nd.w) / (depth_scale + 1e-6));
+      float w_luminance = exp(-abs(luminance(centre.rgb) - luminance(c.rgb)) / luminance_scale);
+      float w = kernel[abs(x)] * kernel[abs(y)] * w_normal * w_depth * w_luminance;
+
+      sum += w * c.rgb;
+      sum_variance += w * w * c.a;
+      sum_weight += w;
+    }
+  }
+
+  // The centre tap always has a non-zero weight, so sum_weight is too
+  vec3 result = sum / sum_weight;
+  if (REMODULATE) {
+    result *= max(texelFetch(ALBEDO, p, 0).rgb, vec3(0.01));
+  }
+  out_colour = vec4(result, sum_variance / (sum_weight * sum_weight));
+}
@@ -0,0 +1,524 @@
+#include "bvh.h"
+#include <algorithm>
+#include <utility>
+
+namespace {
+
+const int NUM_BINS = 16;
+
+// Relative cost of visiting a node compared to intersecting a primitive
+const float TRAVERSAL_COST = 1.0f;
+
+// Below this many primitives build_parallel() just runs the serial builder
+const GLuint PARALLEL_BUILD_THRESHOLD = 1 << 14;
+
+// Items per task in the data parallel passes of build_parallel()
+const size_t GRAIN = 1 << 14;
+
+// Morton codes use 10 bits per axis. Clusters are formed from up to the top
+// MAX_CLUSTER_BITS_PER_AXIS of them, aiming for TARGET_CLUSTER_SIZE primitives.
+const int MORTON_BITS_PER_AXIS = 10;
+const int MAX_CLUSTER_BITS_PER_AXIS = 5;
+const GLuint TARGET_CLUSTER_SIZE = 64;
+
+// update() rebuilds a subtree when its SAH cost has grown by more than
+// PARTIAL_REBUILD_RATIO since it was built, and the whole tree when the root's
+// has grown by FULL_REBUILD_RATIO or over half the primitives need rebuilding.
+// Subtrees with fewer than MIN_REBUILD_PRIMS are not worth it.
+const float PARTIAL_REBUILD_RATIO = 1.3f;
+const float FULL_REBUILD_RATIO = 1.5f;
+const GLuint MIN_REBUILD_PRIMS = 16;
+
+const int RADIX_BITS = 10;
+const GLuint RADIX_BUCKETS = 1 << RADIX_BITS;
+
+struct Bin {
+  AABB bounds;
+  GLuint count = 0;
+};
+
+// Primitives are partitioned as self contained references rather than as
+// indices into prim_bounds, which keeps every pass over a node's primitives
+// sequential in memory. The weight is the number of primitives the reference
+// stands for in the SAH, which is more than one for whole clusters.
+struct PrimRef {
+  AABB bounds;
+  vec3 centroid;
+  GLuint prim;
+  GLuint weight;
+};
+
+float axis_value(const vec3 &v, int axis) {
+  return axis == 0 ? v.x : (axis == 1 ? v.y : v.z);
+}
+
+int bin_index(float c, float c_min, float scale) {
+  int b = int((c - c_min) * scale);
+  return std::min(std::max(b, 0), NUM_BINS - 1);
+}
+
+// Top-down binned SAH build over refs, which is reordered so that every leaf
+// covers a contiguous range of it
+void build_sah(std::vector<PrimRef> &refs, GLuint max_leaf_size,
+               std::vector<BVHNode> &nodes) {
+  GLuint num_refs = refs.size();
+
+  // A binary tree with n leaves never has more than 2n-1 nodes, so reserving
+  // up front keeps node references valid while children are appended
+  nodes.reserve(2 * num_refs - 1);
+  nodes.push_back(BVHNode{vec3(0.0), 0, vec3(0.0), num_refs});
+
+  std::vector<GLuint> stack{0};
+  while (!stack.empty()) {
+    BVHNode &node = nodes[stack.back()];
+    stack.pop_back();
+
+    GLuint first = node.left_first;
+    GLuint count = node.prim_count;
+    AABB bounds, centroid_bounds;
+    GLuint weight = 0;
+    for (GLuint i = first; i < first + count; i++) {
+      bounds.grow(refs[i].bounds);
+      centroid_bounds.grow(refs[i].centroid);
+      weight += refs[i].weight;
+    }
+    node.min = bounds.min;
+    node.max = bounds.max;
+    if (count == 1) {
+      continue;
+    }
+
+    // Find the cheapest bin boundary to split at along any axis
+    float best_cost = INFINITY;
+    int best_axis = -1;
+    int best_split = 0;
+    for (int axis = 0; axis < 3; axis++) {
+      float c_min = axis_value(centroid_bounds.min, axis);
+      float c_max = axis_value(centroid_bounds.max, axis);
+      if (c_max <= c_min) {
+        continue;
+      }
+      float scale = NUM_BINS / (c_max - c_min);
+
+      Bin bins[NUM_BINS];
+      for (GLuint i = first; i < first + count; i++) {
+        Bin &bin = bins[bin_index(axis_value(refs[i].centroid, axis), c_min, scale)];
+        bin.bounds.grow(refs[i].bounds);
+        bin.count += refs[i].weight;
+      }
+
+      // Sweep from the right to get the cost of everything right of a split,
+      // then from the left to combine it with the left side
+      float right_area[NUM_BINS - 1];
+      GLuint right_count[NUM_BINS - 1];
+      AABB acc;
+      GLuint acc_count = 0;
+      for (int b = NUM_BINS - 1; b > 0; b--) {
+        acc.grow(bins[b].bounds);
+        acc_count += bins[b].count;
+        right_area[b - 1] = acc.surface_area();
+        right_count[b - 1] = acc_count;
+      }
+      acc = AABB();
+      acc_count = 0;
+      for (int b = 0; b < NUM_BINS - 1; b++) {
+        acc.grow(bins[b].bounds);
+        acc_count += bins[b].count;
+        if (acc_count == 0 || right_count[b] == 0) {
+          continue;
+        }
+        float cost = acc.surface_area() * acc_count + right_area[b] * right_count[b];
+        if (cost < best_cost) {
+          best_cost = cost;
+          best_axis = axis;
+          best_split = b + 1;
+        }
+      }
+    }
+
+    float leaf_cost = float(weight);
+    float parent_area = bounds.surface_area();
+    best_cost = TRAVERSAL_COST + best_cost / fmaxf(parent_area, 1e-20f);
+    if (count <= max_leaf_size && (best_axis < 0 || best_cost >= leaf_cost)) {
+      continue;
+    }
+
+    PrimRef *begin = refs.data() + first;
+    PrimRef *end = begin + count;
+    PrimRef *mid = begin;
+    if (best_axis >= 0) {
+      float c_min = axis_value(centroid_bounds.min, best_axis);
+      float scale = NUM_BINS / (axis_value(centroid_bounds.max, best_axis) - c_min);
+      mid = std::partition(begin, end, [&](const PrimRef &r) {
+        return bin_index(axis_value(r.centroid, best_axis), c_min, scale) < best_split;
+      });
+    }
+    if (mid == begin || mid == end) {
+      // All centroids coincide, or binning could not separate them. Split at
+      // the median so oversized leaves are still broken up.
+      mid = begin + count / 2;
+    }
+
+    GLuint left_count = mid - begin;
+    GLuint left = nodes.size();
+    node.left_first = left;
+    node.prim_count = 0;
+    nodes.push_back(BVHNode{vec3(0.0), first, vec3(0.0), left_count});
+    nodes.push_back(BVHNode{vec3(0.0), first + left_count, vec3(0.0), count - left_count});
+    stack.push_back(left + 1);
+    stack.push_back(left);
+  }
+}
+
+// Spreads the low 10 bits of v out to every third bit
+GLuint expand_bits(GLuint v) {
+  v = (v * 0x00010001u) & 0xFF0000FFu;
+  v = (v * 0x00000101u) & 0x0F00F00Fu;
+  v = (v * 0x00000011u) & 0xC30C30C3u;
+  v = (v * 0x00000005u) & 0x49249249u;
+  return v;
+}
+
+// Morton code of p on a cubic grid over bounds. Using the same cell size on
+// every axis keeps clusters from degenerating into slivers in flat scenes.
+GLuint morton_code(const vec3 &p, const AABB &bounds) {
+  vec3 extent = bounds.max - bounds.min;
+  float size = std::max(std::max(extent.x, extent.y), extent.z);
+  float scale = size > 0.0f ? (1 << MORTON_BITS_PER_AXIS) / size : 0.0f;
+  const float max_cell = float((1 << MORTON_BITS_PER_AXIS) - 1);
+  GLuint xyz[3];
+  for (int a = 0; a < 3; a++) {
+    float cell = (axis_value(p, a) - axis_value(bounds.min, a)) * scale;
+    xyz[a] = GLuint(std::min(std::max(cell, 0.0f), max_cell));
+  }
+  return expand_bits(xyz[0]) << 2 | expand_bits(xyz[1]) << 1 | expand_bits(xyz[2]);
+}
+
+// Stable parallel LSD radix sort of 30 bit keys, carrying values along
+void radix_sort(std::vector<GLuint> &keys, std::vector<GLuint> &values,
+                ThreadPool &pool) {
+  size_t n = keys.size();
+  size_t num_chunks = std::min<size_t>(pool.size() * 4, (n + GRAIN - 1) / GRAIN);
+  size_t chunk_size = (n + num_chunks - 1) / num_chunks;
+  std::vector<GLuint> keys_tmp(n), values_tmp(n);
+  std::vector<size_t> offsets(num_chunks * RADIX_BUCKETS);
+
+  for (int shift = 0; shift < 3 * MORTON_BITS_PER_AXIS; shift += RADIX_BITS) {
+    pool.parallel_for(num_chunks, 1, [&](size_t c_begin, size_t c_end) {
+      for (size_t c = c_begin; c < c_end; c++) {
+        size_t *hist = &offsets[c * RADIX_BUCKETS];
+        std::fill(hist, hist + RADIX_BUCKETS, 0);
+        for (size_t i = c * chunk_size; i < std::min(n, (c + 1) * chunk_size); i++) {
+          hist[(keys[i] >> shift) & (RADIX_BUCKETS - 1)]++;
+        }
+      }
+    });
+
+    // Bucket major, chunk minor exclusive scan keeps the sort stable
+    size_t sum = 0;
+    for (GLuint b = 0; b < RADIX_BUCKETS; b++) {
+      for (size_t c = 0; c < num_chunks; c++) {
+        size_t count = offsets[c * RADIX_BUCKETS + b];
+        offsets[c * RADIX_BUCKETS + b] = sum;
+        sum += count;
+      }
+    }
+
+    pool.parallel_for(num_chunks, 1, [&](size_t c_begin, size_t c_end) {
+      for (size_t c = c_begin; c < c_end; c++) {
+        size_t *offset = &offsets[c * RADIX_BUCKETS];
+        for (size_t i = c * chunk_size; i < std::min(n, (c + 1) * chunk_size); i++) {
+          size_t dst = offset[(keys[i] >> shift) & (RADIX_BUCKETS - 1)]++;
+          keys_tmp[dst] = keys[i];
+          values_tmp[dst] = values[i];
+        }
+      }
+    });
+    keys.swap(keys_tmp);
+    values.swap(values_tmp);
+  }
+}
+
+// SAH cost of every subtree relative to the area of its root, which is the
+// expected cost of a ray that hits the root. Also returns the contiguous range
+// of prim_indices each subtree covers.
+void subtree_costs(const std::vector<BVHNode> &nodes, std::vector<float> &cost,
+                   std::vector<GLuint> &first, std::vector<GLuint> &count) {
+  cost.resize(nodes.size());
+  first.resize(nodes.size());
+  count.resize(nodes.size());
+  for (GLuint i = nodes.size(); i-- > 0;) {
+    const BVHNode &node = nodes[i];
+    if (node.is_leaf()) {
+      cost[i] = node.prim_count;
+      first[i] = node.left_first;
+      count[i] = node.prim_count;
+      continue;
+    }
+    GLuint l = node.left_first, r = l + 1;
+    float area = fmaxf(node.bounds().surface_area(), 1e-20f);
+    float abs_cost = TRAVERSAL_COST * area +
+                     cost[l] * nodes[l].bounds().surface_area() +
+                     cost[r] * nodes[r].bounds().surface_area();
+    cost[i] = abs_cost / area;
+    first[i] = std::min(first[l], first[r]);
+    count[i] = count[l] + count[r];
+  }
+}
+
+// Copies the tree into a new node array, replacing the subtrees marked in
+// rebuild with fresh binned SAH builds over the same primitive ranges. The
+// copy is made top-down, so children still come after their parents.
+void rebuild_subtrees(BVH &bvh, const std::vector<AABB> &prim_bounds,
+                      const std::vector<bool> &rebuild,
+                      const std::vector<GLuint> &first,
+                      const std::vector<GLuint> &count, GLuint max_leaf_size) {
+  std::vector<BVHNode> out;
+  out.reserve(bvh.nodes.size());
+  out.push_back(bvh.nodes[0]);
+
+  std::vector<PrimRef> refs;
+  std::vector<BVHNode> local;
+  std::vector<std::pair<GLuint, GLuint>> stack{{0, 0}}; // (old node, new node)
+  while (!stack.empty()) {
+    GLuint old_index = stack.back().first, new_index = stack.back().second;
+    stack.pop_back();
+    const BVHNode &node = bvh.nodes[old_index];
+
+    if (rebuild[old_index]) {
+      GLuint f = first[old_index], n = count[old_index];
+      refs.resize(n);
+      for (GLuint i = 0; i < n; i++) {
+        GLuint prim = bvh.prim_indices[f + i];
+        refs[i] = PrimRef{prim_bounds[prim], prim_bounds[prim].centroid(), prim, 1};
+      }
+      local.clear();
+      build_sah(refs, max_leaf_size, local);
+      for (GLuint i = 0; i < n; i++) {
+        bvh.prim_indices[f + i] = refs[i].prim;
+      }
+
+      // Local node k > 0 goes to base + k - 1, the root replaces new_index
+      GLuint base = out.size();
+      out.resize(base + local.size() - 1);
+      for (GLuint k = 0; k < local.size(); k++) {
+        BVHNode copy = local[k];
+        copy.left_first += copy.is_leaf() ? f : base - 1;
+        out[k == 0 ? new_index : base + k - 1] = copy;
+      }
+    } else if (node.is_leaf()) {
+      out[new_index] = node;
+    } else {
+      GLuint left = out.size();
+      out.push_back(bvh.nodes[node.left_first]);
+      out.push_back(bvh.nodes[node.left_first + 1]);
+      out[new_index] = node;
+      out[new_index].left_first = left;
+      stack.push_back({node.left_first + 1, left + 1});
+      stack.push_back({node.left_first, left});
+    }
+  }
+  bvh.nodes.swap(out);
+}
+
+} // namespace
+
+void BVH::build(const std::vector<AABB> &prim_bounds, GLuint max_leaf_size) {
+  GLuint num_prims = prim_bounds.size();
+  nodes.clear();
+  reference_cost.clear();
+  prim_indices.resize(num_prims);
+  if (num_prims == 0) {
+    return;
+  }
+
+  std::vector<PrimRef> refs(num_prims);
+  for (GLuint i = 0; i < num_prims; i++) {
+    refs[i] = PrimRef{prim_bounds[i], prim_bounds[i].centroid(), i, 1};
+  }
+  build_sah(refs, max_leaf_size, nodes);
+  for (GLuint i = 0; i < num_prims; i++) {
+    prim_indices[i] = refs[i].prim;
+  }
+}
+
+void BVH::build_parallel(const std::vector<AABB> &prim_bounds,
+                         GLuint max_leaf_size, ThreadPool &pool) {
+  GLuint num_prims = prim_bounds.size();
+  if (num_prims < PARALLEL_BUILD_THRESHOLD || pool.size() == 1) {
+    build(prim_bounds, max_leaf_size);
+    return;
+  }
+  reference_cost.clear();
+
+  // Bounds of all centroids, reduced per chunk
+  size_t num_chunks = (num_prims + GRAIN - 1) / GRAIN;
+  std::vector<AABB> chunk_bounds(num_chunks);
+  pool.parallel_for(num_prims, GRAIN, [&](size_t begin, size_t end) {
+    AABB b;
+    for (size_t i = begin; i < end; i++) {
+      b.grow(prim_bounds[i].centroid());
+    }
+    chunk_bounds[begin / GRAIN] = b;
+  });
+  AABB centroid_bounds;
+  for (const AABB &b : chunk_bounds) {
+    centroid_bounds.grow(b);
+  }
+
+  // Sort the primitives along a Morton curve
+  std::vector<GLuint> codes(num_prims), sorted_prims(num_prims);
+  pool.parallel_for(num_prims, GRAIN, [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; i++) {
+      codes[i] = morton_code(prim_bounds[i].centroid(), centroid_bounds);
+      sorted_prims[i] = i;
+    }
+  });
+  radix_sort(codes, sorted_prims, pool);
+  prim_indices.resize(num_prims);
+
+  // Group primitives into clusters by the top bits of their codes. Enough
+  // bits are used to get roughly TARGET_CLUSTER_SIZE primitives per cluster.
+  int cluster_bits = 1;
+  while (cluster_bits < MAX_CLUSTER_BITS_PER_AXIS &&
+         (GLuint(1) << (3 * cluster_bits)) * TARGET_CLUSTER_SIZE < num_prims) {
+    cluster_bits++;
+  }
+  int cluster_shift = 3 * (MORTON_BITS_PER_AXIS - cluster_bits);
+  std::vector<GLuint> cluster_starts{0};
+  for (GLuint i = 1; i < num_prims; i++) {
+    if ((codes[i] >> cluster_shift) != (codes[i - 1] >> cluster_shift)) {
+      cluster_starts.push_back(i);
+    }
+  }
+  GLuint num_clusters = cluster_starts.size();
+  cluster_starts.push_back(num_prims);
+
+  // Bottom levels: a binned SAH subtree per cluster, built independently
+  std::vector<std::vector<BVHNode>> cluster_nodes(num_clusters);
+  std::vector<PrimRef> cluster_refs(num_clusters);
+  pool.parallel_for(num_clusters, 16, [&](size_t begin, size_t end) {
+    std::vector<PrimRef> refs;
+    for (size_t c = begin; c < end; c++) {
+      GLuint first = cluster_starts[c];
+      GLuint count = cluster_starts[c + 1] - first;
+      refs.resize(count);
+      for (GLuint i = 0; i < count; i++) {
+        const AABB &b = prim_bounds[sorted_prims[first + i]];
+        refs[i] = PrimRef{b, b.centroid(), sorted_prims[first + i], 1};
+      }
+      build_sah(refs, max_leaf_size, cluster_nodes[c]);
+      for (GLuint i = 0; i < count; i++) {
+        prim_indices[first + i] = refs[i].prim;
+      }
+      for (BVHNode &node : cluster_nodes[c]) {
+        if (node.is_leaf()) {
+          node.left_first += first;
+        }
+      }
+      const BVHNode &root = cluster_nodes[c][0];
+      cluster_refs[c] = PrimRef{root.bounds(), root.bounds().centroid(), GLuint(c), count};
+    }
+  });
+
+  // Top levels: binned SAH over the clusters, one cluster per leaf
+  std::vector<BVHNode> top;
+  build_sah(cluster_refs, 1, top);
+
+  // Every top level leaf is replaced by its cluster's root, the rest of each
+  // cluster's nodes are appended after the top levels
+  std::vector<GLuint> cluster_offset(num_clusters);
+  GLuint num_nodes = top.size();
+  for (GLuint c = 0; c < num_clusters; c++) {
+    cluster_offset[c] = num_nodes;
+    num_nodes += cluster_nodes[c].size() - 1;
+  }
+  nodes.resize(num_nodes);
+  std::vector<GLuint> cluster_slot(num_clusters);
+  for (GLuint i = 0; i < top.size(); i++) {
+    if (top[i].is_leaf()) {
+      cluster_slot[cluster_refs[top[i].left_first].prim] = i;
+    } else {
+      nodes[i] = top[i];
+    }
+  }
+  pool.parallel_for(num_clusters, 64, [&](size_t begin, size_t end) {
+    for (size_t c = begin; c < end; c++) {
+      const std::vector<BVHNode> &local = cluster_nodes[c];
+      for (GLuint k = 0; k < local.size(); k++) {
+        BVHNode node = local[k];
+        if (!node.is_leaf()) {
+          node.left_first = cluster_offset[c] + node.left_first - 1;
+        }
+        nodes[k == 0 ? cluster_slot[c] : cluster_offset[c] + k - 1] = node;
+      }
+    }
+  });
+}
+
+void BVH::refit(const std::vector<AABB> &prim_bounds) {
+  for (GLuint i = nodes.size(); i-- > 0;) {
+    BVHNode &node = nodes[i];
+    AABB bounds;
+    if (node.is_leaf()) {
+      for (GLuint p = node.left_first; p < node.left_first + node.prim_count; p++) {
+        bounds.grow(prim_bounds[prim_indices[p]]);
+      }
+    } else {
+      bounds = nodes[node.left_first].bounds();
+      bounds.grow(nodes[node.left_first + 1].bounds());
+    }
+    node.min = bounds.min;
+    node.max = bounds.max;
+  }
+}
+
+BVHUpdate BVH::update(const std::vector<AABB> &prim_bounds, GLuint max_leaf_size) {
+  if (nodes.empty()) {
+    return BVHUpdate::REFIT;
+  }
+  std::vector<float> cost;
+  std::vector<GLuint> first, count;
+  if (reference_cost.size() != nodes.size()) {
+    // The boxes are still the ones the tree was built with
+    subtree_costs(nodes, reference_cost, first, count);
+  }
+
+  refit(prim_bounds);
+  subtree_costs(nodes, cost, first, count);
+  BVHUpdate result = BVHUpdate::FULL_REBUILD;
+  if (cost[0] <= FULL_REBUILD_RATIO * reference_cost[0]) {
+    // Collect the topmost subtrees that degraded too far
+    std::vector<bool> rebuild(nodes.size(), false);
+    GLuint rebuild_prims = 0;
+    std::vector<GLuint> stack{0};
+    while (!stack.empty()) {
+      GLuint i = stack.back();
+      stack.pop_back();
+      if (nodes[i].is_leaf()) {
+        continue;
+      }
+      if (count[i] >= MIN_REBUILD_PRIMS &&
+          cost[i] > PARTIAL_REBUILD_RATIO * reference_cost[i]) {
+        rebuild[i] = true;
+        rebuild_prims += count[i];
+        continue;
+      }
+      stack.push_back(nodes[i].left_first);
+      stack.push_back(nodes[i].left_first + 1);
+    }
+
+    if (rebuild_prims == 0) {
+      return BVHUpdate::REFIT;
+    }
+    if (2 * rebuild_prims <= prim_indices.size()) {
+      rebuild_subtrees(*this, prim_bounds, rebuild, first, count, max_leaf_size);
+      result = BVHUpdate::PARTIAL_REBUILD;
+    }
+  }
+  if (result == BVHUpdate::FULL_REBUILD) {
+    build_parallel(prim_bounds, max_leaf_size);
+  }
+  subtree_costs(nodes, reference_cost, first, count);
+  return result;
+}
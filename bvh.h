@@ -0,0 +1,170 @@
+/*
+ * Bounding volume hierarchy over an arbitrary set of primitives, described
+ * only by their bounding boxes. The same builder is used for spheres and
+ * triangles, the caller maps prim_indices back to its own primitives.
+ */
+#pragma once
+#include <algorithm>
+#include <math.h>
+#include <vector>
+#include "VectorUtils4.h"
+#include "thread_pool.h"
+
+struct AABB {
+  vec3 min;
+  vec3 max;
+
+  AABB() : min{vec3(INFINITY)}, max{vec3(-INFINITY)} {}
+  AABB(vec3 min, vec3 max) : min{min}, max{max} {}
+
+  void grow(vec3 p) {
+    min = vec3(std::min(min.x, p.x), std::min(min.y, p.y), std::min(min.z, p.z));
+    max = vec3(std::max(max.x, p.x), std::max(max.y, p.y), std::max(max.z, p.z));
+  }
+
+  void grow(const AABB &b) {
+    min = vec3(std::min(min.x, b.min.x), std::min(min.y, b.min.y),
+               std::min(min.z, b.min.z));
+    max = vec3(std::max(max.x, b.max.x), std::max(max.y, b.max.y),
+               std::max(max.z, b.max.z));
+  }
+
+  vec3 centroid() const {
+    return vec3(0.5f * (min.x + max.x), 0.5f * (min.y + max.y),
+                0.5f * (min.z + max.z));
+  }
+
+  float surface_area() const {
+    float dx = max.x - min.x, dy = max.y - min.y, dz = max.z - min.z;
+    if (dx < 0.0f || dy < 0.0f || dz < 0.0f) {
+      return 0.0f;
+    }
+    return 2.0f * (dx * dy + dy * dz + dz * dx);
+  }
+};
+
+// NB! The node is exactly two vec4s so the node array can be written to disk
+// or uploaded to the GPU as is.
+struct BVHNode {
+  vec3 min;
+  GLuint left_first; // Left child for interior nodes (right child is
+                     // left_first + 1), first primitive index for leaves
+  vec3 max;
+  GLuint prim_count; // Zero for interior nodes
+
+  bool is_leaf() const { return prim_count > 0; }
+  AABB bounds() const { return AABB(min, max); }
+};
+
+// Slab test of a ray against a box. inv_dir is the componentwise reciprocal
+// of the ray direction. On a hit t_enter is the entry distance, clamped to 0.
+inline bool ray_aabb_intersect(const vec3 &lo, const vec3 &hi,
+                               const vec3 &origin, const vec3 &inv_dir,
+                               float t_max, float &t_enter) {
+  float tx0 = (lo.x - origin.x) * inv_dir.x, tx1 = (hi.x - origin.x) * inv_dir.x;
+  float ty0 = (lo.y - origin.y) * inv_dir.y, ty1 = (hi.y - origin.y) * inv_dir.y;
+  float tz0 = (lo.z - origin.z) * inv_dir.z, tz1 = (hi.z - origin.z) * inv_dir.z;
+  t_enter = std::max(std::max(std::min(tx0, tx1), std::min(ty0, ty1)),
+                     std::max(std::min(tz0, tz1), 0.0f));
+  float t_exit = std::min(std::min(std::max(tx0, tx1), std::max(ty0, ty1)),
+                          std::min(std::max(tz0, tz1), t_max));
+  return t_enter <= t_exit;
+}
+
+inline vec3 safe_inverse(const vec3 &dir) {
+  const float eps = 1e-20f;
+  return vec3(1.0f / (fabsf(dir.x) > eps ? dir.x : copysignf(eps, dir.x)),
+              1.0f / (fabsf(dir.y) > eps ? dir.y : copysignf(eps, dir.y)),
+              1.0f / (fabsf(dir.z) > eps ? dir.z : copysignf(eps, dir.z)));
+}
+
+// What BVH::update() had to do to bring the tree up to date
+enum class BVHUpdate { REFIT, PARTIAL_REBUILD, FULL_REBUILD };
+
+struct BVH {
+  std::vector<BVHNode> nodes;
+  std::vector<GLuint> prim_indices;
+
+  // Per node SAH cost relative to its own area, as of the last (re)build.
+  // Filled in by update() and used to tell how much a refit has degraded it.
+  // The builders clear it, so the next update() takes the new tree's costs.
+  std::vector<float> reference_cost;
+
+  // Builds the hierarchy top-down using binned SAH. Leaves hold at most
+  // max_leaf_size primitives.
+  void build(const std::vector<AABB> &prim_bounds, GLuint max_leaf_size = 4);
+
+  // Faster build for large inputs. Primitives are sorted along a Morton curve
+  // and cut into spatial clusters, each cluster gets a binned SAH subtree built
+  // in parallel, and the levels above the clusters are built with binned SAH
+  // over the cluster boxes. Small inputs fall back to build().
+  void build_parallel(const std::vector<AABB> &prim_bounds, GLuint max_leaf_size = 4,
+                      ThreadPool &pool = ThreadPool::global());
+
+  // Recomputes every node's box bottom-up from new primitive bounds, keeping
+  // the topology. Children must come after their parent in nodes, which holds
+  // for every tree built here.
+  void refit(const std::vector<AABB> &prim_bounds);
+
+  // Brings the tree up to date with moved primitives. It is refitted, then
+  // subtrees whose SAH cost has degraded too far are rebuilt in place, or the
+  // whole tree if the root has. The primitive count must be unchanged.
+  BVHUpdate update(const std::vector<AABB> &prim_bounds, GLuint max_leaf_size = 4);
+
+  // Finds the closest hit along a ray on the CPU. intersect_prim(prim, t_max)
+  // tests a single primitive, and on a hit closer than t_max it shrinks t_max
+  // and returns true.
+  template <typename IntersectPrim>
+  bool intersect(const vec3 &origin, const vec3 &dir, float &t_max,
+                 IntersectPrim intersect_prim) const;
+};
+
+template <typename IntersectPrim>
+bool BVH::intersect(const vec3 &origin, const vec3 &dir, float &t_max,
+                    IntersectPrim intersect_prim) const {
+  if (nodes.empty()) {
+    return false;
+  }
+  vec3 inv_dir = safe_inverse(dir);
+  bool did_hit = false;
+  float t_enter;
+  if (!ray_aabb_intersect(nodes[0].min, nodes[0].max, origin, inv_dir, t_max,
+                          t_enter)) {
+    return false;
+  }
+
+  GLuint stack[64];
+  int stack_size = 0;
+  stack[stack_size++] = 0;
+  while (stack_size > 0) {
+    const BVHNode &node = nodes[stack[--stack_size]];
+    if (node.is_leaf()) {
+      for (GLuint i = node.left_first; i < node.left_first + node.prim_count; i++) {
+        did_hit |= intersect_prim(prim_indices[i], t_max);
+      }
+      continue;
+    }
+
+    // Visit the nearer child first so t_max shrinks as early as possible
+    GLuint left = node.left_first, right = left + 1;
+    float t_left, t_right;
+    bool hit_left = ray_aabb_intersect(nodes[left].min, nodes[left].max, origin,
+                                       inv_dir, t_max, t_left);
+    bool hit_right = ray_aabb_intersect(nodes[right].min, nodes[right].max,
+                                        origin, inv_dir, t_max, t_right);
+    if (hit_left && hit_right && t_right < t_left) {
+      GLuint tmp = left;
+      left = right;
+      right = tmp;
+    }
+    if (hit_left && hit_right) {
+      stack[stack_size++] = right;
+      stack[stack_size++] = left;
+    } else if (hit_left) {
+      stack[stack_size++] = left;
+    } else if (hit_right) {
+      stack[stack_size++] = right;
+    }
+  }
+  return did_hit;
+}
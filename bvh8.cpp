@@ -0,0 +1,188 @@
+#include "bvh8.h"
+#include <assert.h>
+#include <utility>
+
+namespace {
+
+float axis_value(const vec3 &v, int axis) {
+  return axis == 0 ? v.x : (axis == 1 ? v.y : v.z);
+}
+
+// Picks the smallest power of two grid spacing that still spans the extent
+// in 255 steps, returned as a biased exponent
+GLubyte grid_exponent(float extent) {
+  int e = -126;
+  if (extent > 0.0f) {
+    int exp;
+    float mantissa = frexpf(extent / 255.0f, &exp);
+    // frexp gives extent/255 = mantissa * 2^exp with mantissa in [0.5, 1)
+    e = mantissa == 0.5f ? exp - 1 : exp;
+  }
+  if (e < -126) e = -126;
+  if (e > 127) e = 127;
+  return GLubyte(e + 127);
+}
+
+GLubyte quantize_down(float value, float origin, float scale) {
+  float q = floorf((value - origin) / scale);
+  while (q > 0.0f && origin + q * scale > value) {
+    q -= 1.0f;
+  }
+  return GLubyte(fminf(fmaxf(q, 0.0f), 255.0f));
+}
+
+GLubyte quantize_up(float value, float origin, float scale) {
+  float q = ceilf((value - origin) / scale);
+  while (q < 255.0f && origin + q * scale < value) {
+    q += 1.0f;
+  }
+  return GLubyte(fminf(fmaxf(q, 0.0f), 255.0f));
+}
+
+// Anchors the node's grid at bounds and quantizes the boxes of the binary
+// nodes in its child slots onto it
+void quantize_children(BVH8Node &node, const AABB &bounds, const BVH &bvh,
+                       const GLuint *children, int num_children) {
+  node.origin = bounds.min;
+  for (int a = 0; a < 3; a++) {
+    node.exponent[a] = grid_exponent(axis_value(bounds.max, a) - axis_value(bounds.min, a));
+  }
+  vec3 scale = vec3(grid_scale(node.exponent[0]), grid_scale(node.exponent[1]),
+                    grid_scale(node.exponent[2]));
+  for (int i = 0; i < num_children; i++) {
+    const BVHNode &c = bvh.nodes[children[i]];
+    for (int a = 0; a < 3; a++) {
+      float o = axis_value(node.origin, a), s = axis_value(scale, a);
+      node.qmin[a][i] = quantize_down(axis_value(c.min, a), o, s);
+      node.qmax[a][i] = quantize_up(axis_value(c.max, a), o, s);
+    }
+  }
+}
+
+// Whether the leaves among children fit in meta once laid out in slot order:
+// at most 7 primitives at an offset of at most 31, and never 0xff, which marks
+// interior slots
+bool leaves_fit(const BVH &bvh, const GLuint *children, int num_children) {
+  GLuint offset = 0;
+  for (int i = 0; i < num_children; i++) {
+    const BVHNode &c = bvh.nodes[children[i]];
+    if (!c.is_leaf()) {
+      continue;
+    }
+    if (c.prim_count > 7 || offset > 31 || (c.prim_count << 5 | offset) == 0xff) {
+      return false;
+    }
+    offset += c.prim_count;
+  }
+  return true;
+}
+
+} // namespace
+
+void BVH8::build(const BVH &bvh) {
+  nodes.clear();
+  prim_indices.clear();
+  node_sources.clear();
+  slot_sources.clear();
+  depth = 0;
+  if (bvh.nodes.empty()) {
+    return;
+  }
+  prim_indices.reserve(bvh.prim_indices.size());
+
+  // Pairs of (wide node, binary node it represents). Interior children of a
+  // wide node are allocated next to each other, so the order is breadth first.
+  std::vector<std::pair<GLuint, GLuint>> queue;
+  std::vector<GLuint> levels = {1}; // Per wide node, the root is on level 1
+  nodes.push_back(BVH8Node{});
+  node_sources.push_back(0);
+  queue.push_back({0, 0});
+  for (size_t q = 0; q < queue.size(); q++) {
+    GLuint wide_index = queue[q].first;
+    const BVHNode &bin = bvh.nodes[queue[q].second];
+    depth = std::max(depth, levels[wide_index]);
+
+    // Open up the child with the largest surface area until all eight slots
+    // are used or only leaves remain. A child is only opened if the leaves
+    // still fit in meta afterwards.
+    GLuint children[8];
+    int num_children = 0;
+    if (bin.is_leaf()) {
+      children[num_children++] = queue[q].second;
+    } else {
+      children[num_children++] = bin.left_first;
+      children[num_children++] = bin.left_first + 1;
+    }
+    while (num_children < 8) {
+      int best = -1;
+      float best_area = -1.0f;
+      for (int i = 0; i < num_children; i++) {
+        const BVHNode &c = bvh.nodes[children[i]];
+        float area = c.bounds().surface_area();
+        if (c.is_leaf() || area <= best_area) {
+          continue;
+        }
+        GLuint opened[8];
+        std::copy(children, children + num_children, opened);
+        opened[i] = c.left_first;
+        opened[num_children] = c.left_first + 1;
+        if (leaves_fit(bvh, opened, num_children + 1)) {
+          best = i;
+          best_area = area;
+        }
+      }
+      if (best < 0) {
+        break;
+      }
+      GLuint opened = children[best];
+      children[best] = bvh.nodes[opened].left_first;
+      children[num_children++] = bvh.nodes[opened].left_first + 1;
+    }
+
+    assert(leaves_fit(bvh, children, num_children) &&
+           "binary BVH leaves hold more primitives than BVH8Node can encode");
+
+    BVH8Node node{};
+    quantize_children(node, bin.bounds(), bvh, children, num_children);
+    node.child_base = nodes.size();
+    node.prim_base = prim_indices.size();
+    std::array<GLuint, 8> sources{};
+    std::copy(children, children + num_children, sources.begin());
+    slot_sources.push_back(sources);
+
+    for (int i = 0; i < num_children; i++) {
+      const BVHNode &c = bvh.nodes[children[i]];
+      if (c.is_leaf()) {
+        GLuint offset = prim_indices.size() - node.prim_base;
+        node.meta[i] = GLubyte(c.prim_count << 5 | offset);
+        for (GLuint p = c.left_first; p < c.left_first + c.prim_count; p++) {
+          prim_indices.push_back(bvh.prim_indices[p]);
+        }
+      } else {
+        node.imask |= 1 << i;
+        node.meta[i] = 0xff;
+        queue.push_back({GLuint(nodes.size()), children[i]});
+        levels.push_back(levels[wide_index] + 1);
+        nodes.push_back(BVH8Node{});
+        node_sources.push_back(children[i]);
+      }
+    }
+    nodes[wide_index] = node;
+  }
+}
+
+void BVH8::refit(const BVH &bvh, std::vector<GLuint> &changed_nodes) {
+  for (GLuint i = 0; i < nodes.size(); i++) {
+    BVH8Node node = nodes[i];
+    int num_children = 0;
+    while (num_children < 8 && node.slot_used(num_children)) {
+      num_children++;
+    }
+    quantize_children(node, bvh.nodes[node_sources[i]].bounds(), bvh,
+                      slot_sources[i].data(), num_children);
+    if (memcmp(&node, &nodes[i], sizeof(node)) != 0) {
+      nodes[i] = node;
+      changed_nodes.push_back(i);
+    }
+  }
+}
@@ -0,0 +1,152 @@
+/*
+ * Compressed 8-wide BVH. Child boxes are stored quantized to 8 bits per axis
+ * on a power of two grid anchored at the parent's min corner, which packs
+ * eight children into one 80 byte node instead of the 256 bytes eight binary
+ * nodes would need. It is built by collapsing a binary BVH.
+ *
+ * NB! tracer.frag reads each node as five uvec4s, keep the layout in sync.
+ */
+#pragma once
+#include <array>
+#include <string.h>
+#include "bvh.h"
+
+// 2^(e-127) built directly from the float bit pattern
+inline float grid_scale(GLubyte e) {
+  GLuint bits = GLuint(e) << 23;
+  float f;
+  memcpy(&f, &bits, sizeof(f));
+  return f;
+}
+
+struct BVH8Node {
+  vec3 origin;          // Min corner of the node's box
+  GLubyte exponent[3];  // Grid spacing per axis is 2^(exponent-127)
+  GLubyte imask;        // Bit i is set if child slot i is an interior node
+  GLuint child_base;    // First interior child, the others follow in slot order
+  GLuint prim_base;     // First entry in prim_indices used by the leaf children
+  GLubyte meta[8];      // 0 for empty slots, 0xff for interior children and
+                        // (count << 5 | offset from prim_base) for leaves,
+                        // which keeps count to 7 and offset to 31
+  GLubyte qmin[3][8];   // Quantized child boxes, per axis then per slot
+  GLubyte qmax[3][8];
+
+  bool slot_used(int i) const { return meta[i] != 0; }
+  bool slot_interior(int i) const { return (imask >> i) & 1; }
+  GLuint leaf_count(int i) const { return meta[i] >> 5; }
+  GLuint leaf_first(int i) const { return prim_base + (meta[i] & 31); }
+
+  // Index of the node in interior child slot i
+  GLuint child_index(int i) const {
+    return child_base + __builtin_popcount(imask & ((1u << i) - 1));
+  }
+
+  AABB child_bounds(int i) const;
+};
+
+static_assert(sizeof(BVH8Node) == 80, "BVH8Node must match tracer.frag");
+
+struct BVH8 {
+  std::vector<BVH8Node> nodes;
+  std::vector<GLuint> prim_indices;
+  GLuint depth = 0;  // Levels of nodes, a traversal stack needs this many entries
+
+  // The binary node each wide node was collapsed from, and the binary nodes in
+  // its child slots. Only kept on the CPU for refit().
+  std::vector<GLuint> node_sources;
+  std::vector<std::array<GLuint, 8>> slot_sources;
+
+  // Collapses a binary BVH. Its leaves must hold at most 7 primitives, and
+  // children are only pulled up into a wide node while the primitives of its
+  // leaves stay within the 31 meta can address.
+  void build(const BVH &bvh);
+
+  // Requantizes every node from the binary BVH it was built from after that
+  // has been refitted, keeping the topology. The indices of nodes whose bytes
+  // changed are appended to changed_nodes in increasing order.
+  void refit(const BVH &bvh, std::vector<GLuint> &changed_nodes);
+
+  // Same contract as BVH::intersect
+  template <typename IntersectPrim>
+  bool intersect(const vec3 &origin, const vec3 &dir, float &t_max,
+                 IntersectPrim intersect_prim) const;
+};
+
+inline AABB BVH8Node::child_bounds(int i) const {
+  vec3 scale = vec3(grid_scale(exponent[0]), grid_scale(exponent[1]),
+                    grid_scale(exponent[2]));
+  return AABB(vec3(origin.x + qmin[0][i] * scale.x, origin.y + qmin[1][i] * scale.y,
+                   origin.z + qmin[2][i] * scale.z),
+              vec3(origin.x + qmax[0][i] * scale.x, origin.y + qmax[1][i] * scale.y,
+                   origin.z + qmax[2][i] * scale.z));
+}
+
+template <typename IntersectPrim>
+bool BVH8::intersect(const vec3 &origin, const vec3 &dir, float &t_max,
+                     IntersectPrim intersect_prim) const {
+  if (nodes.empty()) {
+    return false;
+  }
+  vec3 inv_dir = safe_inverse(dir);
+  bool did_hit = false;
+
+  struct Entry {
+    GLuint node;
+    float t_enter;
+  };
+  Entry stack[128];
+  int stack_size = 0;
+  stack[stack_size++] = Entry{0, 0.0f};
+  while (stack_size > 0) {
+    Entry entry = stack[--stack_size];
+    if (entry.t_enter > t_max) {
+      continue;
+    }
+    const BVH8Node &node = nodes[entry.node];
+
+    // Child boxes are never decoded, the slab distances are computed straight
+    // from the quantized values: t = (origin - o) / d + q * scale / d
+    float ox = (node.origin.x - origin.x) * inv_dir.x;
+    float oy = (node.origin.y - origin.y) * inv_dir.y;
+    float oz = (node.origin.z - origin.z) * inv_dir.z;
+    float sx = grid_scale(node.exponent[0]) * inv_dir.x;
+    float sy = grid_scale(node.exponent[1]) * inv_dir.y;
+    float sz = grid_scale(node.exponent[2]) * inv_dir.z;
+
+    // Test all children against the ray, leaves are intersected right away
+    // while hit interior children are pushed far to near
+    Entry hits[8];
+    int num_hits = 0;
+    for (int i = 0; i < 8; i++) {
+      if (!node.slot_used(i)) {
+        continue;
+      }
+      float tx0 = ox + node.qmin[0][i] * sx, tx1 = ox + node.qmax[0][i] * sx;
+      float ty0 = oy + node.qmin[1][i] * sy, ty1 = oy + node.qmax[1][i] * sy;
+      float tz0 = oz + node.qmin[2][i] * sz, tz1 = oz + node.qmax[2][i] * sz;
+      float t_enter = std::max(std::max(std::min(tx0, tx1), std::min(ty0, ty1)),
+                               std::max(std::min(tz0, tz1), 0.0f));
+      float t_exit = std::min(std::min(std::max(tx0, tx1), std::max(ty0, ty1)),
+                              std::min(std::max(tz0, tz1), t_max));
+      if (t_enter > t_exit) {
+        continue;
+      }
+      if (node.slot_interior(i)) {
+        int j = num_hits++;
+        for (; j > 0 && hits[j - 1].t_enter < t_enter; j--) {
+          hits[j] = hits[j - 1];
+        }
+        hits[j] = Entry{node.child_index(i), t_enter};
+      } else {
+        GLuint first = node.leaf_first(i);
+        for (GLuint p = first; p < first + node.leaf_count(i); p++) {
+          did_hit |= intersect_prim(prim_indices[p], t_max);
+        }
+      }
+    }
+    for (int j = 0; j < num_hits; j++) {
+      stack[stack_size++] = hits[j];
+    }
+  }
+  return did_hit;
+}
@@ -0,0 +1,132 @@
+// Compares the plain binary BVH against the compressed 8-wide BVH on a random
+// sphere scene: memory footprint and single threaded closest hit Mrays/s. The
+// parallel builder is listed with the binary BVH it produces.
+//
+// Usage: bvh_bench.out [num_spheres] [num_rays]
+
+#include <chrono>
+#include <random>
+#include <stdio.h>
+#include <stdlib.h>
+#define MAIN
+#include "VectorUtils4.h"
+#include "bvh.h"
+#include "bvh8.h"
+
+struct BenchSphere {
+  vec3 center;
+  float radius;
+};
+
+static bool intersect_sphere(const BenchSphere &s, const vec3 &origin,
+                             const vec3 &dir, float &t_max) {
+  // Discriminant computed from the closest approach to the center, which
+  // avoids cancellation for small spheres far away from the ray origin
+  vec3 offs = s.center - origin;
+  float b = dot(dir, offs);
+  vec3 closest = offs - dir * b;
+  float discriminant = s.radius * s.radius - dot(closest, closest);
+  if (discriminant < 0.0f) {
+    return false;
+  }
+  float sqrtd = sqrtf(discriminant);
+  float t = b - sqrtd;
+  if (t <= 0.001f) {
+    t = b + sqrtd;
+  }
+  if (t <= 0.001f || t >= t_max) {
+    return false;
+  }
+  t_max = t;
+  return true;
+}
+
+template <typename Tree>
+static double trace_rays(const Tree &tree, const std::vector<BenchSphere> &spheres,
+                         const std::vector<vec3> &origins,
+                         const std::vector<vec3> &dirs, std::vector<float> &t_hit) {
+  auto start = std::chrono::steady_clock::now();
+  for (size_t r = 0; r < origins.size(); r++) {
+    float t_max = INFINITY;
+    tree.intersect(origins[r], dirs[r], t_max, [&](GLuint prim, float &t) {
+      return intersect_sphere(spheres[prim], origins[r], dirs[r], t);
+    });
+    t_hit[r] = t_max;
+  }
+  std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+  return elapsed.count();
+}
+
+int main(int argc, char *argv[]) {
+  size_t num_spheres = argc > 1 ? atol(argv[1]) : 1000000;
+  size_t num_rays = argc > 2 ? atol(argv[2]) : 1000000;
+
+  // Small spheres scattered in a thin slab, similar to a large particle scene
+  std::mt19937 rng(1234);
+  std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+  std::vector<BenchSphere> spheres(num_spheres);
+  std::vector<AABB> bounds(num_spheres);
+  for (size_t i = 0; i < num_spheres; i++) {
+    spheres[i].center = vec3(200.0f * uniform(rng) - 100.0f, 2.0f * uniform(rng),
+                             200.0f * uniform(rng) - 100.0f);
+    spheres[i].radius = 0.02f + 0.1f * uniform(rng);
+    vec3 r = vec3(spheres[i].radius);
+    bounds[i] = AABB(spheres[i].center - r, spheres[i].center + r);
+  }
+
+  // Rays from a camera above the slab, looking at random points on it
+  std::vector<vec3> origins(num_rays), dirs(num_rays);
+  for (size_t r = 0; r < num_rays; r++) {
+    origins[r] = vec3(0.0f, 100.0f, 150.0f);
+    vec3 target = vec3(200.0f * uniform(rng) - 100.0f, 0.0f,
+                       200.0f * uniform(rng) - 100.0f);
+    dirs[r] = normalize(target - origins[r]);
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  BVH bvh;
+  bvh.build(bounds);
+  std::chrono::duration<double> build_binary = std::chrono::steady_clock::now() - start;
+  start = std::chrono::steady_clock::now();
+  BVH8 bvh8;
+  bvh8.build(bvh);
+  std::chrono::duration<double> build_wide = std::chrono::steady_clock::now() - start;
+  start = std::chrono::steady_clock::now();
+  BVH bvh_parallel;
+  bvh_parallel.build_parallel(bounds);
+  std::chrono::duration<double> build_parallel = std::chrono::steady_clock::now() - start;
+
+  std::vector<float> t_binary(num_rays), t_wide(num_rays), t_parallel(num_rays);
+  double time_binary = trace_rays(bvh, spheres, origins, dirs, t_binary);
+  double time_wide = trace_rays(bvh8, spheres, origins, dirs, t_wide);
+  double time_parallel = trace_rays(bvh_parallel, spheres, origins, dirs, t_parallel);
+  size_t mismatches = 0, num_hits = 0;
+  for (size_t r = 0; r < num_rays; r++) {
+    mismatches += t_binary[r] != t_wide[r] || t_binary[r] != t_parallel[r];
+    num_hits += t_binary[r] < INFINITY;
+  }
+
+  size_t bytes_binary = bvh.nodes.size() * sizeof(BVHNode) +
+                        bvh.prim_indices.size() * sizeof(GLuint);
+  size_t bytes_parallel = bvh_parallel.nodes.size() * sizeof(BVHNode) +
+                          bvh_parallel.prim_indices.size() * sizeof(GLuint);
+  size_t bytes_wide = bvh8.nodes.size() * sizeof(BVH8Node) +
+                      bvh8.prim_indices.size() * sizeof(GLuint);
+  printf("%zu spheres, %zu rays, %.1f%% hit, %u build threads\n", num_spheres,
+         num_rays, 100.0 * num_hits / num_rays, ThreadPool::global().size());
+  printf("%-12s %10s %12s %10s %10s\n", "", "nodes", "memory (MB)", "build (s)",
+         "Mrays/s");
+  printf("%-12s %10zu %12.2f %10.3f %10.2f\n", "binary", bvh.nodes.size(),
+         bytes_binary / 1e6, build_binary.count(), num_rays / time_binary / 1e6);
+  printf("%-12s %10zu %12.2f %10.3f %10.2f\n", "parallel",
+         bvh_parallel.nodes.size(), bytes_parallel / 1e6, build_parallel.count(),
+         num_rays / time_parallel / 1e6);
+  printf("%-12s %10zu %12.2f %10.3f %10.2f\n", "8-wide quant", bvh8.nodes.size(),
+         bytes_wide / 1e6, build_binary.count() + build_wide.count(),
+         num_rays / time_wide / 1e6);
+  if (mismatches > 0) {
+    printf("WARNING: %zu rays got different hits\n", mismatches);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,81 @@
+#include "checkpoint.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <memory>
+#include <string>
+
+namespace {
+
+// Ends in a format version. The header and pixels are stored in the host's
+// byte order, checkpoints are not meant to move between machines.
+const char MAGIC[8] = {'R', 'T', 'C', 'K', 'P', 'T', '0', '2'};
+
+size_t pixel_floats(int width, int height) { return size_t(width) * height * 4; }
+
+} // namespace
+
+bool write_checkpoint(const char *filename, const Checkpoint &checkpoint) {
+  std::string tmp_name = std::string(filename) + ".tmp";
+  FILE *file = fopen(tmp_name.c_str(), "wb");
+  if (!file) {
+    fprintf(stderr, "Could not create %s\n", tmp_name.c_str());
+    return false;
+  }
+  int32_t header[3] = {checkpoint.width, checkpoint.height, checkpoint.samples};
+  size_t count = checkpoint.pixels.size();
+  bool ok = fwrite(MAGIC, 1, sizeof(MAGIC), file) == sizeof(MAGIC) &&
+            fwrite(header, sizeof(header), 1, file) == 1 &&
+            fwrite(checkpoint.pixels.data(), sizeof(float), count, file) == count;
+  ok = fclose(file) == 0 && ok;
+  if (!ok || rename(tmp_name.c_str(), filename) != 0) {
+    fprintf(stderr, "Could not write %s\n", filename);
+    remove(tmp_name.c_str());
+    return false;
+  }
+  return true;
+}
+
+bool read_checkpoint(const char *filename, Checkpoint &checkpoint) {
+  FILE *file = fopen(filename, "rb");
+  if (!file) {
+    fprintf(stderr, "Could not open %s\n", filename);
+    return false;
+  }
+  char magic[sizeof(MAGIC)];
+  int32_t header[3];
+  if (fread(magic, 1, sizeof(magic), file) != sizeof(magic) ||
+      memcmp(magic, MAGIC, sizeof(MAGIC)) != 0 ||
+      fread(header, sizeof(header), 1, file) != 1 || header[0] <= 0 ||
+      header[1] <= 0 || header[2] < 0) {
+    fprintf(stderr, "%s is not a checkpoint\n", filename);
+    fclose(file);
+    return false;
+  }
+  checkpoint.width = header[0];
+  checkpoint.height = header[1];
+  checkpoint.samples = header[2];
+  checkpoint.pixels.resize(pixel_floats(checkpoint.width, checkpoint.height));
+  size_t count = checkpoint.pixels.size();
+  bool ok = fread(checkpoint.pixels.data(), sizeof(float), count, file) == count;
+  fclose(file);
+  if (!ok) {
+    fprintf(stderr, "%s is truncated\n", filename);
+    return false;
+  }
+  return true;
+}
+
+void save_checkpoint_async(Readback *readback, AsyncWriter *writer,
+                           FBOstruct *accumulation, int samples,
+                           const char *filename) {
+  start_readback(readback, accumulation->fb, GL_COLOR_ATTACHMENT0,
+                 [=](Image &&image) {
+    std::shared_ptr<Checkpoint> checkpoint = std::make_shared<Checkpoint>();
+    checkpoint->width = image.width;
+    checkpoint->height = image.height;
+    checkpoint->samples = samples;
+    checkpoint->pixels = std::move(image.pixels);
+    queue_job(writer, [=] { write_checkpoint(filename, *checkpoint); });
+  });
+}
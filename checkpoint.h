@@ -0,0 +1,33 @@
+/*
+ * Checkpoints of the accumulation buffer, so a long render that dies can be
+ * resumed instead of starting over. The buffer is read back asynchronously and
+ * the file is written on a background thread, so checkpointing never stalls
+ * rendering. Files are written under a temporary name and renamed into place,
+ * so a crash while writing leaves the previous checkpoint intact.
+ */
+#pragma once
+#include <vector>
+#include "GL_utilities.h"
+#include "async_writer.h"
+#include "readback.h"
+
+struct Checkpoint {
+  int width = 0;
+  int height = 0;
+  int samples = 0; // Per pixel accumulated, where the RNG sequence continues
+  // RGBA per pixel, bottom row first, as held by the accumulation buffer: the
+  // mean radiance, which times samples is the radiance sum, and the mean
+  // squared luminance in alpha
+  std::vector<float> pixels;
+};
+
+// Both print why and return false on failure
+bool write_checkpoint(const char *filename, const Checkpoint &checkpoint);
+bool read_checkpoint(const char *filename, Checkpoint &checkpoint);
+
+// Reads the first colour attachment of accumulation, holding samples samples
+// per pixel, back through readback and writes it to filename on writer's
+// thread
+void save_checkpoint_async(Readback *readback, AsyncWriter *writer,
+                           FBOstruct *accumulation, int samples,
+                           const char *filename);
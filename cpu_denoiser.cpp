@@ -0,0 +1,190 @@
+#include "cpu_denoiser.h"
+#include <algorithm>
+#include <stdint.h>
+#include <string.h>
+
+namespace {
+
+// Rows per task
+const int BAND_HEIGHT = 16;
+
+// Keeps the relative colour distance finite for black pixels
+const float EPSILON = 1e-3f;
+
+// e^x for x <= 0, to about 1e-5 relative and flushing to zero below about
+// -87. Written without float compares or calls so loops using it vectorize.
+inline float fast_exp(float x) {
+  float y = x * 1.44269504f; // log2(e)
+  int32_t i = std::max(int32_t(y - 0.5f), -127);
+  float f = y - float(i); // In [-0.5, 0.5]
+  float p = 1.0f + f * (0.693147182f + f * (0.240226507f +
+                f * (0.0555041087f + f * (0.00961812911f + f * 0.00133335581f))));
+  int32_t bits = (i + 127) << 23;
+  float scale;
+  memcpy(&scale, &bits, sizeof(scale));
+  return p * scale;
+}
+
+// Copies channels [0, 3) of the rows [y0, y1) of image, extended by border
+// pixels on every side with clamping, into three planes of width
+// image.width + 2 * border
+void load_planes(const Image &image, int y0, int y1, int border, float *planes) {
+  int width = image.width + 2 * border;
+  size_t plane_size = size_t(width) * (y1 - y0 + 2 * border);
+  for (int y = y0 - border; y < y1 + border; y++) {
+    int sy = std::min(std::max(y, 0), image.height - 1);
+    for (int x = -border; x < image.width + border; x++) {
+      int sx = std::min(std::max(x, 0), image.width - 1);
+      const float *p = image.pixel(sx, sy);
+      size_t i = size_t(y - y0 + border) * width + (x + border);
+      for (int c = 0; c < 3; c++) {
+        planes[c * plane_size + i] = p[c];
+      }
+    }
+  }
+}
+
+void denoise_band(const Image &colour, const Image *albedo, const Image *normal,
+                  Image &out, const CPUDenoiseSettings &settings, int y0, int y1) {
+  const int r = settings.radius;
+  const int pr = settings.patch_radius;
+  const int border = r + pr;
+  const int width = colour.width;
+  const int band = y1 - y0;
+  const int padded_width = width + 2 * border;
+  const size_t plane_size = size_t(padded_width) * (band + 2 * border);
+
+  std::vector<float> c_planes(3 * plane_size), a_planes, n_planes;
+  load_planes(colour, y0, y1, border, c_planes.data());
+  if (albedo) {
+    a_planes.resize(3 * plane_size);
+    load_planes(*albedo, y0, y1, border, a_planes.data());
+  }
+  if (normal) {
+    n_planes.resize(3 * plane_size);
+    load_planes(*normal, y0, y1, border, n_planes.data());
+  }
+
+  // Per pixel patch distance terms, their horizontal sums, the exponent and
+  // then weight for one row, and the running weighted sums for the output
+  const int d_rows = band + 2 * pr;
+  const int d_width = width + 2 * pr;
+  std::vector<float> d(size_t(d_rows) * d_width), h(size_t(d_rows) * width), e(width);
+  std::vector<float> sum_w(size_t(band) * width, 0.0f);
+  std::vector<float> sum_c(3 * size_t(band) * width, 0.0f);
+
+  const float patch_norm =
+      1.0f / (3.0f * (2 * pr + 1) * (2 * pr + 1) * settings.strength * settings.strength);
+  const float albedo_norm = 1.0f / (settings.sigma_albedo * settings.sigma_albedo);
+  const float normal_norm = 1.0f / (settings.sigma_normal * settings.sigma_normal);
+
+  for (int dy = -r; dy <= r; dy++) {
+    for (int dx = -r; dx <= r; dx++) {
+      // Relative squared colour difference between p and p + offset, for
+      // every pixel the patches of the band touch
+      for (int row = 0; row < d_rows; row++) {
+        size_t p = size_t(row + r) * padded_width + r;
+        size_t q = p + ptrdiff_t(dy) * padded_width + dx;
+        float *d_row = &d[size_t(row) * d_width];
+        for (int c = 0; c < 3; c++) {
+          const float *cp = &c_planes[c * plane_size + p];
+          const float *cq = &c_planes[c * plane_size + q];
+          for (int x = 0; x < d_width; x++) {
+            float diff = cp[x] - cq[x];
+            float term = diff * diff / (EPSILON + cp[x] * cp[x] + cq[x] * cq[x]);
+            d_row[x] = c == 0 ? term : d_row[x] + term;
+          }
+        }
+      }
+
+      // Box filter over the patch, horizontally then vertically
+      for (int row = 0; row < d_rows; row++) {
+        const float *d_row = &d[size_t(row) * d_width];
+        float *h_row = &h[size_t(row) * width];
+        for (int x = 0; x < width; x++) {
+          h_row[x] = d_row[x];
+        }
+        for (int k = 1; k <= 2 * pr; k++) {
+          for (int x = 0; x < width; x++) {
+            h_row[x] += d_row[x + k];
+          }
+        }
+      }
+
+      // Turn the patch distances and guide differences into weights, one
+      // simple loop at a time so each of them vectorizes
+      for (int y = 0; y < band; y++) {
+        size_t p = size_t(y + border) * padded_width + border;
+        size_t q = p + ptrdiff_t(dy) * padded_width + dx;
+        for (int x = 0; x < width; x++) {
+          e[x] = 0.0f;
+        }
+        for (int k = 0; k <= 2 * pr; k++) {
+          const float *h_row = &h[size_t(y + k) * width];
+          for (int x = 0; x < width; x++) {
+            e[x] += h_row[x] * patch_norm;
+          }
+        }
+        for (int c = 0; c < 3 && albedo; c++) {
+          const float *ap = &a_planes[c * plane_size + p];
+          const float *aq = &a_planes[c * plane_size + q];
+          for (int x = 0; x < width; x++) {
+            float diff = ap[x] - aq[x];
+            e[x] += diff * diff * albedo_norm;
+          }
+        }
+        for (int c = 0; c < 3 && normal; c++) {
+          const float *np = &n_planes[c * plane_size + p];
+          const float *nq = &n_planes[c * plane_size + q];
+          for (int x = 0; x < width; x++) {
+            float diff = np[x] - nq[x];
+            e[x] += diff * diff * normal_norm;
+          }
+        }
+
+        float *w_row = &sum_w[size_t(y) * width];
+        for (int x = 0; x < width; x++) {
+          e[x] = fast_exp(-e[x]);
+          w_row[x] += e[x];
+        }
+        for (int c = 0; c < 3; c++) {
+          const float *cq = &c_planes[c * plane_size + q];
+          float *c_row = &sum_c[(c * size_t(band) + y) * width];
+          for (int x = 0; x < width; x++) {
+            c_row[x] += e[x] * cq[x];
+          }
+        }
+      }
+    }
+  }
+
+  // The centre pixel always has weight one, so sum_w is never zero
+  for (int y = 0; y < band; y++) {
+    for (int x = 0; x < width; x++) {
+      float *o = out.pixel(x, y0 + y);
+      float w = sum_w[size_t(y) * width + x];
+      for (int c = 0; c < 3; c++) {
+        o[c] = sum_c[(c * size_t(band) + y) * width + x] / w;
+      }
+      const float *src = colour.pixel(x, y0 + y);
+      for (int c = 3; c < colour.channels; c++) {
+        o[c] = src[c];
+      }
+    }
+  }
+}
+
+} // namespace
+
+void denoise_cpu(const Image &colour, const Image *albedo, const Image *normal,
+                 Image &out, const CPUDenoiseSettings &settings, ThreadPool &pool) {
+  out = Image(colour.width, colour.height, colour.channels);
+  int num_bands = (colour.height + BAND_HEIGHT - 1) / BAND_HEIGHT;
+  pool.parallel_for(num_bands, 1, [&](size_t begin, size_t end) {
+    for (size_t b = begin; b < end; b++) {
+      int y0 = b * BAND_HEIGHT;
+      int y1 = std::min(y0 + BAND_HEIGHT, colour.height);
+      denoise_band(colour, albedo, normal, out, settings, y0, y1);
+    }
+  });
+}
@@ -0,0 +1,28 @@
+/*
+ * Denoiser for renders on machines without a GPU. It is a joint non-local
+ * means filter: every pixel is replaced by a weighted average of the pixels
+ * in a window around it, weighted by how similar the small patches of noisy
+ * colour around both are, and by how similar their albedo and normal are.
+ * The work is split into bands of rows on the thread pool, and the inner
+ * loops run over whole rows of planar data so the compiler can vectorize
+ * them.
+ */
+#pragma once
+#include "image.h"
+#include "thread_pool.h"
+
+struct CPUDenoiseSettings {
+  int radius = 7;            // The window is (2 * radius + 1)^2 pixels
+  int patch_radius = 1;      // Patches are (2 * patch_radius + 1)^2 pixels
+  float strength = 0.5f;     // Larger values average over less similar patches
+  float sigma_albedo = 0.1f; // Tolerated albedo and normal differences
+  float sigma_normal = 0.3f;
+};
+
+// Filters the first three channels of colour, which holds linear radiance
+// and must have at least three channels.
+// albedo and normal are images of the same size with at least three channels,
+// or NULL. out gets colour's channel count, extra channels are copied as is.
+void denoise_cpu(const Image &colour, const Image *albedo, const Image *normal,
+                 Image &out, const CPUDenoiseSettings &settings = CPUDenoiseSettings(),
+                 ThreadPool &pool = ThreadPool::global());
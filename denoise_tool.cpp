@@ -0,0 +1,62 @@
+// Denoises a render on the CPU, for batch machines without a GPU.
+//
+// Usage: denoise_tool.out [-r radius] [-s strength] colour.pfm out.pfm
+//                         [albedo.pfm [normal.pfm]]
+
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cpu_denoiser.h"
+
+static bool same_size(const Image &a, const Image &b, const char *name) {
+  if (a.width != b.width || a.height != b.height || b.channels < 3) {
+    fprintf(stderr, "%s must be an RGB image the size of the colour image\n", name);
+    return false;
+  }
+  return true;
+}
+
+int main(int argc, char *argv[]) {
+  CPUDenoiseSettings settings;
+  const char *files[4] = {NULL, NULL, NULL, NULL};
+  int num_files = 0;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+      settings.radius = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+      settings.strength = atof(argv[++i]);
+    } else if (num_files < 4) {
+      files[num_files++] = argv[i];
+    }
+  }
+  if (num_files < 2) {
+    fprintf(stderr, "Usage: %s [-r radius] [-s strength] colour.pfm out.{pfm,exr,png} "
+                    "[albedo.pfm [normal.pfm]]\n", argv[0]);
+    return 1;
+  }
+
+  Image colour, albedo, normal;
+  if (!read_pfm(files[0], colour)) {
+    return 1;
+  }
+  if (colour.channels < 3) {
+    fprintf(stderr, "%s must be an RGB image\n", files[0]);
+    return 1;
+  }
+  if (files[2] && (!read_pfm(files[2], albedo) || !same_size(colour, albedo, files[2]))) {
+    return 1;
+  }
+  if (files[3] && (!read_pfm(files[3], normal) || !same_size(colour, normal, files[3]))) {
+    return 1;
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  Image out;
+  denoise_cpu(colour, files[2] ? &albedo : NULL, files[3] ? &normal : NULL, out,
+              settings);
+  std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+  printf("Denoised %dx%d in %.3f s on %u threads\n", colour.width, colour.height,
+         elapsed.count(), ThreadPool::global().size());
+  return write_image(files[1], out) ? 0 : 1;
+}
@@ -0,0 +1,89 @@
+#include "denoiser.h"
+#include <stdlib.h>
+
+namespace {
+
+GLuint create_guide_texture(int width, int height) {
+  GLuint tex;
+  glGenTextures(1, &tex);
+  glBindTexture(GL_TEXTURE_2D, tex);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, width, height, 0, GL_RGBA, GL_FLOAT,
+               NULL);
+  glBindTexture(GL_TEXTURE_2D, 0);
+  return tex;
+}
+
+void bind_texture(GLuint program, const char *name, GLint unit, GLuint tex) {
+  glActiveTexture(GL_TEXTURE0 + unit);
+  glBindTexture(GL_TEXTURE_2D, tex);
+  glUniform1i(glGetUniformLocation(program, name), unit);
+}
+
+} // namespace
+
+Denoiser *create_denoiser(int width, int height, int iterations) {
+  Denoiser *denoiser = new Denoiser();
+  denoiser->program = loadShaders("shader.vert", "atrous.frag");
+  denoiser->ping_pong[0] = initFBO(width, height, 0);
+  denoiser->ping_pong[1] = initFBO(width, height, 0);
+  denoiser->iterations = iterations;
+  denoiser->enabled = true;
+  return denoiser;
+}
+
+void dispose_denoiser(Denoiser *denoiser) {
+  for (FBOstruct *fbo : denoiser->ping_pong) {
+    glDeleteFramebuffers(1, &fbo->fb);
+    glDeleteRenderbuffers(1, &fbo->rb);
+    glDeleteTextures(1, &fbo->texid);
+    free(fbo);
+  }
+  glDeleteProgram(denoiser->program);
+  delete denoiser;
+}
+
+void attach_guide_buffers(FBOstruct *fbo, GLuint *normal_depth, GLuint *albedo) {
+  *normal_depth = create_guide_texture(fbo->width, fbo->height);
+  *albedo = create_guide_texture(fbo->width, fbo->height);
+  glBindFramebuffer(GL_FRAMEBUFFER, fbo->fb);
+  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D,
+                         *normal_depth, 0);
+  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT2, GL_TEXTURE_2D,
+                         *albedo, 0);
+  const GLenum draw_buffers[] = {GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1,
+                                 GL_COLOR_ATTACHMENT2};
+  glDrawBuffers(3, draw_buffers);
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+  printError("attach guide buffers");
+}
+
+FBOstruct *denoise(Denoiser *denoiser, GLuint colour, GLuint normal_depth,
+                   GLuint albedo, int sample_count, Model *quad) {
+  GLuint program = denoiser->program;
+  denoiser->timer.begin();
+  glUseProgram(program);
+  glUniform1f(glGetUniformLocation(program, "SAMPLE_COUNT"),
+              sample_count > 0 ? sample_count : 1);
+
+  FBOstruct *out = NULL;
+  GLuint in = colour;
+  for (int i = 0; i < denoiser->iterations; i++) {
+    out = denoiser->ping_pong[i % 2];
+    useFBO(out, NULL, NULL);
+    bind_texture(program, "COLOUR", 0, in);
+    bind_texture(program, "NORMAL_DEPTH", 1, normal_depth);
+    bind_texture(program, "ALBEDO", 2, albedo);
+    glUniform1i(glGetUniformLocation(program, "STEP"), 1 << i);
+    glUniform1i(glGetUniformLocation(program, "DEMODULATE"), i == 0);
+    glUniform1i(glGetUniformLocation(program, "REMODULATE"),
+                i == denoiser->iterations - 1);
+    DrawModel(quad, program, "in_position", NULL, NULL);
+    in = out->texid;
+  }
+  glActiveTexture(GL_TEXTURE0);
+  denoiser->timer.end();
+  printError("denoise");
+  return out;
+}
@@ -0,0 +1,34 @@
+/*
+ * Edge-avoiding à-trous wavelet denoiser in the style of SVGF, run between
+ * accumulation and presentation. The trace pass writes first-hit normal, view
+ * depth and albedo as extra colour attachments, which steer the filter away
+ * from geometric edges. Each of the iterations in atrous.frag doubles the tap
+ * spacing, so five of them cover a 61x61 pixel footprint with only 25 taps
+ * each.
+ */
+#pragma once
+#include "GL_utilities.h"
+#include "LittleOBJLoader.h"
+#include "gpu_timer.h"
+
+struct Denoiser {
+  GLuint program;
+  FBOstruct *ping_pong[2];
+  int iterations;
+  bool enabled;
+  GPUTimer timer; // GPU time of all iterations together
+};
+
+// iterations must be at least one
+Denoiser *create_denoiser(int width, int height, int iterations = 5);
+void dispose_denoiser(Denoiser *denoiser);
+
+// Adds RGBA32F textures for the first-hit normal and depth, and albedo, to
+// fbo as colour attachments 1 and 2, and makes it draw to all three
+void attach_guide_buffers(FBOstruct *fbo, GLuint *normal_depth, GLuint *albedo);
+
+// Filters the radiance in colour, the mean of sample_count samples per pixel
+// with the mean squared luminance of the samples in alpha. quad is the screen
+// covering model. Returns the FBO that holds the result.
+FBOstruct *denoise(Denoiser *denoiser, GLuint colour, GLuint normal_depth,
+                   GLuint albedo, int sample_count, Model *quad);
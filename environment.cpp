@@ -0,0 +1,115 @@
+#include "environment.h"
+#include <algorithm>
+#include <math.h>
+#include <stdio.h>
+#include <vector>
+#include "image.h"
+
+namespace {
+
+// Entries of threshold, alias and relative probability per weight, four
+// floats each as laid out in environment.h
+std::vector<float> build_alias_table(const std::vector<double> &weights) {
+  size_t n = weights.size();
+  double total = 0.0;
+  for (double w : weights) {
+    total += w;
+  }
+  // Probabilities times n, so the average is 1. A black map is sampled
+  // uniformly.
+  std::vector<double> scaled(n, 1.0);
+  if (total > 0.0) {
+    for (size_t i = 0; i < n; i++) {
+      scaled[i] = weights[i] * n / total;
+    }
+  }
+  std::vector<float> table(4 * n);
+  std::vector<size_t> small, large;
+  for (size_t i = 0; i < n; i++) {
+    table[4 * i] = 1.0f;
+    table[4 * i + 1] = float(i);
+    table[4 * i + 2] = float(scaled[i]);
+    (scaled[i] < 1.0 ? small : large).push_back(i);
+  }
+
+  // Each entry below average is topped up by one above it, which then counts
+  // as below average itself once it has given away enough. Whatever is left
+  // at the end is 1 up to rounding and keeps a threshold of 1.
+  std::vector<double> remaining = scaled;
+  while (!small.empty() && !large.empty()) {
+    size_t s = small.back(), l = large.back();
+    small.pop_back();
+    table[4 * s] = float(remaining[s]);
+    table[4 * s + 1] = float(l);
+    remaining[l] -= 1.0 - remaining[s];
+    if (remaining[l] < 1.0) {
+      large.pop_back();
+      small.push_back(l);
+    }
+  }
+  return table;
+}
+
+GLuint create_texture(GLenum internal_format, int width, int height,
+                      GLenum format, const float *data, GLint filter) {
+  GLuint tex;
+  glGenTextures(1, &tex);
+  glBindTexture(GL_TEXTURE_2D, tex);
+  glTexImage2D(GL_TEXTURE_2D, 0, internal_format, width, height, 0, format,
+               GL_FLOAT, data);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, filter);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, filter);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+  glBindTexture(GL_TEXTURE_2D, 0);
+  return tex;
+}
+
+} // namespace
+
+Environment *load_environment(const char *filename) {
+  Image image;
+  bool ok = has_extension(filename, ".hdr") ? read_hdr(filename, image)
+                                            : read_pfm(filename, image);
+  if (!ok) {
+    return nullptr;
+  }
+  if (image.channels == 1) {
+    Image grey = image;
+    image = Image(grey.width, grey.height, 3);
+    for (size_t i = 0; i < grey.pixels.size(); i++) {
+      image.pixels[3 * i] = image.pixels[3 * i + 1] = image.pixels[3 * i + 2] =
+          grey.pixels[i];
+    }
+  }
+
+  // A texel's solid angle is proportional to the sine of its polar angle,
+  // which shrinks the rows towards the poles
+  int width = image.width, height = image.height;
+  std::vector<double> weights(size_t(width) * height);
+  for (int y = 0; y < height; y++) {
+    double sin_theta = sin(M_PI * (y + 0.5) / height);
+    for (int x = 0; x < width; x++) {
+      const float *p = image.pixel(x, y);
+      double luminance = 0.2126 * p[0] + 0.7152 * p[1] + 0.0722 * p[2];
+      weights[size_t(y) * width + x] = std::max(luminance, 0.0) * sin_theta;
+    }
+  }
+  std::vector<float> table = build_alias_table(weights);
+
+  Environment *environment = new Environment();
+  environment->width = width;
+  environment->height = height;
+  environment->radiance_tex = create_texture(GL_RGB32F, width, height, GL_RGB,
+                                             image.pixels.data(), GL_LINEAR);
+  environment->sampling_tex = create_texture(GL_RGBA32F, width, height, GL_RGBA,
+                                             table.data(), GL_NEAREST);
+  printError("upload environment");
+  return environment;
+}
+
+void dispose_environment(Environment *environment) {
+  glDeleteTextures(1, &environment->radiance_tex);
+  glDeleteTextures(1, &environment->sampling_tex);
+  delete environment;
+}
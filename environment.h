@@ -0,0 +1,29 @@
+/*
+ * HDR environment lighting from a lat-long map, read from a PFM or Radiance
+ * HDR file. The top row of the map is straight up (+y) and the middle column
+ * looks along +x.
+ *
+ * For importance sampling, every texel gets a probability proportional to its
+ * luminance times the solid angle it covers. Those probabilities go into an
+ * alias table (Walker's method, built with Vose's algorithm), so the tracer
+ * draws a texel in constant time with a single lookup and then a direction
+ * within it. The table is a texture the size of the map. Texel i, counted
+ * row by row from the bottom, holds:
+ *   r  the chance of keeping texel i rather than its alias
+ *   g  the index of the alias, exact in a float up to 2^24 texels
+ *   b  the probability of texel i times the texel count, which tracer.frag
+ *      turns into a density over solid angle
+ */
+#pragma once
+#include "GL_utilities.h"
+
+struct Environment {
+  int width;
+  int height;
+  GLuint radiance_tex; // RGB radiance, linearly filtered
+  GLuint sampling_tex; // The alias table
+};
+
+// Prints why and returns nullptr if the map can not be read
+Environment *load_environment(const char *filename);
+void dispose_environment(Environment *environment);
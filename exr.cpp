@@ -0,0 +1,232 @@
+#include "exr.h"
+#include <algorithm>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <zlib.h>
+
+namespace {
+
+const int PIXEL_TYPE_HALF = 1;
+const int PIXEL_TYPE_FLOAT = 2;
+
+// Rounds to nearest even, overflowing to infinity like a float conversion
+uint16_t float_to_half(float f) {
+  uint32_t x;
+  memcpy(&x, &f, 4);
+  uint16_t sign = (x >> 16) & 0x8000;
+  uint32_t abs = x & 0x7fffffff;
+  if (abs > 0x7f800000) {
+    return sign | 0x7e00; // NaN
+  }
+  if (abs >= 0x477ff000) {
+    return sign | 0x7c00; // Rounds to more than the largest half, 65504
+  }
+  if (abs < 0x38800000) {
+    // Below the smallest normal half, counted in steps of 2^-24. The product
+    // is exact, and a result of 1024 is the smallest normal half as it should.
+    float a;
+    memcpy(&a, &abs, 4);
+    return sign | (uint16_t)nearbyintf(a * 16777216.0f);
+  }
+  // Rebias the exponent from 127 to 15 and round away the low 13 bits
+  return sign | (uint16_t)((abs - 0x38000000 + 0x0fff + ((abs >> 13) & 1)) >> 13);
+}
+
+struct ByteWriter {
+  std::vector<unsigned char> bytes;
+
+  void u8(unsigned char v) { bytes.push_back(v); }
+  void u32(uint32_t v) {
+    for (int i = 0; i < 4; i++) {
+      bytes.push_back((v >> (8 * i)) & 0xff);
+    }
+  }
+  void u64(uint64_t v) {
+    for (int i = 0; i < 8; i++) {
+      bytes.push_back((v >> (8 * i)) & 0xff);
+    }
+  }
+  void f32(float v) {
+    uint32_t x;
+    memcpy(&x, &v, 4);
+    u32(x);
+  }
+  void str(const std::string &s) {
+    bytes.insert(bytes.end(), s.begin(), s.end());
+    bytes.push_back(0);
+  }
+  void attribute(const char *name, const char *type, uint32_t size) {
+    str(name);
+    str(type);
+    u32(size);
+  }
+};
+
+int scanlines_per_block(ExrCompression compression) {
+  return compression == ExrCompression::ZIP ? 16 : 1;
+}
+
+// Scanlines y0 up to y1, counted from the top, each holding every channel in
+// turn, as stored in a block before compression
+std::vector<unsigned char> pack_block(const std::vector<ExrChannel> &channels,
+                                      int width, int height, int y0, int y1) {
+  ByteWriter out;
+  for (int y = y0; y < y1; y++) {
+    int row = height - 1 - y; // Images are stored bottom row first
+    for (const ExrChannel &channel : channels) {
+      const Image &image = *channel.image;
+      for (int x = 0; x < width; x++) {
+        float v = image.pixel(x, row)[channel.source_channel];
+        if (channel.half) {
+          uint16_t h = float_to_half(v);
+          out.u8(h & 0xff);
+          out.u8(h >> 8);
+        } else {
+          out.f32(v);
+        }
+      }
+    }
+  }
+  return out.bytes;
+}
+
+// EXR's ZIP scheme: the bytes are split into even and odd halves and delta
+// encoded before deflating, which makes smooth half and float data compress
+// much better. Raw data is kept if compression does not help.
+std::vector<unsigned char> zip_block(const std::vector<unsigned char> &raw) {
+  size_t n = raw.size();
+  std::vector<unsigned char> tmp(n);
+  size_t half = (n + 1) / 2;
+  for (size_t i = 0; i < n; i++) {
+    tmp[(i % 2 == 0 ? 0 : half) + i / 2] = raw[i];
+  }
+  for (size_t i = n - 1; i > 0; i--) {
+    tmp[i] = (unsigned char)(int(tmp[i]) - int(tmp[i - 1]) + 128);
+  }
+
+  uLongf size = compressBound(n);
+  std::vector<unsigned char> compressed(size);
+  if (compress2(compressed.data(), &size, tmp.data(), n, 4) != Z_OK || size >= n) {
+    return raw;
+  }
+  compressed.resize(size);
+  return compressed;
+}
+
+} // namespace
+
+bool write_exr(const char *filename, const std::vector<ExrChannel> &channels,
+               ExrCompression compression, ThreadPool &pool) {
+  if (channels.empty()) {
+    fprintf(stderr, "No channels to write to %s\n", filename);
+    return false;
+  }
+  int width = channels[0].image->width, height = channels[0].image->height;
+  for (const ExrChannel &channel : channels) {
+    if (channel.image->width != width || channel.image->height != height ||
+        channel.source_channel >= channel.image->channels) {
+      fprintf(stderr, "Channel %s does not fit in %s\n", channel.name.c_str(),
+              filename);
+      return false;
+    }
+  }
+
+  // Readers expect the channels sorted by name, both in the header and in the
+  // pixel data
+  std::vector<ExrChannel> sorted = channels;
+  std::sort(sorted.begin(), sorted.end(),
+            [](const ExrChannel &a, const ExrChannel &b) { return a.name < b.name; });
+
+  ByteWriter header;
+  header.u32(20000630); // Magic number
+  header.u32(2);        // Version 2, single part scanline file
+
+  uint32_t channel_list_size = 1;
+  for (const ExrChannel &channel : sorted) {
+    channel_list_size += channel.name.size() + 1 + 16;
+  }
+  header.attribute("channels", "chlist", channel_list_size);
+  for (const ExrChannel &channel : sorted) {
+    header.str(channel.name);
+    header.u32(channel.half ? PIXEL_TYPE_HALF : PIXEL_TYPE_FLOAT);
+    header.u32(0); // Not perceptually linear, and three reserved bytes
+    header.u32(1); // No subsampling in x or y
+    header.u32(1);
+  }
+  header.u8(0);
+  header.attribute("compression", "compression", 1);
+  header.u8(compression == ExrCompression::ZIP ? 3 : 0);
+  for (const char *window : {"dataWindow", "displayWindow"}) {
+    header.attribute(window, "box2i", 16);
+    header.u32(0);
+    header.u32(0);
+    header.u32(width - 1);
+    header.u32(height - 1);
+  }
+  header.attribute("lineOrder", "lineOrder", 1);
+  header.u8(0); // Increasing y, top row first
+  header.attribute("pixelAspectRatio", "float", 4);
+  header.f32(1.0f);
+  header.attribute("screenWindowCenter", "v2f", 8);
+  header.f32(0.0f);
+  header.f32(0.0f);
+  header.attribute("screenWindowWidth", "float", 4);
+  header.f32(1.0f);
+  header.u8(0); // End of header
+
+  // Each block is converted and compressed on its own
+  int lines = scanlines_per_block(compression);
+  int num_blocks = (height + lines - 1) / lines;
+  std::vector<std::vector<unsigned char>> blocks(num_blocks);
+  pool.parallel_for(num_blocks, 1, [&](size_t begin, size_t end) {
+    for (size_t b = begin; b < end; b++) {
+      int y0 = b * lines, y1 = std::min(height, y0 + lines);
+      blocks[b] = pack_block(sorted, width, height, y0, y1);
+      if (compression == ExrCompression::ZIP) {
+        blocks[b] = zip_block(blocks[b]);
+      }
+    }
+  });
+
+  // The offset table gives the file position of every block, each of which
+  // starts with its first scanline and its size
+  uint64_t offset = header.bytes.size() + 8 * uint64_t(num_blocks);
+  for (const std::vector<unsigned char> &block : blocks) {
+    header.u64(offset);
+    offset += 8 + block.size();
+  }
+
+  FILE *file = fopen(filename, "wb");
+  if (!file) {
+    fprintf(stderr, "Could not create %s\n", filename);
+    return false;
+  }
+  bool ok = fwrite(header.bytes.data(), 1, header.bytes.size(), file) ==
+            header.bytes.size();
+  for (int b = 0; b < num_blocks && ok; b++) {
+    ByteWriter prefix;
+    prefix.u32(b * lines);
+    prefix.u32(blocks[b].size());
+    ok = fwrite(prefix.bytes.data(), 1, 8, file) == 8 &&
+         fwrite(blocks[b].data(), 1, blocks[b].size(), file) == blocks[b].size();
+  }
+  ok = fclose(file) == 0 && ok;
+  if (!ok) {
+    fprintf(stderr, "Could not write %s\n", filename);
+  }
+  return ok;
+}
+
+bool write_exr(const char *filename, const Image &image, bool half,
+               ExrCompression compression, ThreadPool &pool) {
+  const char *names[4][4] = {
+      {"Y"}, {"Y", "A"}, {"R", "G", "B"}, {"R", "G", "B", "A"}};
+  int count = std::min(std::max(image.channels, 1), 4);
+  std::vector<ExrChannel> channels;
+  for (int c = 0; c < count; c++) {
+    channels.push_back({names[count - 1][c], &image, c, half});
+  }
+  return write_exr(filename, channels, compression, pool);
+}
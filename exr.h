@@ -0,0 +1,37 @@
+/*
+ * Writing OpenEXR files, so the HDR radiance and the guide buffers can be
+ * taken into compositing tools. Files are single part scanline images. Extra
+ * layers such as albedo or depth are stored the usual way, as channels named
+ * "layer.channel" next to the plain R, G and B of the main image. Scanline
+ * blocks are converted and compressed in parallel.
+ */
+#pragma once
+#include <string>
+#include <vector>
+#include "image.h"
+#include "thread_pool.h"
+
+enum class ExrCompression {
+  NONE, // One scanline per block
+  ZIP,  // zlib over blocks of 16 scanlines, the usual choice for renders
+};
+
+// One channel of the file, taken from channel source_channel of image. Half
+// floats are plenty for colour but not for depth or sample counts.
+struct ExrChannel {
+  std::string name;
+  const Image *image;
+  int source_channel;
+  bool half;
+};
+
+// Every image must have the same size. Channels may come in any order.
+// Prints why and returns false on failure.
+bool write_exr(const char *filename, const std::vector<ExrChannel> &channels,
+               ExrCompression compression = ExrCompression::ZIP,
+               ThreadPool &pool = ThreadPool::global());
+
+// Writes the channels of image as Y, YA, RGB or RGBA
+bool write_exr(const char *filename, const Image &image, bool half = true,
+               ExrCompression compression = ExrCompression::ZIP,
+               ThreadPool &pool = ThreadPool::global());
@@ -0,0 +1,71 @@
+#include "frame_budget.h"
+#include <algorithm>
+
+namespace {
+
+// Weight of a new measurement in the cost estimate. Frame times jitter, so
+// a few are averaged, but a change of view is followed within a few frames.
+const float SMOOTHING = 0.3f;
+
+// Tiles are powers of two between these sizes. Below the smallest the
+// overhead of a draw starts to dominate.
+const int MIN_TILE_SIZE = 32;
+const int MAX_TILE_SIZE = 4096;
+
+// Tiles differ in cost, sky being cheap and glass expensive, so they are
+// sized as if each cost this many times the average
+const float MAX_DRAW_MARGIN = 2.0f;
+
+// Picks the largest tile expected to be traced within max_draw_ms
+int choose_tile_size(const FrameBudget &budget) {
+  if (budget.fixed_tile_size > 0) {
+    return budget.fixed_tile_size;
+  }
+  float draw_ms = MAX_DRAW_MARGIN * budget.samples * budget.ms_per_sample;
+  if (draw_ms <= budget.max_draw_ms) {
+    return 0;
+  }
+  float pixels = (float)budget.width * budget.height * budget.max_draw_ms / draw_ms;
+  int size = MAX_TILE_SIZE;
+  while (size > MIN_TILE_SIZE && (float)size * size > pixels) {
+    size /= 2;
+  }
+  return size;
+}
+
+} // namespace
+
+FrameBudget create_frame_budget(int width, int height, float target_ms,
+                                float max_draw_ms, int max_samples) {
+  FrameBudget budget;
+  budget.width = width;
+  budget.height = height;
+  budget.target_ms = target_ms;
+  budget.max_draw_ms = max_draw_ms;
+  budget.max_samples = max_samples;
+  return budget;
+}
+
+void update_frame_budget(FrameBudget &budget, const GPUTimer &timer) {
+  if (timer.measurements == budget.measurements_seen) {
+    return;
+  }
+  budget.measurements_seen = timer.measurements;
+  if (timer.measured_work <= 0 || timer.ms <= 0.0f) {
+    return;
+  }
+  float measured = timer.ms / timer.measured_work;
+  budget.ms_per_sample = budget.ms_per_sample > 0.0f
+                             ? budget.ms_per_sample +
+                                   SMOOTHING * (measured - budget.ms_per_sample)
+                             : measured;
+
+  // Grow at most twofold per measurement, as the estimate may lag behind a
+  // view that just got more expensive. Shrinking happens at once.
+  int wanted = (int)(budget.target_ms / budget.ms_per_sample);
+  int most = std::min(budget.max_samples, 2 * budget.samples);
+  budget.samples = budget.fixed_samples > 0
+                       ? budget.fixed_samples
+                       : std::max(1, std::min(wanted, most));
+  budget.tile_size = choose_tile_size(budget);
+}
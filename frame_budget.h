@@ -0,0 +1,34 @@
+/*
+ * Adapts the number of samples traced per frame to a frame time budget, so a
+ * slow GPU keeps the window responsive and a fast one is not left idle. The
+ * cost of a sample is learnt from GPU timer measurements of the trace pass.
+ * As drivers reset the GPU when a single draw runs for too long, and a long
+ * draw also keeps the desktop from updating, the screen is split into square
+ * scissored tiles drawn one at a time once a full screen draw would take more
+ * than max_draw_ms. The tile size is tuned from the measured time per pixel
+ * and sample, or can be fixed.
+ */
+#pragma once
+#include "gpu_timer.h"
+
+struct FrameBudget {
+  int width, height;        // Of the traced image
+  float target_ms;          // GPU time to aim a trace pass at, may be changed
+  float max_draw_ms;        // Longest a single draw is allowed to take
+  int max_samples;          // Per pixel and frame
+  int fixed_samples = 0;    // Used instead of adapting the samples if set
+  int fixed_tile_size = 0;  // Used instead of tuning the tile size if set
+  float ms_per_sample = 0;  // Of the whole image, 0 until first measured
+  int samples = 1;          // To trace in the next pass
+  int tile_size = 0;        // Tile side in pixels, 0 to draw in one go
+  int measurements_seen = 0;
+};
+
+FrameBudget create_frame_budget(int width, int height, float target_ms,
+                                float max_draw_ms = 250.0f,
+                                int max_samples = 256);
+
+// Takes in a new measurement from timer, whose work is the sample count it
+// timed, and picks samples and the tile size for the next pass. Does nothing if timer
+// has no measurement that has not been seen before.
+void update_frame_budget(FrameBudget &budget, const GPUTimer &timer);
@@ -0,0 +1,67 @@
+/*
+ * Measures how long a span of GL commands takes on the GPU with
+ * GL_TIME_ELAPSED queries. A ring of queries is used in turn, and a result is
+ * only read once it is available, so timing does not stall the pipeline. Only
+ * when the GPU is so far behind that every query is still in flight does
+ * begin() wait for the oldest, rather than restart it and lose its result.
+ * The time reported therefore lags a frame or so behind, and each measurement
+ * comes with the amount of work it was started with so it can be related to
+ * what it timed.
+ */
+#pragma once
+#include <GL/gl.h>
+#include <GL/glext.h>
+
+struct GPUTimer {
+  static const int QUERY_COUNT = 4;
+  GLuint queries[QUERY_COUNT] = {};
+  bool pending[QUERY_COUNT] = {};
+  int work[QUERY_COUNT] = {};
+  int current = 0;       // The next query to start, the oldest in flight
+  float ms = 0.0f;       // Latest finished measurement
+  int measured_work = 0; // The work passed to begin() for it
+  int measurements = 0;  // Finished so far
+
+  void begin(int amount = 0) {
+    if (queries[0] == 0) {
+      glGenQueries(QUERY_COUNT, queries);
+    }
+    collect();
+    if (pending[current]) {
+      read(current);
+    }
+    work[current] = amount;
+    glBeginQuery(GL_TIME_ELAPSED, queries[current]);
+  }
+
+  void end() {
+    glEndQuery(GL_TIME_ELAPSED);
+    pending[current] = true;
+    current = (current + 1) % QUERY_COUNT;
+  }
+
+  // Picks up results that have become available since the last call, oldest
+  // first
+  void collect() {
+    for (int i = 0; i < QUERY_COUNT; i++) {
+      int q = (current + i) % QUERY_COUNT;
+      GLint available = 0;
+      if (pending[q]) {
+        glGetQueryObjectiv(queries[q], GL_QUERY_RESULT_AVAILABLE, &available);
+      }
+      if (available) {
+        read(q);
+      }
+    }
+  }
+
+  // Takes the result of query q, waiting for it if need be
+  void read(int q) {
+    GLuint64 ns;
+    glGetQueryObjectui64v(queries[q], GL_QUERY_RESULT, &ns);
+    ms = ns / 1e6f;
+    measured_work = work[q];
+    measurements++;
+    pending[q] = false;
+  }
+};
@@ -0,0 +1,310 @@
+#include "image.h"
+#include "exr.h"
+#include <algorithm>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <zlib.h>
+
+namespace {
+
+bool host_is_little_endian() {
+  uint16_t one = 1;
+  unsigned char first;
+  memcpy(&first, &one, 1);
+  return first == 1;
+}
+
+void swap_bytes(float *values, size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    unsigned char b[4];
+    memcpy(b, &values[i], 4);
+    unsigned char swapped[4] = {b[3], b[2], b[1], b[0]};
+    memcpy(&values[i], swapped, 4);
+  }
+}
+
+// Converts to 8 bit, rows top down, with 1, 3 or 4 channels
+std::vector<unsigned char> to_bytes(const Image &image, int &out_channels) {
+  out_channels = image.channels == 1 ? 1 : image.channels == 4 ? 4 : 3;
+  std::vector<unsigned char> bytes(size_t(image.width) * image.height * out_channels);
+  unsigned char *out = bytes.data();
+  for (int y = image.height - 1; y >= 0; y--) {
+    for (int x = 0; x < image.width; x++) {
+      const float *p = image.pixel(x, y);
+      for (int c = 0; c < out_channels; c++) {
+        float v = c < image.channels ? p[c] : 0.0f;
+        *out++ = (unsigned char)(std::min(std::max(v, 0.0f), 1.0f) * 255.0f + 0.5f);
+      }
+    }
+  }
+  return bytes;
+}
+
+void put_u32_be(unsigned char *p, uint32_t v) {
+  p[0] = v >> 24;
+  p[1] = v >> 16;
+  p[2] = v >> 8;
+  p[3] = v;
+}
+
+bool write_png_chunk(FILE *file, const char *type, const unsigned char *data,
+                     uint32_t size) {
+  unsigned char length[4], crc[4];
+  put_u32_be(length, size);
+  uLong sum = crc32(0, (const Bytef *)type, 4);
+  sum = crc32(sum, data, size);
+  put_u32_be(crc, sum);
+  return fwrite(length, 4, 1, file) == 1 && fwrite(type, 4, 1, file) == 1 &&
+         fwrite(data, 1, size, file) == size && fwrite(crc, 4, 1, file) == 1;
+}
+
+// Reads one scanline of RGBE pixels, run-length encoded or flat
+bool read_rgbe_scanline(FILE *file, unsigned char *rgbe, int width) {
+  unsigned char head[4];
+  if (fread(head, 1, 4, file) != 4) {
+    return false;
+  }
+  if (width < 8 || width > 0x7fff || head[0] != 2 || head[1] != 2 ||
+      (head[2] & 0x80)) {
+    memcpy(rgbe, head, 4);
+    return fread(rgbe + 4, 4, width - 1, file) == size_t(width - 1);
+  }
+  if ((head[2] << 8 | head[3]) != width) {
+    return false;
+  }
+  // Each of the four components in turn, as runs of one value or literals
+  for (int c = 0; c < 4; c++) {
+    for (int x = 0; x < width;) {
+      int count = fgetc(file);
+      bool run = count > 128;
+      count = run ? count - 128 : count;
+      if (count <= 0 || x + count > width) {
+        return false;
+      }
+      int value = run ? fgetc(file) : 0;
+      for (; count > 0; count--) {
+        value = run ? value : fgetc(file);
+        if (value == EOF) {
+          return false;
+        }
+        rgbe[4 * x++ + c] = value;
+      }
+    }
+  }
+  return true;
+}
+
+} // namespace
+
+bool read_pfm(const char *filename, Image &image) {
+  FILE *file = fopen(filename, "rb");
+  if (!file) {
+    fprintf(stderr, "Could not open %s\n", filename);
+    return false;
+  }
+  char type[3] = {0};
+  int width, height;
+  float scale;
+  // The single whitespace after the scale is consumed by the %*c
+  if (fscanf(file, "%2s %d %d %f%*c", type, &width, &height, &scale) != 4 ||
+      type[0] != 'P' || (type[1] != 'F' && type[1] != 'f') || width <= 0 ||
+      height <= 0) {
+    fprintf(stderr, "%s is not a PFM file\n", filename);
+    fclose(file);
+    return false;
+  }
+
+  image = Image(width, height, type[1] == 'F' ? 3 : 1);
+  size_t count = image.pixels.size();
+  bool ok = fread(image.pixels.data(), sizeof(float), count, file) == count;
+  fclose(file);
+  if (!ok) {
+    fprintf(stderr, "%s is truncated\n", filename);
+    return false;
+  }
+  // A negative scale means little endian data
+  if ((scale < 0.0f) != host_is_little_endian()) {
+    swap_bytes(image.pixels.data(), count);
+  }
+  return true;
+}
+
+bool read_hdr(const char *filename, Image &image) {
+  FILE *file = fopen(filename, "rb");
+  if (!file) {
+    fprintf(stderr, "Could not open %s\n", filename);
+    return false;
+  }
+  // Header lines up to a blank one, then the resolution
+  char line[256];
+  bool ok = fgets(line, sizeof(line), file) && strncmp(line, "#?", 2) == 0;
+  while (ok && fgets(line, sizeof(line), file) && line[0] != '\n') {
+    ok = strncmp(line, "FORMAT=", 7) != 0 ||
+         strncmp(line, "FORMAT=32-bit_rle_rgbe", 22) == 0;
+  }
+  int width, height;
+  if (!ok || fscanf(file, "-Y %d +X %d%*c", &height, &width) != 2 ||
+      width <= 0 || height <= 0) {
+    fprintf(stderr, "%s is not an RGBE Radiance file with rows top down\n",
+            filename);
+    fclose(file);
+    return false;
+  }
+
+  image = Image(width, height, 3);
+  std::vector<unsigned char> rgbe(size_t(width) * 4);
+  for (int y = height - 1; y >= 0 && ok; y--) {
+    ok = read_rgbe_scanline(file, rgbe.data(), width);
+    for (int x = 0; x < width && ok; x++) {
+      const unsigned char *p = &rgbe[size_t(x) * 4];
+      float scale = p[3] ? ldexpf(1.0f, p[3] - (128 + 8)) : 0.0f;
+      for (int c = 0; c < 3; c++) {
+        image.pixel(x, y)[c] = p[3] ? (p[c] + 0.5f) * scale : 0.0f;
+      }
+    }
+  }
+  fclose(file);
+  if (!ok) {
+    fprintf(stderr, "%s is truncated or corrupt\n", filename);
+  }
+  return ok;
+}
+
+bool write_pfm(const char *filename, const Image &image) {
+  FILE *file = fopen(filename, "wb");
+  if (!file) {
+    fprintf(stderr, "Could not create %s\n", filename);
+    return false;
+  }
+  int out_channels = image.channels == 1 ? 1 : 3;
+  fprintf(file, "%s\n%d %d\n%s\n", out_channels == 1 ? "Pf" : "PF", image.width,
+          image.height, host_is_little_endian() ? "-1.0" : "1.0");
+
+  std::vector<float> row(size_t(image.width) * out_channels);
+  bool ok = true;
+  for (int y = 0; y < image.height && ok; y++) {
+    for (int x = 0; x < image.width; x++) {
+      const float *p = image.pixel(x, y);
+      for (int c = 0; c < out_channels; c++) {
+        row[size_t(x) * out_channels + c] = c < image.channels ? p[c] : 0.0f;
+      }
+    }
+    ok = fwrite(row.data(), sizeof(float), row.size(), file) == row.size();
+  }
+  ok = fclose(file) == 0 && ok;
+  if (!ok) {
+    fprintf(stderr, "Could not write %s\n", filename);
+  }
+  return ok;
+}
+
+bool write_png(const char *filename, const Image &image) {
+  int channels;
+  std::vector<unsigned char> bytes = to_bytes(image, channels);
+
+  // Every row starts with its filter type, always none here
+  size_t row_size = size_t(image.width) * channels;
+  std::vector<unsigned char> raw((row_size + 1) * image.height);
+  for (int y = 0; y < image.height; y++) {
+    raw[y * (row_size + 1)] = 0;
+    memcpy(&raw[y * (row_size + 1) + 1], &bytes[y * row_size], row_size);
+  }
+  uLongf compressed_size = compressBound(raw.size());
+  std::vector<unsigned char> compressed(compressed_size);
+  // A low level is nearly as small and much faster for rendered images
+  if (compress2(compressed.data(), &compressed_size, raw.data(), raw.size(), 3) !=
+      Z_OK) {
+    fprintf(stderr, "Could not compress %s\n", filename);
+    return false;
+  }
+
+  FILE *file = fopen(filename, "wb");
+  if (!file) {
+    fprintf(stderr, "Could not create %s\n", filename);
+    return false;
+  }
+  const unsigned char signature[8] = {137, 'P', 'N', 'G', '\r', '\n', 26, '\n'};
+  unsigned char header[13];
+  put_u32_be(header, image.width);
+  put_u32_be(header + 4, image.height);
+  header[8] = 8; // Bits per channel
+  header[9] = channels == 1 ? 0 : channels == 3 ? 2 : 6; // Colour type
+  header[10] = header[11] = header[12] = 0; // Deflate, no filter, no interlace
+  bool ok = fwrite(signature, sizeof(signature), 1, file) == 1 &&
+            write_png_chunk(file, "IHDR", header, sizeof(header)) &&
+            write_png_chunk(file, "IDAT", compressed.data(), compressed_size) &&
+            write_png_chunk(file, "IEND", NULL, 0);
+  ok = fclose(file) == 0 && ok;
+  if (!ok) {
+    fprintf(stderr, "Could not write %s\n", filename);
+  }
+  return ok;
+}
+
+bool write_tga(const char *filename, const Image &image) {
+  int channels;
+  std::vector<unsigned char> bytes = to_bytes(image, channels);
+  // TGA stores colour as BGR(A)
+  if (channels >= 3) {
+    for (size_t i = 0; i < bytes.size(); i += channels) {
+      std::swap(bytes[i], bytes[i + 2]);
+    }
+  }
+
+  FILE *file = fopen(filename, "wb");
+  if (!file) {
+    fprintf(stderr, "Could not create %s\n", filename);
+    return false;
+  }
+  unsigned char header[18] = {0};
+  header[2] = channels == 1 ? 3 : 2; // Uncompressed greyscale or true colour
+  header[12] = image.width & 0xff;
+  header[13] = image.width >> 8;
+  header[14] = image.height & 0xff;
+  header[15] = image.height >> 8;
+  header[16] = channels * 8;
+  // Rows are stored top down, and the alpha bits are counted in the
+  // descriptor
+  header[17] = 0x20 | (channels == 4 ? 8 : 0);
+  bool ok = fwrite(header, sizeof(header), 1, file) == 1 &&
+            fwrite(bytes.data(), 1, bytes.size(), file) == bytes.size();
+  ok = fclose(file) == 0 && ok;
+  if (!ok) {
+    fprintf(stderr, "Could not write %s\n", filename);
+  }
+  return ok;
+}
+
+bool has_extension(const char *filename, const char *extension) {
+  size_t n = strlen(filename), m = strlen(extension);
+  return n >= m && strcasecmp(filename + n - m, extension) == 0;
+}
+
+Image first_channels(const Image &image, int channels) {
+  Image out(image.width, image.height, channels);
+  size_t count = size_t(image.width) * image.height;
+  for (size_t i = 0; i < count; i++) {
+    for (int c = 0; c < channels; c++) {
+      out.pixels[i * channels + c] =
+          c < image.channels ? image.pixels[i * image.channels + c] : 0.0f;
+    }
+  }
+  return out;
+}
+
+bool write_image(const char *filename, const Image &image) {
+  if (has_extension(filename, ".pfm")) {
+    return write_pfm(filename, image);
+  } else if (has_extension(filename, ".png")) {
+    return write_png(filename, image);
+  } else if (has_extension(filename, ".tga")) {
+    return write_tga(filename, image);
+  } else if (has_extension(filename, ".exr")) {
+    return write_exr(filename, image);
+  }
+  fprintf(stderr, "Unknown image format for %s\n", filename);
+  return false;
+}
@@ -0,0 +1,57 @@
+/*
+ * Float images on the CPU, reading them from PFM and Radiance HDR files and
+ * writing them as PFM, PNG and TGA. Pixels are stored interleaved with rows
+ * from the bottom up, which is both the order glReadPixels returns and the
+ * order of PFM files.
+ */
+#pragma once
+#include <stddef.h>
+#include <vector>
+
+struct Image {
+  int width = 0;
+  int height = 0;
+  int channels = 0;
+  std::vector<float> pixels;
+
+  Image() {}
+  Image(int width, int height, int channels)
+      : width{width}, height{height}, channels{channels},
+        pixels(size_t(width) * height * channels) {}
+
+  float *pixel(int x, int y) {
+    return &pixels[(size_t(y) * width + x) * channels];
+  }
+  const float *pixel(int x, int y) const {
+    return &pixels[(size_t(y) * width + x) * channels];
+  }
+};
+
+// Greyscale (Pf) and RGB (PF) files of either byte order are read as 1 and
+// 3 channel images. Returns false and prints why on failure.
+bool read_pfm(const char *filename, Image &image);
+
+// RGBE Radiance files (.hdr), the usual format of HDR environment maps, are
+// read as 3 channel images. Returns false and prints why on failure.
+bool read_hdr(const char *filename, Image &image);
+
+// Writes 1 channel images as greyscale and others as RGB, dropping any
+// channels past the third
+bool write_pfm(const char *filename, const Image &image);
+
+// 8 bit formats. Values are taken to be display encoded already and are
+// clamped to [0, 1]. 1 channel images are written as greyscale, 2 and 3 channel
+// ones as RGB and 4 channel ones as RGBA.
+bool write_png(const char *filename, const Image &image);
+bool write_tga(const char *filename, const Image &image);
+
+// Case insensitive, extension includes the dot
+bool has_extension(const char *filename, const char *extension);
+
+// Copy of image with only its first channels channels, padded with zeros if
+// it has fewer
+Image first_channels(const Image &image, int channels);
+
+// Picks the format from the extension of filename, .pfm, .png, .tga or .exr,
+// the last as half float RGB(A) with ZIP compression
+bool write_image(const char *filename, const Image &image);
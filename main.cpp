@@ -3,13 +3,36 @@
 
 #include <GL/gl.h>
 #include <GL/glext.h>
+#include <X11/Xlib.h>
+#include <algorithm>
+#include <chrono>
 #include <cstdlib>
+#include <math.h>
+#include <memory>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
 #define MAIN
 #include "GL_utilities.h"
 #include "LittleOBJLoader.h"
 #include "MicroGlut.h"
 #include "VectorUtils4.h"
+#include "async_writer.h"
+#include "bvh8.h"
+#include "checkpoint.h"
+#include "cpu_denoiser.h"
+#include "denoiser.h"
+#include "environment.h"
+#include "exr.h"
+#include "frame_budget.h"
+#include "material.h"
+#include "readback.h"
+#include "sequence.h"
+#include "shader_variants.h"
+#include "shapes.h"
 #include "sphere.h"
+#include "textures.h"
 // uses framework OpenGL
 // uses framework Cocoa
 
@@ -20,16 +43,77 @@ const double ASPECT_RATIO = 16.0 / 9.0;
 const int SCREEN_WIDTH = 800;
 const int SCREEN_HEIGHT = int(SCREEN_WIDTH / ASPECT_RATIO);
 
-// Ray parameters
-const uint SAMPLES_PER_PIXEL = 20;
+// Ray parameters. The samples per pixel of a frame are picked to fit the GPU
+// time of a frame into INTERACTIVE_FRAME_MS in the window, which --frame-ms
+// changes, and of a pass into BATCH_FRAME_MS when rendering sequences. While
+// the camera moves each frame traces at most MOVING_SAMPLES_PER_PIXEL, so the
+// view keeps up with the input. --spp fixes the samples per frame instead.
+// Long passes are traced in tiles, whose size --tile-size fixes, with a flush
+// after each one if --flush-tiles is given.
+const float INTERACTIVE_FRAME_MS = 16.0;
+const float BATCH_FRAME_MS = 200.0;
+const int MOVING_SAMPLES_PER_PIXEL = 1;
 const int MAX_BOUNCE_COUNT = 20;
 
+// Path lengths. Russian roulette may end paths from bounce rr_min_depth on,
+// which --rr-depth changes. --split makes paths go on from their first diffuse
+// hit as that many branches, which spends more of the time on the bounces
+// past it. Either pays off in some scenes and not in others, so their effect
+// is shown as the variance of a sample times its GPU time: the lower, the
+// sooner the image is clean.
+int rr_min_depth = 2;
+int split_count = 1;
+float frame_ms = INTERACTIVE_FRAME_MS;
+FrameBudget frame_budget =
+    create_frame_budget(SCREEN_WIDTH, SCREEN_HEIGHT, INTERACTIVE_FRAME_MS);
+bool flush_tiles = false;
+
 // Shaders and shader parameters
-int frame = 0;
-GLuint tracer, plain_tex_shader;
+int accumulated_samples = 0; // Per pixel, in prev_frame
+GLuint plain_tex_shader, present_shader;
+
+// The tracer is compiled with the bounce count, the material features the
+// scene uses and a traversal stack deep enough for its BVH built in, and with
+// the samples per pass when they are fixed
+ShaderVariants *tracer_variants;
+int scene_material_features;
+// BVH levels the tracer traverses when compiled without BVH_STACK_SIZE
+const GLuint GENERAL_BVH_STACK_SIZE = 32;
+// Program and sample count of the last pass, and whether it was specialised
+GLuint pass_tracer = 0;
+int pass_samples = 0;
+bool pass_specialised = false;
+bool camera_was_moving = false;
 Model *triangle_model;
 FBOstruct *prev_frame, *curr_frame;
 
+// First-hit guide buffers written by the tracer next to curr_frame, and the
+// denoiser reading them. Press 'n' to toggle denoising.
+GLuint normal_depth_tex, albedo_tex;
+Denoiser *denoiser;
+GPUTimer trace_timer;
+
+// The accumulated image is saved to CHECKPOINT_FILE this often, and picked up
+// again when started with --resume
+const char *CHECKPOINT_FILE = "render.checkpoint";
+const int CHECKPOINT_INTERVAL_MS = 5 * 60 * 1000;
+int last_checkpoint_ms = 0;
+
+// Everything saved to disk is read back through a ring of pixel buffers and
+// encoded on a background thread. Press 'v' to record every frame shown to
+// numbered PNG files.
+Readback *readback;
+AsyncWriter *writer;
+bool recording = false;
+int recorded_frames = 0;
+
+// The variance of a sample times its GPU time in ms per sample per pixel,
+// measured from a readback of the accumulation this often while the camera
+// is still. 0 until measured.
+const int VARIANCE_INTERVAL_MS = 2000;
+int last_variance_ms = 0;
+double variance_time = 0.0;
+
 // Camera parameters
 const float VERTICAL_FOV = 60;
 vec3 cam_pos = vec3(-2.0, 0.2, 1.0);
@@ -39,11 +123,240 @@ float defocus_angle = 0.9;
 float focus_dist = 2.7;
 float EXPOSURE = 0.4;
 
-// Sending sphere data to the GPU
-GLuint sphere_ubo;
-GLuint sphere_block_binding = 0;
-Sphere spheres[15];
-GLuint num_spheres = 0;
+// Camera controls. w/s, a/d and q/e move forwards and back, sideways and down
+// and up. Dragging with the left mouse button turns the camera, or orbits it
+// around cam_look_at after 'o' has been pressed. Moving restarts the
+// accumulation, but keeps the FBOs and scene buffers as they are.
+const float CAMERA_SPEED = 1.0;          // Units per second
+const float CAMERA_TURN_SPEED = 0.005;   // Radians per pixel dragged
+bool orbit_camera = false;
+bool dragging = false;
+int drag_x, drag_y;
+int last_display_ms = 0;
+bool camera_moved = false;
+
+// Bounce the small spheres around. Every frame the BVH is then refitted or
+// rebuilt, only the changed data is uploaded and the accumulation restarts.
+const bool ANIMATE_SPHERES = false;
+std::vector<vec3> sphere_rest_pos;
+
+// Sending scene data to the GPU. Spheres and the BVH over them, the quads and
+// the boxes are stored in buffer textures bound to the texture units below.
+// The binary BVH the 8-wide one is collapsed from is kept for refitting.
+// Rendering a sequence fills a second set of buffers with the next frame's
+// scene while the first is being traced. Only spheres move, so planes, quads,
+// boxes, the material table and the material index of each primitive are
+// uploaded once.
+std::vector<Sphere> spheres;
+std::vector<Quad> quads;
+std::vector<Box> boxes;
+std::vector<Plane> planes;
+MaterialTable material_table;
+// Index into the material table per primitive of each kind
+std::vector<GLuint> sphere_materials, quad_materials, box_materials,
+    plane_materials;
+GLuint material_buffer, material_tex;
+GLuint prim_material_buffer, prim_material_tex;
+GLuint quad_buffer, quad_tex;
+GLuint box_buffer, box_tex;
+GLuint plane_buffer, plane_tex;
+TextureArray *textures;
+Environment *environment = nullptr; // Lights the scene instead of the sky
+BVH scene_bvh_binary;
+BVH8 scene_bvh;
+struct SceneBuffers {
+  GLuint sphere_buffer, sphere_tex;
+  GLuint bvh_node_buffer, bvh_node_tex;
+  GLuint bvh_prim_buffer, bvh_prim_tex;
+  GLuint bvh_depth; // Levels of the BVH in the buffers
+};
+SceneBuffers scene_buffers[2];
+int traced_scene = 0; // The set of scene_buffers the tracer reads
+const GLint SPHERE_TEX_UNIT = 2;
+const GLint BVH_NODE_TEX_UNIT = 3;
+const GLint BVH_PRIM_TEX_UNIT = 4;
+const GLint MATERIAL_TEX_UNIT = 5;
+const GLint PRIM_MATERIAL_TEX_UNIT = 6;
+const GLint QUAD_TEX_UNIT = 7;
+const GLint BOX_TEX_UNIT = 8;
+const GLint PLANE_TEX_UNIT = 9;
+const GLint TEXTURE_ARRAY_UNIT = 10;
+const GLint ENVIRONMENT_UNIT = 11;
+const GLint ENVIRONMENT_SAMPLING_UNIT = 12;
+
+// Creates a buffer object holding data and a buffer texture viewing it
+GLuint create_buffer_texture(GLenum internal_format, const void *data,
+                             GLsizeiptr size, GLuint *buffer,
+                             GLenum usage = GL_STATIC_DRAW) {
+  GLuint tex;
+  glGenBuffers(1, buffer);
+  glBindBuffer(GL_TEXTURE_BUFFER, *buffer);
+  glBufferData(GL_TEXTURE_BUFFER, size, data, usage);
+  glGenTextures(1, &tex);
+  glBindTexture(GL_TEXTURE_BUFFER, tex);
+  glTexBuffer(GL_TEXTURE_BUFFER, internal_format, *buffer);
+  glBindTexture(GL_TEXTURE_BUFFER, 0);
+  glBindBuffer(GL_TEXTURE_BUFFER, 0);
+  return tex;
+}
+
+// Replaces the whole contents of a buffer, which may change its size
+void upload_buffer(GLuint buffer, const void *data, GLsizeiptr size) {
+  glBindBuffer(GL_TEXTURE_BUFFER, buffer);
+  glBufferData(GL_TEXTURE_BUFFER, size, data, GL_DYNAMIC_DRAW);
+  glBindBuffer(GL_TEXTURE_BUFFER, 0);
+}
+
+// Uploads only the elements at the given increasing indices, with one
+// glBufferSubData per run of consecutive indices
+void upload_ranges(GLuint buffer, const void *data, GLsizeiptr elem_size,
+                   const std::vector<GLuint> &indices) {
+  glBindBuffer(GL_TEXTURE_BUFFER, buffer);
+  for (size_t i = 0; i < indices.size();) {
+    size_t j = i + 1;
+    while (j < indices.size() && indices[j] == indices[j - 1] + 1) {
+      j++;
+    }
+    glBufferSubData(GL_TEXTURE_BUFFER, indices[i] * elem_size,
+                    (j - i) * elem_size,
+                    (const char *)data + indices[i] * elem_size);
+    i = j;
+  }
+  glBindBuffer(GL_TEXTURE_BUFFER, 0);
+}
+
+// Bounds of the primitives in the BVH, numbered as in tracer.frag: spheres
+// first, then quads, then boxes
+std::vector<AABB> get_prim_bounds() {
+  std::vector<AABB> prim_bounds;
+  for (const Sphere &sphere : spheres) {
+    prim_bounds.push_back(sphere.bounds());
+  }
+  for (const Quad &quad : quads) {
+    prim_bounds.push_back(quad.bounds());
+  }
+  for (const Box &box : boxes) {
+    prim_bounds.push_back(box.bounds());
+  }
+  return prim_bounds;
+}
+
+// Stand-in for simulation output: the small spheres hop up and down. The
+// shutter covers the motion since the previous frame, so they are motion
+// blurred. Returns the indices of the spheres that moved.
+std::vector<GLuint> animate_spheres(float time) {
+  std::vector<GLuint> moved;
+  for (GLuint i = 0; i < spheres.size(); i++) {
+    if (spheres[i].radius > 0.25f) {
+      continue;
+    }
+    vec3 pos = sphere_rest_pos[i];
+    pos.y += 0.3f * fabsf(sinf(3.0f * time + i));
+    spheres[i].pos = spheres[i].pos_end;
+    spheres[i].pos_end = pos;
+    moved.push_back(i);
+  }
+  return moved;
+}
+
+// Brings the BVH up to date with the spheres and uploads what changed
+void update_scene(float time) {
+  std::vector<GLuint> moved = animate_spheres(time);
+  if (moved.empty()) {
+    return;
+  }
+  SceneBuffers &buffers = scene_buffers[traced_scene];
+  upload_ranges(buffers.sphere_buffer, spheres.data(), sizeof(Sphere), moved);
+
+  if (scene_bvh_binary.update(get_prim_bounds()) == BVHUpdate::REFIT) {
+    std::vector<GLuint> changed_nodes;
+    scene_bvh.refit(scene_bvh_binary, changed_nodes);
+    upload_ranges(buffers.bvh_node_buffer, scene_bvh.nodes.data(), sizeof(BVH8Node),
+                  changed_nodes);
+  } else {
+    scene_bvh.build(scene_bvh_binary);
+    upload_buffer(buffers.bvh_node_buffer, scene_bvh.nodes.data(),
+                  sizeof(BVH8Node) * scene_bvh.nodes.size());
+    upload_buffer(buffers.bvh_prim_buffer, scene_bvh.prim_indices.data(),
+                  sizeof(GLuint) * scene_bvh.prim_indices.size());
+    buffers.bvh_depth = scene_bvh.depth;
+  }
+  printError("update scene buffers");
+
+  // Start accumulating from scratch
+  accumulated_samples = 0;
+}
+
+// Creates buffers holding the current spheres and BVH. Spheres come first
+// among the primitives, so sphere indices are primitive indices as well.
+void create_scene_buffers(SceneBuffers &buffers, GLenum usage) {
+  buffers.sphere_tex = create_buffer_texture(
+      GL_RGBA32F, spheres.data(), sizeof(Sphere) * spheres.size(),
+      &buffers.sphere_buffer, usage);
+  buffers.bvh_node_tex = create_buffer_texture(
+      GL_RGBA32UI, scene_bvh.nodes.data(),
+      sizeof(BVH8Node) * scene_bvh.nodes.size(), &buffers.bvh_node_buffer, usage);
+  buffers.bvh_prim_tex = create_buffer_texture(
+      GL_R32UI, scene_bvh.prim_indices.data(),
+      sizeof(GLuint) * scene_bvh.prim_indices.size(), &buffers.bvh_prim_buffer,
+      usage);
+  buffers.bvh_depth = scene_bvh.depth;
+  printError("upload scene buffers");
+}
+
+// Replaces the whole contents of buffers with the current spheres and BVH
+void upload_scene(SceneBuffers &buffers) {
+  upload_buffer(buffers.sphere_buffer, spheres.data(),
+                sizeof(Sphere) * spheres.size());
+  upload_buffer(buffers.bvh_node_buffer, scene_bvh.nodes.data(),
+                sizeof(BVH8Node) * scene_bvh.nodes.size());
+  upload_buffer(buffers.bvh_prim_buffer, scene_bvh.prim_indices.data(),
+                sizeof(GLuint) * scene_bvh.prim_indices.size());
+  buffers.bvh_depth = scene_bvh.depth;
+  printError("upload scene buffers");
+}
+
+// Adds a sphere to the scene, with material added to the material table if
+// it is not there already
+void add_sphere(const Sphere &sphere, const Material &material) {
+  spheres.push_back(sphere);
+  sphere_materials.push_back(add_material(material_table, material));
+}
+
+void add_quad(const Quad &quad, const Material &material) {
+  quads.push_back(quad);
+  quad_materials.push_back(add_material(material_table, material));
+}
+
+void add_box(const Box &box, const Material &material) {
+  boxes.push_back(box);
+  box_materials.push_back(add_material(material_table, material));
+}
+
+void add_plane(const Plane &plane, const Material &material) {
+  planes.push_back(plane);
+  plane_materials.push_back(add_material(material_table, material));
+}
+
+// Texels of a checkerboard of white and grey squares, square texels wide
+std::vector<unsigned char> checkerboard(int size, int square) {
+  std::vector<unsigned char> rgba;
+  for (int y = 0; y < size; y++) {
+    for (int x = 0; x < size; x++) {
+      unsigned char v = (x / square + y / square) % 2 == 0 ? 255 : 128;
+      rgba.insert(rgba.end(), {v, v, v, 255});
+    }
+  }
+  return rgba;
+}
+
+void bind_buffer_texture(GLuint program, const char *name, GLint unit,
+                         GLuint tex) {
+  glActiveTexture(GL_TEXTURE0 + unit);
+  glBindTexture(GL_TEXTURE_BUFFER, tex);
+  glUniform1i(glGetUniformLocation(program, name), unit);
+  glActiveTexture(GL_TEXTURE0);
+}
 
 void init(void) {
   dumpInfo();
@@ -55,13 +368,21 @@ void init(void) {
   printError("GL inits"); // This is merely a vague indication of where
                           // something might be wrong
   // Load and compile shader
-  tracer = loadShaders("shader.vert", "tracer.frag");
+  tracer_variants = create_shader_variants("shader.vert", "tracer.frag");
+  if (!get_shader_variant(tracer_variants, {})) {
+    exit(1);
+  }
   plain_tex_shader = loadShaders("shader.vert", "plain.frag");
+  present_shader = loadShaders("shader.vert", "present.frag");
   printError("init shader");
 
   // Set up FBOs
   curr_frame = initFBO(SCREEN_WIDTH, SCREEN_HEIGHT, 0);
   prev_frame = initFBO(SCREEN_WIDTH, SCREEN_HEIGHT, 0);
+  attach_guide_buffers(curr_frame, &normal_depth_tex, &albedo_tex);
+  denoiser = create_denoiser(SCREEN_WIDTH, SCREEN_HEIGHT);
+  readback = create_readback(SCREEN_WIDTH, SCREEN_HEIGHT);
+  writer = create_async_writer();
 
   // Set up triangle used to cover the screen
   GLfloat triangle[] = {
@@ -83,7 +404,13 @@ void init(void) {
   vec3 blue = vec3(0.1, 0.3, 0.8);
   vec3 purple = vec3(0.7, 0.1, 0.7);
   vec3 pink = vec3(0.8, 0.3, 0.5);
+  textures = create_texture_array();
+  std::vector<unsigned char> checks = checkerboard(textures->size, textures->size / 4);
   Material ground = Material::init_diffuse(green);
+  ground.albedo_texture =
+      add_texture(textures, textures->size, textures->size, checks.data());
+  Material pedestal = Material::init_diffuse(white * 0.8);
+  Material wall = Material::init_specular(white * 0.8, white, 0.1, 0.05, 0.0);
   Material center = Material::init_diffuse(red);
   // Note: setting reflection roughness to 0 for either 'left' or 'bubble'
   // leads to weird refraction for some mysterious reason
@@ -103,61 +430,158 @@ void init(void) {
   pink_marble =
       Material::init_dielectric(white, 2.0, 0.0, 0.0, pink, white * 0.8);
 
-  // Set up scene with spheres
-  num_spheres = 11;
-  spheres[0] = Sphere{vec3(0.0, -100.515, -1.0), 100.0, ground};
-  spheres[1] = Sphere{vec3(0.0, 0.0, -1.2), 0.5, center};
-  spheres[2] = Sphere{vec3(-1.0, 0.0, -1.0), 0.5, left};
-  spheres[3] = Sphere{vec3(-1.0, 0.0, -1.0), 0.4, bubble};
-  spheres[4] = Sphere{vec3(1.0, 0.0, -1.0), 0.5, right};
-  spheres[5] = Sphere{vec3(0.0, 10.0, 7.0), 1.0, light};
-  spheres[6] = Sphere{vec3(0.0, -0.25, 0.0), 0.25, clear_glass};
-  spheres[7] = Sphere{vec3(-0.7, -0.2, 0.0), 0.125, purple_glass};
-  spheres[8] =
-      Sphere{vec3(-1.5, -0.3, -4.5), 0.3, Material::init_diffuse(blue)};
-  spheres[9] = Sphere{vec3(-1.9, -0.39, -1.3), 0.125, pink_marble};
-  spheres[10] = Sphere{vec3(-0.6, -0.385, 0.7), 0.125, purple_metal};
-
-  // Create a UBO (uniform buffer object) containing array of spheres
-  glGenBuffers(1, &sphere_ubo);
-  glBindBuffer(GL_UNIFORM_BUFFER, sphere_ubo);
-  glBufferData(GL_UNIFORM_BUFFER, sizeof(Sphere) * num_spheres,
-               (void *)&spheres[0], GL_STATIC_DRAW);
-  glBindBuffer(GL_UNIFORM_BUFFER, 0);
-  printError("generate sphere ubo");
+  // Set up scene with spheres on a ground plane
+  add_plane(Plane(vec3(0.0, 1.0, 0.0), vec3(0.0, -0.515, 0.0)), ground);
+  add_box(Box(vec3(2.2, -0.515, -0.6), vec3(2.8, 0.1, 0.0)), pedestal);
+  add_quad(Quad(vec3(-3.0, -0.515, -3.2), vec3(2.0, 0.0, -0.6),
+                vec3(0.0, 1.6, 0.0)),
+           wall);
+  add_sphere(Sphere{vec3(0.0, 0.0, -1.2), 0.5}, center);
+  add_sphere(Sphere{vec3(-1.0, 0.0, -1.0), 0.5}, left);
+  add_sphere(Sphere{vec3(-1.0, 0.0, -1.0), 0.4}, bubble);
+  add_sphere(Sphere{vec3(1.0, 0.0, -1.0), 0.5}, right);
+  add_sphere(Sphere{vec3(0.0, 10.0, 7.0), 1.0}, light);
+  add_sphere(Sphere{vec3(0.0, -0.25, 0.0), 0.25}, clear_glass);
+  add_sphere(Sphere{vec3(-0.7, -0.2, 0.0), 0.125}, purple_glass);
+  add_sphere(Sphere{vec3(-1.5, -0.3, -4.5), vec3(-1.2, -0.3, -4.5), 0.3},
+             Material::init_diffuse(blue));
+  add_sphere(Sphere{vec3(-1.9, -0.39, -1.3), 0.125}, pink_marble);
+  add_sphere(Sphere{vec3(-0.6, -0.385, 0.7), 0.125}, purple_metal);
+
+  for (const Sphere &sphere : spheres) {
+    sphere_rest_pos.push_back(sphere.pos);
+  }
+  const std::vector<Material> &materials = material_table.materials;
+  scene_material_features = material_features(materials);
+
+  material_tex = create_buffer_texture(GL_RGBA32F, materials.data(),
+                                       sizeof(Material) * materials.size(),
+                                       &material_buffer);
+  std::vector<GLuint> prim_materials = sphere_materials;
+  for (const std::vector<GLuint> *kind :
+       {&quad_materials, &box_materials, &plane_materials}) {
+    prim_materials.insert(prim_materials.end(), kind->begin(), kind->end());
+  }
+  prim_material_tex = create_buffer_texture(
+      GL_R32UI, prim_materials.data(), sizeof(GLuint) * prim_materials.size(),
+      &prim_material_buffer);
+  quad_tex = create_buffer_texture(GL_RGBA32F, quads.data(),
+                                   sizeof(Quad) * quads.size(), &quad_buffer);
+  box_tex = create_buffer_texture(GL_RGBA32F, boxes.data(),
+                                  sizeof(Box) * boxes.size(), &box_buffer);
+  plane_tex = create_buffer_texture(GL_RGBA32F, planes.data(),
+                                    sizeof(Plane) * planes.size(), &plane_buffer);
+  upload_texture_array(textures);
+
+  // Build a BVH over the spheres, quads and boxes and collapse it to the compressed 8-wide
+  // layout the shader traverses
+  scene_bvh_binary.build_parallel(get_prim_bounds());
+  scene_bvh.build(scene_bvh_binary);
+
+  create_scene_buffers(scene_buffers[traced_scene],
+                       ANIMATE_SPHERES ? GL_DYNAMIC_DRAW : GL_STATIC_DRAW);
 }
 
-void display(void) {
-  printError("pre display");
-  // clear the screen
-  glClearColor(0.0, 0.0, 0.0, 0.5);
-  glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+// Returns the tracer specialised for the scene and passes of samples samples.
+// Falls back to the general one if the variant does not compile or is still
+// being compiled, and tells which one it returned in specialised.
+GLuint tracer_program(int samples, bool &specialised) {
+  // The traversal stack holds one entry per level of the BVH. Rounding up
+  // keeps the program when a rebuilt tree is a level deeper or shallower.
+  GLuint bvh_depth = scene_buffers[traced_scene].bvh_depth;
+  GLuint stack_size = std::max(GENERAL_BVH_STACK_SIZE, (bvh_depth + 15) / 16 * 16);
+  std::vector<std::string> defines = {
+      "MAX_BOUNCE_COUNT " + std::to_string(MAX_BOUNCE_COUNT),
+      "MATERIAL_FEATURES " + std::to_string(scene_material_features),
+      "BVH_STACK_SIZE " + std::to_string(stack_size)};
+  // The frame budget changes the sample count every few frames, and every
+  // count would need a program of its own
+  if (frame_budget.fixed_samples > 0) {
+    defines.push_back("SAMPLES_PER_PIXEL " + std::to_string(samples));
+  }
+  GLuint program = get_shader_variant(tracer_variants, defines);
+  specialised = program != 0;
+  if (!program && bvh_depth > GENERAL_BVH_STACK_SIZE) {
+    static bool warned = false;
+    if (!warned) {
+      fprintf(stderr, "The BVH is %u levels deep, more than the general tracer "
+                      "can traverse, so it may miss primitives\n", bvh_depth);
+      warned = true;
+    }
+  }
+  return program ? program : get_shader_variant(tracer_variants, {});
+}
 
-  // Do one round of ray tracing into curr_frame ------------------------------
-  frame++;
+// Traces samples more samples per pixel into curr_frame and accumulates them
+// into prev_frame. The screen is traced in tiles of the size frame_budget
+// asks for, one draw each. Flushing after each tile hands them to the GPU one
+// by one rather than in a single submission.
+void trace_pass(int samples) {
 
+  bool specialised;
+  GLuint tracer = tracer_program(samples, specialised);
+  // Programs round differently, so an image that switched program partway
+  // would depend on when a background compile happened to finish. Start it
+  // over instead. Only a pass of another sample count, like the last one of
+  // a sequence frame, may use another variant of the same program, which
+  // every run does alike.
+  if (pass_tracer != 0 &&
+      (specialised != pass_specialised ||
+       (tracer != pass_tracer && samples == pass_samples))) {
+    accumulated_samples = 0;
+  }
+  pass_tracer = tracer;
+  pass_samples = samples;
+  pass_specialised = specialised;
   glUseProgram(tracer);
 
-  // Bind sphere UBO and the corresponding shader block to a common binding
-  // point
-  GLuint sphere_block_index = glGetUniformBlockIndex(tracer, "SphereBlock");
-  glUniformBlockBinding(tracer, sphere_block_index, sphere_block_binding);
-  glBindBufferBase(GL_UNIFORM_BUFFER, sphere_block_binding, sphere_ubo);
-  printError("bind sphere ubo");
+  // Bind the scene buffer textures
+  const SceneBuffers &buffers = scene_buffers[traced_scene];
+  bind_buffer_texture(tracer, "SPHERES", SPHERE_TEX_UNIT, buffers.sphere_tex);
+  bind_buffer_texture(tracer, "BVH_NODES", BVH_NODE_TEX_UNIT,
+                      buffers.bvh_node_tex);
+  bind_buffer_texture(tracer, "BVH_PRIM_INDICES", BVH_PRIM_TEX_UNIT,
+                      buffers.bvh_prim_tex);
+  bind_buffer_texture(tracer, "MATERIALS", MATERIAL_TEX_UNIT, material_tex);
+  bind_buffer_texture(tracer, "PRIM_MATERIALS", PRIM_MATERIAL_TEX_UNIT,
+                      prim_material_tex);
+  bind_buffer_texture(tracer, "QUADS", QUAD_TEX_UNIT, quad_tex);
+  bind_buffer_texture(tracer, "BOXES", BOX_TEX_UNIT, box_tex);
+  bind_buffer_texture(tracer, "PLANES", PLANE_TEX_UNIT, plane_tex);
+  glActiveTexture(GL_TEXTURE0 + TEXTURE_ARRAY_UNIT);
+  glBindTexture(GL_TEXTURE_2D_ARRAY, textures->tex);
+  glUniform1i(glGetUniformLocation(tracer, "TEXTURES"), TEXTURE_ARRAY_UNIT);
+  glUniform1i(glGetUniformLocation(tracer, "USE_ENVIRONMENT_MAP"),
+              environment != nullptr);
+  if (environment) {
+    glActiveTexture(GL_TEXTURE0 + ENVIRONMENT_UNIT);
+    glBindTexture(GL_TEXTURE_2D, environment->radiance_tex);
+    glUniform1i(glGetUniformLocation(tracer, "ENVIRONMENT"), ENVIRONMENT_UNIT);
+    glActiveTexture(GL_TEXTURE0 + ENVIRONMENT_SAMPLING_UNIT);
+    glBindTexture(GL_TEXTURE_2D, environment->sampling_tex);
+    glUniform1i(glGetUniformLocation(tracer, "ENVIRONMENT_SAMPLING"),
+                ENVIRONMENT_SAMPLING_UNIT);
+  }
+  glActiveTexture(GL_TEXTURE0);
+  glUniform1i(glGetUniformLocation(tracer, "SPHERE_COUNT"), spheres.size());
+  glUniform1i(glGetUniformLocation(tracer, "QUAD_COUNT"), quads.size());
+  glUniform1i(glGetUniformLocation(tracer, "BOX_COUNT"), boxes.size());
+  glUniform1i(glGetUniformLocation(tracer, "PLANE_COUNT"), planes.size());
+  printError("bind scene buffers");
 
   useFBO(curr_frame, prev_frame, 0L);
   glUniform1i(glGetUniformLocation(tracer, "prev_frame"), 0);
-  glUniform1i(glGetUniformLocation(tracer, "FRAME"), frame);
+  glUniform1i(glGetUniformLocation(tracer, "SAMPLE_OFFSET"), accumulated_samples);
   glUniform2ui(glGetUniformLocation(tracer, "SCREEN_RESOLUTION"), SCREEN_WIDTH,
                SCREEN_HEIGHT);
-  glUniform1i(glGetUniformLocation(tracer, "NUM_SPHERES"), num_spheres);
   glUniform1f(glGetUniformLocation(tracer, "VFOV"), VERTICAL_FOV);
   glUniform1f(glGetUniformLocation(tracer, "ASPECT_RATIO"),
               (GLfloat)SCREEN_WIDTH / SCREEN_HEIGHT);
-  glUniform1i(glGetUniformLocation(tracer, "SAMPLES_PER_PIXEL"),
-              SAMPLES_PER_PIXEL);
+  glUniform1i(glGetUniformLocation(tracer, "SAMPLES_PER_PIXEL"), samples);
   glUniform1i(glGetUniformLocation(tracer, "MAX_BOUNCE_COUNT"),
               MAX_BOUNCE_COUNT);
+  glUniform1i(glGetUniformLocation(tracer, "RR_MIN_DEPTH"), rr_min_depth);
+  glUniform1i(glGetUniformLocation(tracer, "SPLIT_COUNT"), split_count);
 
   // Upload camera parameters
   vec3 cam_forward = normalize(cam_pos - cam_look_at);
@@ -172,9 +596,25 @@ void display(void) {
   glUniform3fv(glGetUniformLocation(tracer, "CAM_POS"), 1, (GLfloat *)&cam_pos);
   glUniform1f(glGetUniformLocation(tracer, "DEFOCUS_ANGLE"), defocus_angle);
   glUniform1f(glGetUniformLocation(tracer, "FOCUS_DIST"), focus_dist);
-  glUniform1f(glGetUniformLocation(tracer, "EXPOSURE"), EXPOSURE);
 
-  DrawModel(triangle_model, tracer, "in_position", NULL, "in_tex_coord");
+  trace_timer.begin(samples);
+  int tile = frame_budget.tile_size;
+  if (tile <= 0) {
+    DrawModel(triangle_model, tracer, "in_position", NULL, "in_tex_coord");
+  } else {
+    glEnable(GL_SCISSOR_TEST);
+    for (int y = 0; y < SCREEN_HEIGHT; y += tile) {
+      for (int x = 0; x < SCREEN_WIDTH; x += tile) {
+        glScissor(x, y, tile, tile);
+        DrawModel(triangle_model, tracer, "in_position", NULL, "in_tex_coord");
+        if (flush_tiles) {
+          glFlush();
+        }
+      }
+    }
+    glDisable(GL_SCISSOR_TEST);
+  }
+  trace_timer.end();
 
   // Accumulate the output image into prev_frame ------------------------------
   glUseProgram(plain_tex_shader);
@@ -184,29 +624,484 @@ void display(void) {
   useFBO(prev_frame, curr_frame, 0L);
   DrawModel(triangle_model, plain_tex_shader, "in_position", NULL,
             "in_tex_coord");
+  accumulated_samples += samples;
+}
 
-  // Draw result to screen ----------------------------------------------------
-  glUseProgram(plain_tex_shader);
-  glUniform1i(glGetUniformLocation(plain_tex_shader, "tex_unit"), 0);
+// Variance of the luminance of a single sample, averaged over the pixels of
+// the accumulation, read back from prev_frame, of samples samples per pixel.
+// Its alpha holds the mean squared luminance of the samples.
+double sample_variance(const Image &accumulation, int samples) {
+  if (samples < 2) {
+    return 0.0;
+  }
+  double total = 0.0;
+  for (size_t i = 0; i < accumulation.pixels.size(); i += 4) {
+    const float *p = &accumulation.pixels[i];
+    double luminance = 0.2126 * p[0] + 0.7152 * p[1] + 0.0722 * p[2];
+    total += std::max(p[3] - luminance * luminance, 0.0);
+  }
+  double pixels = accumulation.pixels.size() / 4;
+  return total / pixels * samples / (samples - 1);
+}
 
-  // Output to screen
-  useFBO(0L, curr_frame, 0L);
-  DrawModel(triangle_model, plain_tex_shader, "in_position", NULL,
+// Runs the denoiser over curr_frame if it is enabled. Returns the FBO holding
+// the radiance to show.
+FBOstruct *filtered_result() {
+  if (!denoiser->enabled) {
+    return curr_frame;
+  }
+  return denoise(denoiser, curr_frame->texid, normal_depth_tex, albedo_tex,
+                 accumulated_samples, triangle_model);
+}
+
+// Tone maps result into target, or onto the screen if target is NULL
+void present(FBOstruct *result, FBOstruct *target) {
+  glUseProgram(present_shader);
+  glUniform1i(glGetUniformLocation(present_shader, "tex_unit"), 0);
+  glUniform1f(glGetUniformLocation(present_shader, "EXPOSURE"), EXPOSURE);
+  useFBO(target, result, 0L);
+  DrawModel(triangle_model, present_shader, "in_position", NULL,
             "in_tex_coord");
+}
+
+// Turns offset by yaw around the world up axis and by pitch up or down, keeping
+// clear of straight up and down where the view would flip
+vec3 turn(vec3 offset, float yaw, float pitch) {
+  float distance = Norm(offset);
+  float heading = atan2f(offset.x, offset.z) + yaw;
+  float elevation = asinf(offset.y / distance) + pitch;
+  elevation = std::min(std::max(elevation, -1.55f), 1.55f);
+  return distance * vec3(cosf(elevation) * sinf(heading), sinf(elevation),
+                         cosf(elevation) * cosf(heading));
+}
+
+void mouse(int button, int state, int x, int y) {
+  if (button == GLUT_LEFT_BUTTON) {
+    dragging = state == GLUT_DOWN;
+    drag_x = x;
+    drag_y = y;
+  }
+}
+
+void mouse_drag(int x, int y) {
+  if (!dragging) {
+    return;
+  }
+  float yaw = -CAMERA_TURN_SPEED * (x - drag_x);
+  float pitch = -CAMERA_TURN_SPEED * (y - drag_y);
+  drag_x = x;
+  drag_y = y;
+  if (orbit_camera) {
+    cam_pos = cam_look_at + turn(cam_pos - cam_look_at, yaw, -pitch);
+  } else {
+    cam_look_at = cam_pos + turn(cam_look_at - cam_pos, yaw, pitch);
+  }
+  camera_moved = true;
+}
+
+// Applies the held movement keys and any mouse turns since the last frame.
+// Returns true if the camera moved, in which case the accumulation restarts.
+bool move_camera() {
+  int now_ms = glutGet(GLUT_ELAPSED_TIME);
+  // Long frames are capped, so a stall does not fling the camera away
+  float step = CAMERA_SPEED * std::min(now_ms - last_display_ms, 100) / 1000.0f;
+  last_display_ms = now_ms;
+
+  vec3 forward = normalize(cam_look_at - cam_pos);
+  vec3 right = normalize(cross(forward, cam_up));
+  vec3 move = vec3(0.0, 0.0, 0.0);
+  const struct {
+    unsigned char key;
+    vec3 direction;
+  } keys[] = {{'w', forward}, {'s', -forward}, {'d', right},
+              {'a', -right},  {'e', cam_up},   {'q', -cam_up}};
+  for (const auto &k : keys) {
+    if (glutKeyIsDown(k.key)) {
+      move += k.direction;
+    }
+  }
+  if (Norm(move) > 0.0f) {
+    move = step * move;
+    cam_pos += move;
+    cam_look_at += move;
+    camera_moved = true;
+  }
+
+  bool moved = camera_moved;
+  camera_moved = false;
+  if (moved) {
+    accumulated_samples = 0;
+  }
+  return moved;
+}
+
+void display(void) {
+  printError("pre display");
+  // clear the screen
+  glClearColor(0.0, 0.0, 0.0, 0.5);
+  glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+  // An edited tracer traces a different image, so start over with it
+  if (update_shader_variants(tracer_variants)) {
+    accumulated_samples = 0;
+  }
+
+  if (ANIMATE_SPHERES) {
+    update_scene(glutGet(GLUT_ELAPSED_TIME) / 1000.0f);
+  }
+
+  // The denoiser's time comes out of the frame's budget
+  float denoise_ms = denoiser->enabled ? denoiser->timer.ms : 0.0f;
+  frame_budget.target_ms = std::max(frame_ms - denoise_ms, 0.25f * frame_ms);
+  update_frame_budget(frame_budget, trace_timer);
+
+  // Input is taken right before tracing, and a moving camera traces few
+  // samples, so the frame shows the camera where it is now
+  bool moving = move_camera();
+  // With fixed samples per pass a moving camera is traced by the variant for
+  // its few samples, so the still image starts over without them
+  if (!moving && camera_was_moving && frame_budget.fixed_samples > 0) {
+    accumulated_samples = 0;
+  }
+  camera_was_moving = moving;
+  int samples = frame_budget.samples;
+  trace_pass(moving ? std::min(samples, MOVING_SAMPLES_PER_PIXEL) : samples);
+
+  // Checkpoint the accumulation now and then. An animated scene restarts its
+  // accumulation every frame, so there is nothing worth keeping.
+  int now_ms = glutGet(GLUT_ELAPSED_TIME);
+  if (!ANIMATE_SPHERES && !moving &&
+      now_ms - last_checkpoint_ms >= CHECKPOINT_INTERVAL_MS) {
+    save_checkpoint_async(readback, writer, prev_frame, accumulated_samples,
+                          CHECKPOINT_FILE);
+    last_checkpoint_ms = now_ms;
+  }
+
+  // Measure the variance once there are enough samples for it to settle
+  if (!moving && accumulated_samples >= 16 &&
+      now_ms - last_variance_ms >= VARIANCE_INTERVAL_MS) {
+    int accumulated = accumulated_samples;
+    float ms_per_sample = frame_budget.ms_per_sample;
+    start_readback(readback, prev_frame->fb, GL_COLOR_ATTACHMENT0,
+                   [accumulated, ms_per_sample](Image &&image) {
+      variance_time = sample_variance(image, accumulated) * ms_per_sample;
+    });
+    last_variance_ms = now_ms;
+  }
+
+  // Denoise and draw result to screen ---------------------------------------
+  present(filtered_result(), 0L);
+
+  if (recording) {
+    char filename[64];
+    snprintf(filename, sizeof(filename), "frame_%05d.png", recorded_frames++);
+    std::string name = filename;
+    start_readback(readback, 0, GL_BACK, [name](Image &&image) {
+      queue_image(writer, name, std::move(image));
+    });
+  }
+  // Hand finished readbacks to the writer thread
+  poll_readback(readback);
+
+  // GPU times lag a frame or two behind, as they are read without waiting
+  char title[192];
+  snprintf(title, sizeof(title),
+           "GPU Ray tracer - %d spp (%d per frame, tiles %d) - trace %.1f ms, "
+           "denoise %.1f ms (%s) - variance x ms %.3g",
+           accumulated_samples, frame_budget.samples, frame_budget.tile_size,
+           trace_timer.ms, denoise_ms, denoiser->enabled ? "on" : "off",
+           variance_time);
+  glutSetWindowTitle(title);
 
   glutSwapBuffers();
 }
 
+// Denoises the accumulated radiance on the CPU and writes it to render.exr,
+// with the guide buffers and sample count as extra layers. The noisy input and
+// guide buffers are also written as PFM so the render can be denoised again
+// with denoise_tool. The attachments are read back in turn and the last one to
+// arrive hands all three to the writer thread.
+void save_render() {
+  std::shared_ptr<Image> colour = std::make_shared<Image>();
+  std::shared_ptr<Image> normal = std::make_shared<Image>();
+  int samples = accumulated_samples;
+  start_readback(readback, curr_frame->fb, GL_COLOR_ATTACHMENT0,
+                 [colour](Image &&image) { *colour = std::move(image); });
+  start_readback(readback, curr_frame->fb, GL_COLOR_ATTACHMENT1,
+                 [normal](Image &&image) { *normal = std::move(image); });
+  start_readback(readback, curr_frame->fb, GL_COLOR_ATTACHMENT2,
+                 [colour, normal, samples](Image &&image) {
+    std::shared_ptr<Image> albedo = std::make_shared<Image>(std::move(image));
+    queue_job(writer, [colour, normal, albedo, samples] {
+      Image denoised;
+      denoise_cpu(*colour, albedo.get(), normal.get(), denoised);
+      Image sample_count(colour->width, colour->height, 1);
+      std::fill(sample_count.pixels.begin(), sample_count.pixels.end(),
+                (float)samples);
+      // Depth and sample counts need full floats, half is plenty for the rest
+      std::vector<ExrChannel> channels = {
+          {"R", &denoised, 0, true},
+          {"G", &denoised, 1, true},
+          {"B", &denoised, 2, true},
+          {"albedo.R", albedo.get(), 0, true},
+          {"albedo.G", albedo.get(), 1, true},
+          {"albedo.B", albedo.get(), 2, true},
+          {"normal.X", normal.get(), 0, true},
+          {"normal.Y", normal.get(), 1, true},
+          {"normal.Z", normal.get(), 2, true},
+          {"depth.Z", normal.get(), 3, false},
+          {"samples.Y", &sample_count, 0, false},
+      };
+      if (write_exr("render.exr", channels) &&
+          write_pfm("render_noisy.pfm", *colour) &&
+          write_pfm("render_albedo.pfm", *albedo) &&
+          write_pfm("render_normal.pfm", *normal)) {
+        printf("Saved render.exr\n");
+      }
+    });
+  });
+}
+
+// Continues the accumulation saved in filename. Returns false if the file can
+// not be read or was rendered with other settings.
+bool resume_render(const char *filename) {
+  Checkpoint checkpoint;
+  if (!read_checkpoint(filename, checkpoint)) {
+    return false;
+  }
+  if (checkpoint.width != SCREEN_WIDTH || checkpoint.height != SCREEN_HEIGHT) {
+    fprintf(stderr, "%s is %dx%d, the renderer is set up for %dx%d\n", filename,
+            checkpoint.width, checkpoint.height, SCREEN_WIDTH, SCREEN_HEIGHT);
+    return false;
+  }
+
+  // The next trace reads prev_frame as the accumulation so far, and continues
+  // the random sequence from its sample count
+  glBindTexture(GL_TEXTURE_2D, prev_frame->texid);
+  glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, SCREEN_WIDTH, SCREEN_HEIGHT, GL_RGBA,
+                  GL_FLOAT, checkpoint.pixels.data());
+  glBindTexture(GL_TEXTURE_2D, 0);
+  printError("resume render");
+  accumulated_samples = checkpoint.samples;
+  printf("Resumed %s after %d samples per pixel\n", filename,
+         accumulated_samples);
+  return true;
+}
+
+// Moves the scene to a frame of sequence and uploads it into buffers.
+// Returns the CPU time taken in milliseconds.
+double prepare_sequence_frame(const Sequence &sequence, int seq_frame,
+                              SceneBuffers &buffers) {
+  auto start = std::chrono::steady_clock::now();
+  place_spheres(sequence, seq_frame, spheres);
+  if (scene_bvh_binary.update(get_prim_bounds()) == BVHUpdate::REFIT) {
+    std::vector<GLuint> changed_nodes;
+    scene_bvh.refit(scene_bvh_binary, changed_nodes);
+  } else {
+    scene_bvh.build(scene_bvh_binary);
+  }
+  // The other set of buffers was last filled two frames ago, so everything
+  // is uploaded rather than only what changed since the previous frame
+  upload_scene(buffers);
+  std::chrono::duration<double, std::milli> elapsed =
+      std::chrono::steady_clock::now() - start;
+  return elapsed.count();
+}
+
+// Renders every frame of sequence to its target sample count without showing
+// anything, and writes them as numbered images. While the GPU traces a frame
+// the CPU moves the scene on and uploads the next frame into the other set of
+// scene buffers, and finished frames are read back and written in the
+// background.
+bool render_sequence(const Sequence &sequence) {
+  for (const SphereKey &key : sequence.sphere_keys) {
+    if (key.sphere >= spheres.size()) {
+      fprintf(stderr, "The scene has no sphere %u\n", key.sphere);
+      return false;
+    }
+  }
+  FILE *log = NULL;
+  if (!sequence.log.empty()) {
+    log = fopen(sequence.log.c_str(), "w");
+    if (!log) {
+      fprintf(stderr, "Could not create %s\n", sequence.log.c_str());
+      return false;
+    }
+    fprintf(log, "frame,samples,scene_ms,gpu_ms,wall_ms,variance_x_ms\n");
+  }
+
+  // HDR formats get the linear radiance, the others what would be shown
+  const char *output = sequence.output.c_str();
+  bool hdr = has_extension(output, ".exr") || has_extension(output, ".pfm");
+  FBOstruct *tone_mapped = hdr ? NULL : initFBO(SCREEN_WIDTH, SCREEN_HEIGHT, 0);
+  create_scene_buffers(scene_buffers[1 - traced_scene], GL_DYNAMIC_DRAW);
+  frame_budget.target_ms = BATCH_FRAME_MS;
+
+  auto start = std::chrono::steady_clock::now();
+  auto last_done = start;
+  double scene_ms = prepare_sequence_frame(sequence, 0, scene_buffers[traced_scene]);
+  for (int f = 0; f < sequence.frames; f++) {
+    CameraKey camera = camera_at(sequence, f);
+    cam_pos = camera.pos;
+    cam_look_at = camera.look_at;
+    focus_dist = camera.focus_dist;
+    defocus_angle = camera.defocus_angle;
+
+    // Timestamps rather than an elapsed time query, as those can not be
+    // nested inside the trace and denoise timers
+    GLuint queries[2];
+    glGenQueries(2, queries);
+    glQueryCounter(queries[0], GL_TIMESTAMP);
+    accumulated_samples = 0;
+    while (accumulated_samples < sequence.samples_per_pixel) {
+      update_frame_budget(frame_budget, trace_timer);
+      trace_pass(std::min(frame_budget.samples,
+                          sequence.samples_per_pixel - accumulated_samples));
+    }
+    FBOstruct *result = filtered_result();
+    if (tone_mapped) {
+      present(result, tone_mapped);
+      result = tone_mapped;
+    }
+    glQueryCounter(queries[1], GL_TIMESTAMP);
+
+    char filename[512];
+    snprintf(filename, sizeof(filename), output, f);
+    std::string name = filename;
+    int samples = accumulated_samples;
+    std::shared_ptr<double> variance = std::make_shared<double>(0.0);
+    if (log) {
+      // Readbacks are handed over in order, so this one is in by the time the
+      // frame is logged
+      start_readback(readback, prev_frame->fb, GL_COLOR_ATTACHMENT0,
+                     [=](Image &&image) {
+        *variance = sample_variance(image, samples);
+      });
+    }
+    start_readback(readback, result->fb, GL_COLOR_ATTACHMENT0,
+                   [=, &last_done](Image &&image) {
+      // The GPU is done with the frame once it has been read back, so its
+      // time is ready without waiting
+      GLuint64 gpu_start, gpu_end;
+      glGetQueryObjectui64v(queries[0], GL_QUERY_RESULT, &gpu_start);
+      glGetQueryObjectui64v(queries[1], GL_QUERY_RESULT, &gpu_end);
+      glDeleteQueries(2, queries);
+      auto now = std::chrono::steady_clock::now();
+      std::chrono::duration<double, std::milli> wall = now - last_done;
+      last_done = now;
+      if (log) {
+        double gpu_ms = (gpu_end - gpu_start) / 1e6;
+        fprintf(log, "%d,%d,%.2f,%.2f,%.2f,%.4g\n", f, samples, scene_ms,
+                gpu_ms, wall.count(), *variance * gpu_ms / samples);
+      }
+      printf("Frame %d/%d done in %.0f ms\n", f + 1, sequence.frames,
+             wall.count());
+      queue_image(writer, name, first_channels(image, 3));
+    });
+    // Make sure the GPU starts on this frame before the CPU turns to the next
+    glFlush();
+
+    if (f + 1 < sequence.frames) {
+      scene_ms = prepare_sequence_frame(sequence, f + 1,
+                                        scene_buffers[1 - traced_scene]);
+      traced_scene = 1 - traced_scene;
+    }
+    poll_readback(readback);
+  }
+  poll_readback(readback, true);
+  wait_idle(writer);
+
+  std::chrono::duration<double> total = std::chrono::steady_clock::now() - start;
+  printf("Rendered %d frames in %.1f s\n", sequence.frames, total.count());
+  if (log) {
+    fclose(log);
+  }
+  return true;
+}
+
+void keyboard(unsigned char key, int x, int y) {
+  if (key == 'o') {
+    orbit_camera = !orbit_camera;
+    printf(orbit_camera ? "Orbiting the camera\n" : "Flying the camera\n");
+  } else if (key == 'n') {
+    denoiser->enabled = !denoiser->enabled;
+  } else if (key == 'p') {
+    save_render();
+  } else if (key == 'v') {
+    recording = !recording;
+    printf(recording ? "Recording frames\n" : "Stopped recording\n");
+  }
+}
+
 int main(int argc, char *argv[]) {
+  // Shaders are compiled on a thread of their own with a shared context
+  XInitThreads();
   glutInit(&argc, argv);
   glutInitDisplayMode(GLUT_RGBA | GLUT_DEPTH | GLUT_DOUBLE);
-  glutInitContextVersion(3, 2);
+  glutInitContextVersion(3, 3);
   glutInitWindowSize(SCREEN_WIDTH, SCREEN_HEIGHT);
   glutCreateWindow("GPU Ray tracer");
   glutDisplayFunc(display);
+  glutKeyboardFunc(keyboard);
+  glutMouseFunc(mouse);
+  glutMotionFunc(mouse_drag);
   glutRepeatingTimer(40);
 
   init();
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--resume") == 0) {
+      const char *filename = i + 1 < argc ? argv[++i] : CHECKPOINT_FILE;
+      if (!resume_render(filename)) {
+        exit(1);
+      }
+    } else if (strcmp(argv[i], "--frame-ms") == 0 && i + 1 < argc) {
+      frame_ms = atof(argv[++i]);
+      if (frame_ms <= 0.0f) {
+        fprintf(stderr, "--frame-ms needs a positive time\n");
+        exit(1);
+      }
+    } else if (strcmp(argv[i], "--spp") == 0 && i + 1 < argc) {
+      frame_budget.fixed_samples = frame_budget.samples = atoi(argv[++i]);
+      if (frame_budget.samples <= 0) {
+        fprintf(stderr, "--spp needs a positive sample count\n");
+        exit(1);
+      }
+    } else if (strcmp(argv[i], "--tile-size") == 0 && i + 1 < argc) {
+      frame_budget.fixed_tile_size = frame_budget.tile_size = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--flush-tiles") == 0) {
+      flush_tiles = true;
+    } else if (strcmp(argv[i], "--rr-depth") == 0 && i + 1 < argc) {
+      rr_min_depth = atoi(argv[++i]);
+      if (rr_min_depth < 0) {
+        fprintf(stderr, "--rr-depth needs a bounce count of 0 or more\n");
+        exit(1);
+      }
+    } else if (strcmp(argv[i], "--split") == 0 && i + 1 < argc) {
+      split_count = atoi(argv[++i]);
+      if (split_count <= 0) {
+        fprintf(stderr, "--split needs a positive branch count\n");
+        exit(1);
+      }
+    } else if (strcmp(argv[i], "--environment") == 0 && i + 1 < argc) {
+      environment = load_environment(argv[++i]);
+      if (!environment) {
+        exit(1);
+      }
+    } else if (strcmp(argv[i], "--sequence") == 0 && i + 1 < argc) {
+      Sequence sequence;
+      bool ok = read_sequence(argv[++i], sequence) && render_sequence(sequence);
+      dispose_async_writer(writer);
+      exit(ok ? 0 : 1);
+    }
+  }
+  // Sequences are rendered above without it, as they wait for every frame
+  // anyway and are not edited while they run
+  start_background_compiler(tracer_variants);
   glutMainLoop();
+  stop_background_compiler(tracer_variants);
+
+  // The GL context is gone by now, so readbacks still in flight are lost, but
+  // images already handed to the writer thread are finished
+  dispose_async_writer(writer);
   exit(0);
 }
@@ -2,8 +2,22 @@
  * NB! Make sure to keep order and type of the struct members consistent with
  * the same struct in tracer.frag. Padding and alignment needs to be correct
  * when uploading to GPU.
+ *
+ * Every distinct material is stored once, in a table that primitives refer to
+ * by index, so scenes with many primitives of a few materials stay small.
+ *
+ * Rough reflection and refraction are GGX microfacet lobes, see microfacet.h.
+ * The width of the reflection lobe comes from both specular_roughness and
+ * specular_fuzz, as the root of the sum of their squares.
+ *
+ * A material can take its albedo, specular roughness and emission colour from
+ * layers of the scene's texture array, see textures.h, which multiply the
+ * plain values. -1 means no texture.
  */
 #pragma once
+#include <string>
+#include <unordered_map>
+#include <vector>
 #include "VectorUtils4.h"
 
 struct Material {
@@ -20,7 +34,9 @@ struct Material {
   GLfloat refraction_roughness;
   GLfloat f0;
   GLfloat f90;
-  GLfloat padding[3];
+  GLint albedo_texture;
+  GLint roughness_texture;
+  GLint emission_texture;
 
   static Material init_zero() {
     Material m{};
@@ -37,6 +53,9 @@ struct Material {
     m.refraction_colour = vec4(0.0, 0.0, 0.0, 0.0);
     m.f0 = 0.0;
     m.f90 = 1.0;
+    m.albedo_texture = -1;
+    m.roughness_texture = -1;
+    m.emission_texture = -1;
     return m;
   }
 
@@ -82,3 +101,44 @@ struct Material {
     return m;
   }
 };
+
+static_assert(sizeof(Material) == 112, "Material must match tracer.frag");
+
+// Bits of the mask of material features a scene uses, which lets the tracer
+// compile out the others. Must match MATERIAL_FEATURES in tracer.frag.
+const int MATERIAL_SPECULAR = 1;
+const int MATERIAL_REFRACTION = 2;
+const int MATERIAL_EMISSION = 4;
+const int MATERIAL_TEXTURES = 8;
+
+inline int material_features(const std::vector<Material> &materials) {
+  int features = 0;
+  for (const Material &m : materials) {
+    features |= m.specular_chance > 0.0f ? MATERIAL_SPECULAR : 0;
+    features |= m.refraction_chance > 0.0f ? MATERIAL_REFRACTION : 0;
+    features |= m.emission_strength > 0.0f ? MATERIAL_EMISSION : 0;
+    features |= m.albedo_texture >= 0 || m.roughness_texture >= 0 ||
+                        m.emission_texture >= 0
+                    ? MATERIAL_TEXTURES
+                    : 0;
+  }
+  return features;
+}
+
+// Every distinct material once, in the order they were added, with the index
+// of each keyed on its bytes so that adding is constant time
+struct MaterialTable {
+  std::vector<Material> materials;
+  std::unordered_map<std::string, GLuint> indices;
+};
+
+// Returns the index of material in the table, adding it to the end unless an
+// identical one is already there
+inline GLuint add_material(MaterialTable &table, const Material &material) {
+  std::string key((const char *)&material, sizeof(Material));
+  auto found = table.indices.emplace(key, GLuint(table.materials.size()));
+  if (found.second) {
+    table.materials.push_back(material);
+  }
+  return found.first->second;
+}
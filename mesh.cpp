@@ -0,0 +1,278 @@
+#include "mesh.h"
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+// Bump whenever the layout of the header, the arrays or BVHNode changes
+const uint32_t MESH_CACHE_VERSION = 1;
+const char MESH_CACHE_MAGIC[8] = {'R', 'T', 'M', 'E', 'S', 'H', '\0', '\0'};
+
+// All arrays are stored after the header at 16 byte aligned offsets. An
+// offset of zero means the array is absent, which only normals and texture
+// coordinates may be.
+struct MeshCacheHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t header_size;
+
+  // Identifies the OBJ file the cache was built from
+  uint64_t source_size;
+  int64_t source_mtime_ns;
+  uint64_t source_hash;
+
+  uint32_t num_vertices;
+  uint32_t num_indices;
+  uint32_t num_bvh_nodes;
+  uint32_t padding;
+
+  uint64_t positions_offset;
+  uint64_t normals_offset;
+  uint64_t tex_coords_offset;
+  uint64_t indices_offset;
+  uint64_t bvh_nodes_offset;
+  uint64_t bvh_prim_indices_offset;
+};
+
+struct SourceInfo {
+  uint64_t size;
+  int64_t mtime_ns;
+};
+
+bool stat_source(const char *filename, SourceInfo *info) {
+  struct stat st;
+  if (stat(filename, &st) != 0) {
+    return false;
+  }
+  info->size = st.st_size;
+  info->mtime_ns = int64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+  return true;
+}
+
+// 64-bit FNV-1a over the whole file
+uint64_t hash_file(const char *filename) {
+  uint64_t hash = 0xcbf29ce484222325ull;
+  FILE *f = fopen(filename, "rb");
+  if (f == NULL) {
+    return 0;
+  }
+  unsigned char buf[1 << 16];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+    for (size_t i = 0; i < n; i++) {
+      hash = (hash ^ buf[i]) * 0x100000001b3ull;
+    }
+  }
+  fclose(f);
+  return hash;
+}
+
+uint64_t align16(uint64_t offset) { return (offset + 15) & ~uint64_t(15); }
+
+bool array_in_file(uint64_t offset, uint64_t bytes, size_t file_size) {
+  return offset % 16 == 0 && offset >= sizeof(MeshCacheHeader) &&
+         offset <= file_size && bytes <= file_size - offset;
+}
+
+// Stores a new source mtime in the header of an existing cache. Failing only
+// means the next load hashes the OBJ again.
+void write_cache_mtime(const std::string &cache_name, int64_t mtime_ns) {
+  int fd = open(cache_name.c_str(), O_WRONLY);
+  if (fd < 0) {
+    return;
+  }
+  if (pwrite(fd, &mtime_ns, sizeof(mtime_ns),
+             offsetof(MeshCacheHeader, source_mtime_ns)) != sizeof(mtime_ns)) {
+    fprintf(stderr, "Could not update mesh cache %s\n", cache_name.c_str());
+  }
+  close(fd);
+}
+
+TriangleMesh *map_cache(const std::string &cache_name, const char *filename,
+                        const SourceInfo &source) {
+  int fd = open(cache_name.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return NULL;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || size_t(st.st_size) < sizeof(MeshCacheHeader)) {
+    close(fd);
+    return NULL;
+  }
+  size_t file_size = st.st_size;
+  void *mapping = mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    return NULL;
+  }
+
+  const MeshCacheHeader *h = (const MeshCacheHeader *)mapping;
+  bool valid = memcmp(h->magic, MESH_CACHE_MAGIC, sizeof(h->magic)) == 0 &&
+               h->version == MESH_CACHE_VERSION &&
+               h->header_size == sizeof(MeshCacheHeader) &&
+               h->source_size == source.size && h->num_indices % 3 == 0;
+
+  // An unchanged mtime is trusted as is. Otherwise the file may only have
+  // been touched or copied, so fall back to comparing content hashes, and
+  // keep the new mtime so later loads need not hash again.
+  if (valid && h->source_mtime_ns != source.mtime_ns) {
+    valid = h->source_hash == hash_file(filename);
+    if (valid) {
+      write_cache_mtime(cache_name, source.mtime_ns);
+    }
+  }
+
+  GLuint num_triangles = valid ? h->num_indices / 3 : 0;
+  valid = valid &&
+          array_in_file(h->positions_offset, h->num_vertices * sizeof(vec3), file_size) &&
+          (h->normals_offset == 0 ||
+           array_in_file(h->normals_offset, h->num_vertices * sizeof(vec3), file_size)) &&
+          (h->tex_coords_offset == 0 ||
+           array_in_file(h->tex_coords_offset, h->num_vertices * sizeof(vec2), file_size)) &&
+          array_in_file(h->indices_offset, h->num_indices * sizeof(GLuint), file_size) &&
+          array_in_file(h->bvh_nodes_offset, h->num_bvh_nodes * sizeof(BVHNode), file_size) &&
+          array_in_file(h->bvh_prim_indices_offset, num_triangles * sizeof(GLuint), file_size);
+  if (!valid) {
+    munmap(mapping, file_size);
+    return NULL;
+  }
+
+  char *base = (char *)mapping;
+  TriangleMesh *mesh = new TriangleMesh{};
+  mesh->model = LoadDataToModel(
+      (vec3 *)(base + h->positions_offset),
+      h->normals_offset ? (vec3 *)(base + h->normals_offset) : NULL,
+      h->tex_coords_offset ? (vec2 *)(base + h->tex_coords_offset) : NULL, NULL,
+      (GLuint *)(base + h->indices_offset), h->num_vertices, h->num_indices);
+  mesh->num_triangles = num_triangles;
+  mesh->bvh_nodes = (const BVHNode *)(base + h->bvh_nodes_offset);
+  mesh->num_bvh_nodes = h->num_bvh_nodes;
+  mesh->bvh_prim_indices = (const GLuint *)(base + h->bvh_prim_indices_offset);
+  mesh->mapping = mapping;
+  mesh->mapping_size = file_size;
+  return mesh;
+}
+
+void write_cache(const std::string &cache_name, const char *filename,
+                 const SourceInfo &source, const TriangleMesh *mesh) {
+  const Model *m = mesh->model;
+  MeshCacheHeader h{};
+  memcpy(h.magic, MESH_CACHE_MAGIC, sizeof(h.magic));
+  h.version = MESH_CACHE_VERSION;
+  h.header_size = sizeof(MeshCacheHeader);
+  h.source_size = source.size;
+  h.source_mtime_ns = source.mtime_ns;
+  h.source_hash = hash_file(filename);
+  h.num_vertices = m->numVertices;
+  h.num_indices = m->numIndices;
+  h.num_bvh_nodes = mesh->num_bvh_nodes;
+
+  struct Array {
+    uint64_t *offset;
+    const void *data;
+    size_t bytes;
+  } arrays[] = {
+      {&h.positions_offset, m->vertexArray, m->numVertices * sizeof(vec3)},
+      {&h.normals_offset, m->normalArray, m->numVertices * sizeof(vec3)},
+      {&h.tex_coords_offset, m->texCoordArray, m->numVertices * sizeof(vec2)},
+      {&h.indices_offset, m->indexArray, m->numIndices * sizeof(GLuint)},
+      {&h.bvh_nodes_offset, mesh->bvh_nodes, mesh->num_bvh_nodes * sizeof(BVHNode)},
+      {&h.bvh_prim_indices_offset, mesh->bvh_prim_indices,
+       mesh->num_triangles * sizeof(GLuint)},
+  };
+  uint64_t offset = align16(sizeof(MeshCacheHeader));
+  for (Array &a : arrays) {
+    if (a.data == NULL) {
+      continue;
+    }
+    *a.offset = offset;
+    offset = align16(offset + a.bytes);
+  }
+
+  // Write to a temporary file and rename it into place so that a crash or a
+  // concurrent launch never sees a half written cache
+  std::string tmp_name = cache_name + ".tmp";
+  FILE *f = fopen(tmp_name.c_str(), "wb");
+  if (f == NULL) {
+    fprintf(stderr, "Could not write mesh cache %s\n", cache_name.c_str());
+    return;
+  }
+  bool ok = fwrite(&h, sizeof(h), 1, f) == 1;
+  static const char zeros[16] = {};
+  uint64_t written = sizeof(h);
+  for (Array &a : arrays) {
+    if (a.data == NULL) {
+      continue;
+    }
+    ok = ok && fwrite(zeros, 1, *a.offset - written, f) == *a.offset - written;
+    ok = ok && (a.bytes == 0 || fwrite(a.data, a.bytes, 1, f) == 1);
+    written = *a.offset + a.bytes;
+  }
+  ok = fclose(f) == 0 && ok;
+  if (!ok || rename(tmp_name.c_str(), cache_name.c_str()) != 0) {
+    fprintf(stderr, "Could not write mesh cache %s\n", cache_name.c_str());
+    remove(tmp_name.c_str());
+  }
+}
+
+} // namespace
+
+TriangleMesh *load_mesh(const char *filename) {
+  SourceInfo source;
+  if (!stat_source(filename, &source)) {
+    fprintf(stderr, "Could not open mesh %s\n", filename);
+    return NULL;
+  }
+
+  std::string cache_name = std::string(filename) + ".rtcache";
+  TriangleMesh *mesh = map_cache(cache_name, filename, source);
+  if (mesh != NULL) {
+    return mesh;
+  }
+
+  // Cache missing or stale, parse the OBJ and build the BVH from scratch
+  Model *model = LoadModel(filename);
+  if (model == NULL || model->vertexArray == NULL || model->numIndices == 0) {
+    fprintf(stderr, "Could not load mesh %s\n", filename);
+    DisposeModel(model);
+    return NULL;
+  }
+  GLuint num_triangles = model->numIndices / 3;
+  std::vector<AABB> tri_bounds(num_triangles);
+  for (GLuint t = 0; t < num_triangles; t++) {
+    for (int k = 0; k < 3; k++) {
+      tri_bounds[t].grow(model->vertexArray[model->indexArray[3 * t + k]]);
+    }
+  }
+
+  mesh = new TriangleMesh{};
+  mesh->model = model;
+  mesh->num_triangles = num_triangles;
+  mesh->bvh = new BVH();
+  mesh->bvh->build_parallel(tri_bounds);
+  mesh->bvh_nodes = mesh->bvh->nodes.data();
+  mesh->num_bvh_nodes = mesh->bvh->nodes.size();
+  mesh->bvh_prim_indices = mesh->bvh->prim_indices.data();
+
+  write_cache(cache_name, filename, source, mesh);
+  return mesh;
+}
+
+void dispose_mesh(TriangleMesh *mesh) {
+  if (mesh == NULL) {
+    return;
+  }
+  DisposeModel(mesh->model);
+  if (mesh->mapping != NULL) {
+    munmap(mesh->mapping, mesh->mapping_size);
+  }
+  delete mesh->bvh;
+  delete mesh;
+}
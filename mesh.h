@@ -0,0 +1,31 @@
+/*
+ * Triangle meshes loaded from OBJ files together with a BVH over their
+ * triangles. The parsed vertex data and the BVH are cached in a binary file
+ * next to the OBJ (model.obj -> model.obj.rtcache) so that later loads can
+ * memory map the cache instead of parsing and building again.
+ */
+#pragma once
+#include "LittleOBJLoader.h"
+#include "bvh.h"
+
+struct TriangleMesh {
+  // GPU buffers for the mesh. When loaded from the cache the vertex arrays
+  // point straight into the mapped file.
+  Model *model;
+
+  // Triangle i consists of model->indexArray[3*i .. 3*i+2]
+  GLuint num_triangles;
+  const BVHNode *bvh_nodes;
+  GLuint num_bvh_nodes;
+  const GLuint *bvh_prim_indices; // One per triangle
+
+  // Backing storage, either a file mapping or the heap
+  void *mapping;
+  size_t mapping_size;
+  BVH *bvh;
+};
+
+// Loads a mesh from the cache if it is still valid for the OBJ file, else
+// parses the OBJ, builds the BVH and writes a new cache.
+TriangleMesh *load_mesh(const char *filename);
+void dispose_mesh(TriangleMesh *mesh);
@@ -0,0 +1,177 @@
+// Checks the mesh cache in mesh.cpp: a second load of an OBJ maps the cache
+// the first one wrote and gets the same triangles and BVH, a changed OBJ is
+// parsed again, and files that give no mesh are refused.
+//
+// Usage: make test
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#define MAIN
+#include "VectorUtils4.h"
+#include "LittleOBJLoader.h"
+#include "mesh.h"
+
+static int failures = 0;
+
+static void check(bool ok, const char *what) {
+  if (!ok) {
+    printf("FAIL %s\n", what);
+    failures++;
+  }
+}
+
+// LoadModel() makes GL buffers, so the meshes need a current context. A
+// surfaceless EGL one needs neither a window nor a display server.
+static bool make_context() {
+  EGLDisplay display = EGL_NO_DISPLAY;
+  PFNEGLGETPLATFORMDISPLAYEXTPROC get_platform_display =
+      (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+  if (get_platform_display) {
+    display = get_platform_display(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY,
+                                   NULL);
+  }
+  if (display == EGL_NO_DISPLAY) {
+    display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+  }
+  if (display == EGL_NO_DISPLAY || !eglInitialize(display, NULL, NULL) ||
+      !eglBindAPI(EGL_OPENGL_API)) {
+    return false;
+  }
+  const EGLint config_attribs[] = {EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+                                   EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT, EGL_NONE};
+  EGLConfig config;
+  EGLint num_configs = 0;
+  if (!eglChooseConfig(display, config_attribs, &config, 1, &num_configs) ||
+      num_configs == 0) {
+    return false;
+  }
+  const EGLint context_attribs[] = {
+      EGL_CONTEXT_MAJOR_VERSION, 3, EGL_CONTEXT_MINOR_VERSION, 3,
+      EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+      EGL_NONE};
+  EGLContext context =
+      eglCreateContext(display, config, EGL_NO_CONTEXT, context_attribs);
+  return context != EGL_NO_CONTEXT &&
+         eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context);
+}
+
+// An n by n grid of quads, split into triangles by the loader. A transposed
+// grid is a different file of the same size.
+static bool write_grid(const std::string &filename, int n,
+                       bool transposed = false) {
+  FILE *f = fopen(filename.c_str(), "w");
+  if (f == NULL) {
+    return false;
+  }
+  for (int y = 0; y <= n; y++) {
+    for (int x = 0; x <= n; x++) {
+      fprintf(f, "v %d 0 %d\n", transposed ? y : x, transposed ? x : y);
+    }
+  }
+  for (int y = 0; y < n; y++) {
+    for (int x = 0; x < n; x++) {
+      int i = y * (n + 1) + x + 1;
+      fprintf(f, "f %d %d %d %d\n", i, i + n + 1, i + n + 2, i + 1);
+    }
+  }
+  return fclose(f) == 0;
+}
+
+static bool set_mtime(const std::string &filename, time_t seconds) {
+  struct timespec times[2] = {{seconds, 0}, {seconds, 0}};
+  return utimensat(AT_FDCWD, filename.c_str(), times, 0) == 0;
+}
+
+static bool same_mesh(const TriangleMesh *a, const TriangleMesh *b) {
+  return a->num_triangles == b->num_triangles &&
+         a->model->numVertices == b->model->numVertices &&
+         a->num_bvh_nodes == b->num_bvh_nodes &&
+         memcmp(a->model->vertexArray, b->model->vertexArray,
+                a->model->numVertices * sizeof(vec3)) == 0 &&
+         memcmp(a->model->indexArray, b->model->indexArray,
+                3 * a->num_triangles * sizeof(GLuint)) == 0 &&
+         memcmp(a->bvh_nodes, b->bvh_nodes, a->num_bvh_nodes * sizeof(BVHNode)) == 0 &&
+         memcmp(a->bvh_prim_indices, b->bvh_prim_indices,
+                a->num_triangles * sizeof(GLuint)) == 0;
+}
+
+int main() {
+  if (!make_context()) {
+    printf("FAIL Could not make a GL context to load meshes with\n");
+    return 1;
+  }
+
+  char dir[] = "/tmp/mesh_test_XXXXXX";
+  if (mkdtemp(dir) == NULL) {
+    printf("Could not make a temporary directory\n");
+    return 1;
+  }
+  std::string obj = std::string(dir) + "/grid.obj";
+  std::string cache = obj + ".rtcache";
+
+  check(write_grid(obj, 16), "write OBJ");
+  TriangleMesh *first = load_mesh(obj.c_str());
+  check(first != NULL && first->mapping == NULL, "first load parses the OBJ");
+  check(first != NULL && first->num_triangles == 2 * 16 * 16,
+        "first load has every triangle");
+  check(first != NULL && glIsVertexArray(first->model->vao),
+        "first load makes GL buffers");
+  check(access(cache.c_str(), F_OK) == 0, "first load writes the cache");
+
+  TriangleMesh *second = load_mesh(obj.c_str());
+  check(second != NULL && second->mapping != NULL, "second load hits the cache");
+  check(first != NULL && second != NULL && same_mesh(first, second),
+        "cached mesh matches the parsed one");
+  dispose_mesh(second);
+
+  // A touched OBJ is hashed once and the cache takes its new mtime, which is
+  // trusted from then on: an edit of the same size that keeps that mtime is
+  // not noticed, as it is not hashed again
+  check(set_mtime(obj, 1000000000), "touch OBJ");
+  TriangleMesh *touched = load_mesh(obj.c_str());
+  check(touched != NULL && touched->mapping != NULL, "touched OBJ hits the cache");
+  dispose_mesh(touched);
+  check(write_grid(obj, 16, true) && set_mtime(obj, 1000000000),
+        "rewrite OBJ keeping size and mtime");
+  TriangleMesh *trusted = load_mesh(obj.c_str());
+  check(trusted != NULL && trusted->mapping != NULL,
+        "cache keeps the mtime of a touched OBJ");
+  dispose_mesh(trusted);
+
+  check(write_grid(obj, 17), "rewrite OBJ");
+  TriangleMesh *changed = load_mesh(obj.c_str());
+  check(changed != NULL && changed->mapping == NULL,
+        "changed OBJ is parsed again");
+  check(changed != NULL && changed->num_triangles == 2 * 17 * 17,
+        "changed OBJ has every triangle");
+  dispose_mesh(changed);
+  dispose_mesh(first);
+
+  std::string empty = std::string(dir) + "/empty.obj";
+  FILE *f = fopen(empty.c_str(), "w");
+  check(f != NULL && fputs("# no faces\n", f) >= 0 && fclose(f) == 0,
+        "write empty OBJ");
+  check(load_mesh(empty.c_str()) == NULL, "OBJ without triangles is refused");
+  check(load_mesh((std::string(dir) + "/missing.obj").c_str()) == NULL,
+        "missing OBJ is refused");
+
+  remove(cache.c_str());
+  remove(obj.c_str());
+  remove((empty + ".rtcache").c_str());
+  remove(empty.c_str());
+  rmdir(dir);
+
+  if (failures > 0) {
+    printf("%d checks failed\n", failures);
+    return 1;
+  }
+  printf("All mesh checks passed\n");
+  return 0;
+}
@@ -0,0 +1,209 @@
+/*
+ * GGX microfacet lobes, the CPU side of the functions of the same names in
+ * tracer.frag, for checking the sampling and densities away from the GPU;
+ * microfacet_test.cpp does, run it with make test. The refraction lobe's
+ * value and density are only needed here, the tracer just samples it.
+ *
+ * Every lobe is described by the unit shading normal n, the unit direction v
+ * towards the viewer and alpha, the GGX width, which is the square of the
+ * material's roughness. Scattered directions l point away from the surface.
+ * The Fresnel term is left out: the tracer already picks between diffuse,
+ * reflection and refraction by it, so a lobe only ever gets the light that
+ * Fresnel sends its way.
+ *
+ * Directions are sampled from the distribution of normals visible from v,
+ * after Heitz, "Sampling the GGX Distribution of Visible Normals" (2018).
+ * Every sample then carries a throughput of G2 / G1(v), between 0 and 1,
+ * which is what keeps rough lobes from adding energy. The shadowing is
+ * Smith's, height-correlated.
+ */
+#pragma once
+#include <math.h>
+#include "VectorUtils4.h"
+#include "rng.h"
+
+// Smoothest width used, smooth mirrors and glass are very narrow lobes
+const float GGX_MIN_ALPHA = 1e-3f;
+
+inline float ggx_alpha(float roughness) {
+  return fmaxf(roughness * roughness, GGX_MIN_ALPHA);
+}
+
+// Smith's Lambda for a direction at cos_theta from the normal
+inline float ggx_lambda(float cos_theta, float alpha) {
+  float cos2 = cos_theta * cos_theta;
+  float tan2 = fmaxf(1.0f - cos2, 0.0f) / fmaxf(cos2, 1e-8f);
+  return 0.5f * (sqrtf(1.0f + alpha * alpha * tan2) - 1.0f);
+}
+
+// Density of microfacet normals at cos_m from the normal, per unit of
+// projected solid angle
+inline float ggx_d(float cos_m, float alpha) {
+  float a2 = alpha * alpha;
+  float d = cos_m * cos_m * (a2 - 1.0f) + 1.0f;
+  return a2 / (float(M_PI) * d * d);
+}
+
+inline float ggx_g1(float cos_v, float alpha) {
+  return 1.0f / (1.0f + ggx_lambda(cos_v, alpha));
+}
+
+// A microfacet normal picked from those visible from v, from two uniform
+// numbers in [0, 1)
+inline vec3 sample_ggx_vndf(vec3 n, vec3 v, float alpha, float u1, float u2) {
+  // Tangent frame around n, from Duff et al., "Building an Orthonormal Basis,
+  // Revisited" (2017)
+  float z_sign = copysignf(1.0f, n.z);
+  float a = -1.0f / (z_sign + n.z);
+  float b = n.x * n.y * a;
+  vec3 t1 = vec3(1.0f + z_sign * n.x * n.x * a, z_sign * b, -z_sign * n.x);
+  vec3 t2 = vec3(b, z_sign + n.y * n.y * a, -n.y);
+
+  // Stretch the view so the lobe becomes the hemisphere of alpha 1, pick a
+  // point on the disk it projects to and stretch the normal there back
+  vec3 vh = normalize(vec3(alpha * dot(v, t1), alpha * dot(v, t2), dot(v, n)));
+  float len2 = vh.x * vh.x + vh.y * vh.y;
+  vec3 b1 = len2 > 0.0f ? vec3(-vh.y, vh.x, 0.0f) / sqrtf(len2)
+                        : vec3(1.0f, 0.0f, 0.0f);
+  vec3 b2 = cross(vh, b1);
+  float r = sqrtf(u1);
+  float phi = 2.0f * float(M_PI) * u2;
+  float p1 = r * cosf(phi);
+  float p2 = r * sinf(phi);
+  float s = 0.5f * (1.0f + vh.z);
+  p2 = (1.0f - s) * sqrtf(fmaxf(1.0f - p1 * p1, 0.0f)) + s * p2;
+  vec3 nh = p1 * b1 + p2 * b2 +
+            sqrtf(fmaxf(1.0f - p1 * p1 - p2 * p2, 0.0f)) * vh;
+  vec3 m = normalize(vec3(alpha * nh.x, alpha * nh.y, fmaxf(nh.z, 0.0f)));
+  return m.x * t1 + m.y * t2 + m.z * n;
+}
+
+// Throughput of l, scattered about the microfacet normal m that
+// sample_ggx_vndf() gave, by reflection or refraction. 0 when l ends up on
+// the other side of the surface than m sends it.
+inline float ggx_sample_weight(vec3 n, vec3 v, vec3 m, vec3 l, float alpha) {
+  float cos_l = dot(n, l);
+  if (cos_l * dot(m, l) <= 0.0f) {
+    return 0.0f;
+  }
+  float lambda_v = ggx_lambda(dot(n, v), alpha);
+  float lambda_l = ggx_lambda(fabsf(cos_l), alpha);
+  return (1.0f + lambda_v) / (1.0f + lambda_v + lambda_l);
+}
+
+// The reflection lobe times the cosine at l, D G2 / (4 cos_v)
+inline float ggx_reflection(vec3 n, vec3 v, vec3 l, float alpha) {
+  float cos_v = dot(n, v), cos_l = dot(n, l);
+  if (cos_v <= 0.0f || cos_l <= 0.0f) {
+    return 0.0f;
+  }
+  vec3 m = normalize(v + l);
+  float g2 = 1.0f / (1.0f + ggx_lambda(cos_v, alpha) + ggx_lambda(cos_l, alpha));
+  return ggx_d(dot(n, m), alpha) * g2 / (4.0f * cos_v);
+}
+
+// Density over solid angle of reflecting v to l about a normal from
+// sample_ggx_vndf(), G1(v) D / (4 cos_v)
+inline float ggx_reflection_pdf(vec3 n, vec3 v, vec3 l, float alpha) {
+  float cos_v = dot(n, v), cos_l = dot(n, l);
+  if (cos_v <= 0.0f || cos_l <= 0.0f) {
+    return 0.0f;
+  }
+  vec3 m = normalize(v + l);
+  return ggx_g1(cos_v, alpha) * ggx_d(dot(n, m), alpha) / (4.0f * cos_v);
+}
+
+// Refracts v about the microfacet normal m into l, for eta the index of
+// refraction on the far side of the surface over the one on v's side, like
+// refract() in tracer.frag. Returns false on total internal reflection.
+inline bool ggx_refract(vec3 v, vec3 m, float eta, vec3 &l) {
+  float cos_i = dot(v, m);
+  float sin2_t = (1.0f - cos_i * cos_i) / (eta * eta);
+  if (sin2_t >= 1.0f) {
+    return false;
+  }
+  l = (cos_i / eta - sqrtf(1.0f - sin2_t)) * m - v / eta;
+  return true;
+}
+
+// Half vector of v and a refracted l, on v's side of the surface
+inline vec3 ggx_refraction_normal(vec3 n, vec3 v, vec3 l, float eta) {
+  vec3 m = normalize(-(v + eta * l));
+  return dot(m, n) < 0.0f ? -m : m;
+}
+
+// The refraction lobe times the cosine at l, after Walter et al.,
+// "Microfacet Models for Refraction through Rough Surfaces" (2007). Like the
+// tracer it leaves out the scaling of radiance by eta^2 on the way through.
+inline float ggx_refraction(vec3 n, vec3 v, vec3 l, float alpha, float eta) {
+  float cos_v = dot(n, v), cos_l = dot(n, l);
+  if (cos_v <= 0.0f || cos_l >= 0.0f) {
+    return 0.0f;
+  }
+  vec3 m = ggx_refraction_normal(n, v, l, eta);
+  float v_m = dot(v, m), l_m = dot(l, m);
+  float denom = v_m + eta * l_m;
+  if (v_m <= 0.0f || l_m >= 0.0f || denom == 0.0f) {
+    return 0.0f;
+  }
+  float g2 = 1.0f / (1.0f + ggx_lambda(cos_v, alpha) + ggx_lambda(cos_l, alpha));
+  return v_m * -l_m * eta * eta * ggx_d(dot(n, m), alpha) * g2 /
+         (cos_v * denom * denom);
+}
+
+// Density over solid angle of refracting v to l about a normal from
+// sample_ggx_vndf()
+inline float ggx_refraction_pdf(vec3 n, vec3 v, vec3 l, float alpha,
+                                float eta) {
+  float cos_v = dot(n, v), cos_l = dot(n, l);
+  if (cos_v <= 0.0f || cos_l >= 0.0f) {
+    return 0.0f;
+  }
+  vec3 m = ggx_refraction_normal(n, v, l, eta);
+  float v_m = dot(v, m), l_m = dot(l, m);
+  float denom = v_m + eta * l_m;
+  if (v_m <= 0.0f || l_m >= 0.0f || denom == 0.0f) {
+    return 0.0f;
+  }
+  return ggx_g1(cos_v, alpha) * ggx_d(dot(n, m), alpha) * v_m * -l_m * eta *
+         eta / (cos_v * denom * denom);
+}
+
+// Share of the light from v that the reflection lobe sends back out, by
+// averaging the throughput of sample_count sampled directions. It is at most
+// 1; the rest is light that would take several bounces between microfacets
+// to leave. sample is the Rng's sample index, the bounce is unused.
+inline float ggx_reflection_albedo(float cos_v, float alpha, int sample_count,
+                                   uint32_t sample = 0) {
+  vec3 n = vec3(0.0f, 0.0f, 1.0f);
+  vec3 v = vec3(sqrtf(fmaxf(1.0f - cos_v * cos_v, 0.0f)), 0.0f, cos_v);
+  double total = 0.0;
+  for (int i = 0; i < sample_count; i++) {
+    Rng rng(uint32_t(i), sample);
+    float u1 = rng.next_float(), u2 = rng.next_float();
+    vec3 m = sample_ggx_vndf(n, v, alpha, u1, u2);
+    vec3 l = 2.0f * dot(v, m) * m - v;
+    total += ggx_sample_weight(n, v, m, l, alpha);
+  }
+  return float(total / sample_count);
+}
+
+// Share of the light from v that the refraction lobe passes on, counting
+// totally internally reflected directions as the tracer does. At most 1.
+inline float ggx_refraction_albedo(float cos_v, float alpha, float eta,
+                                   int sample_count, uint32_t sample = 0) {
+  vec3 n = vec3(0.0f, 0.0f, 1.0f);
+  vec3 v = vec3(sqrtf(fmaxf(1.0f - cos_v * cos_v, 0.0f)), 0.0f, cos_v);
+  double total = 0.0;
+  for (int i = 0; i < sample_count; i++) {
+    Rng rng(uint32_t(i), sample);
+    float u1 = rng.next_float(), u2 = rng.next_float();
+    vec3 m = sample_ggx_vndf(n, v, alpha, u1, u2);
+    vec3 l;
+    if (!ggx_refract(v, m, eta, l)) {
+      l = 2.0f * dot(v, m) * m - v;
+    }
+    total += ggx_sample_weight(n, v, m, l, alpha);
+  }
+  return float(total / sample_count);
+}
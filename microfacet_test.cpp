@@ -0,0 +1,167 @@
+// Checks the GGX lobes in microfacet.h: sampled throughput never adds energy,
+// the throughput of a sample is the lobe over its density, and the densities
+// integrate to the share of samples that leave on the side they should.
+//
+// Usage: make test
+
+#include <stdio.h>
+#define MAIN
+#include "VectorUtils4.h"
+#include "microfacet.h"
+
+static const float COS_VS[] = {0.05f, 0.2f, 0.5f, 0.8f, 1.0f};
+static const float ALPHAS[] = {GGX_MIN_ALPHA, 0.05f, 0.1f, 0.3f, 0.6f, 1.0f};
+// Into glass, and out of it where total internal reflection happens
+static const float ETAS[] = {1.5f, 1.0f / 1.5f};
+// Reflection, written as eta 0, and both refractions
+static const float LOBES[] = {0.0f, 1.5f, 1.0f / 1.5f};
+
+static int failures = 0;
+
+static void check(bool ok, const char *what, float cos_v, float alpha,
+                  float eta, double got, double expected) {
+  if (!ok) {
+    printf("FAIL %s: cos_v %g alpha %g eta %g: got %g, expected %g\n", what,
+           cos_v, alpha, eta, got, expected);
+    failures++;
+  }
+}
+
+static vec3 view_dir(float cos_v) {
+  return vec3(sqrtf(fmaxf(1.0f - cos_v * cos_v, 0.0f)), 0.0f, cos_v);
+}
+
+// Scatters v about a sampled normal like tracer.frag, by reflection for
+// eta 0 and by refraction otherwise. Returns false for total internal
+// reflection.
+static bool scatter(vec3 v, vec3 m, float eta, vec3 &l) {
+  if (eta == 0.0f) {
+    l = 2.0f * dot(v, m) * m - v;
+    return true;
+  }
+  return ggx_refract(v, m, eta, l);
+}
+
+static float lobe(vec3 n, vec3 v, vec3 l, float alpha, float eta) {
+  return eta == 0.0f ? ggx_reflection(n, v, l, alpha)
+                     : ggx_refraction(n, v, l, alpha, eta);
+}
+
+static float lobe_pdf(vec3 n, vec3 v, vec3 l, float alpha, float eta) {
+  return eta == 0.0f ? ggx_reflection_pdf(n, v, l, alpha)
+                     : ggx_refraction_pdf(n, v, l, alpha, eta);
+}
+
+// Compares the lobe over its density with the throughput of every sample,
+// and returns the share of samples that got scattered to the right side
+static double check_samples(float cos_v, float alpha, float eta,
+                            int sample_count) {
+  vec3 n = vec3(0.0f, 0.0f, 1.0f);
+  vec3 v = view_dir(cos_v);
+  int valid = 0;
+  int mismatches = 0;
+  double worst = 0.0, worst_expected = 0.0;
+  for (int i = 0; i < sample_count; i++) {
+    Rng rng(uint32_t(i), 1);
+    float u1 = rng.next_float(), u2 = rng.next_float();
+    vec3 m = sample_ggx_vndf(n, v, alpha, u1, u2);
+    vec3 l;
+    if (!scatter(v, m, eta, l)) {
+      continue;
+    }
+    float weight = ggx_sample_weight(n, v, m, l, alpha);
+    if (weight <= 0.0f) {
+      continue;
+    }
+    valid++;
+    float pdf = lobe_pdf(n, v, l, alpha, eta);
+    if (pdf <= 0.0f) {
+      mismatches++;
+      worst = 0.0;
+      worst_expected = weight;
+      continue;
+    }
+    double ratio = lobe(n, v, l, alpha, eta) / pdf;
+    if (fabs(ratio - weight) > 1e-3 * weight) {
+      mismatches++;
+      worst = ratio;
+      worst_expected = weight;
+    }
+  }
+  check(mismatches == 0, "lobe / pdf == sample weight", cos_v, alpha, eta,
+        worst, worst_expected);
+  return double(valid) / sample_count;
+}
+
+// Integrates the density over the hemisphere the lobe scatters into, in
+// steps of polar angle so the narrow lobes around the normal are resolved
+static double integrate_pdf(float cos_v, float alpha, float eta) {
+  const int theta_steps = 1024, phi_steps = 1024;
+  vec3 n = vec3(0.0f, 0.0f, 1.0f);
+  vec3 v = view_dir(cos_v);
+  float side = eta == 0.0f ? 1.0f : -1.0f;
+  double d_theta = 0.5 * M_PI / theta_steps, d_phi = 2.0 * M_PI / phi_steps;
+  double total = 0.0;
+  for (int i = 0; i < theta_steps; i++) {
+    double theta = (i + 0.5) * d_theta;
+    double ring = 0.0;
+    for (int j = 0; j < phi_steps; j++) {
+      double phi = (j + 0.5) * d_phi;
+      vec3 l = vec3(float(sin(theta) * cos(phi)), float(sin(theta) * sin(phi)),
+                    side * float(cos(theta)));
+      ring += lobe_pdf(n, v, l, alpha, eta);
+    }
+    total += ring * sin(theta) * d_theta * d_phi;
+  }
+  return total;
+}
+
+int main() {
+  const int sample_count = 1 << 18;
+
+  for (float cos_v : COS_VS) {
+    for (float alpha : ALPHAS) {
+      float albedo = ggx_reflection_albedo(cos_v, alpha, sample_count);
+      check(albedo <= 1.0f, "reflection albedo <= 1", cos_v, alpha, 0.0f,
+            albedo, 1.0);
+      for (float eta : ETAS) {
+        albedo = ggx_refraction_albedo(cos_v, alpha, eta, sample_count);
+        check(albedo <= 1.0f, "refraction albedo <= 1", cos_v, alpha, eta,
+              albedo, 1.0);
+      }
+    }
+  }
+
+  for (float cos_v : COS_VS) {
+    for (float alpha : ALPHAS) {
+      for (float eta : LOBES) {
+        double valid = check_samples(cos_v, alpha, eta, sample_count);
+        // Narrower lobes are too sharp to integrate on the grid
+        if (alpha < 0.1f) {
+          continue;
+        }
+        double integral = integrate_pdf(cos_v, alpha, eta);
+        check(fabs(integral - valid) < 0.01, "pdf integral == sampled share",
+              cos_v, alpha, eta, integral, valid);
+        check(integral < 1.01, "pdf integral <= 1", cos_v, alpha, eta,
+              integral, 1.0);
+      }
+    }
+  }
+
+  // Seen head on, a smooth lobe keeps nearly every sample, also when it
+  // refracts into glass
+  for (int i = 0; i < 2; i++) {
+    float eta = LOBES[i];
+    double integral = integrate_pdf(1.0f, 0.1f, eta);
+    check(fabs(integral - 1.0) < 0.01, "pdf integral == 1", 1.0f, 0.1f, eta,
+          integral, 1.0);
+  }
+
+  if (failures > 0) {
+    printf("%d checks failed\n", failures);
+    return 1;
+  }
+  printf("All microfacet checks passed\n");
+  return 0;
+}
@@ -0,0 +1,45 @@
+#version 150
+
+// Turns the accumulated (or denoised) linear radiance into the displayed
+// image: exposure, tone mapping and conversion to sRGB.
+
+in vec2 out_tex_coord;
+
+uniform sampler2D tex_unit;
+uniform float EXPOSURE;
+
+out vec4 out_colour;
+
+// Functions for colour correction --------------------------------------------
+vec3 less_than(vec3 v, float value) {
+  return vec3(
+    float(v.x < value),
+    float(v.y < value),
+    float(v.z < value)
+  );
+}
+
+vec3 linear_to_srgb(vec3 rgb) {
+  rgb = clamp(rgb, vec3(0.0), vec3(1.0));  
+  return mix(
+    pow(rgb, vec3(1.0/2.4)) * 1.055 - 0.055,
+    rgb * 12.92,
+    less_than(rgb, 0.0031308)
+  );
+}
+
+// Tone maps an HDR colour to LDR according to a luminance only fit
+// Code made by Krzysztof Narkowicz
+vec3 aces_film(vec3 hdr) {
+  float a = 2.51;
+  float b = 0.03;
+  float c = 2.43;
+  float d = 0.59;
+  float e = 0.14;
+  return clamp((hdr*(a*hdr + b)) / (hdr*(c*hdr + d) + e), 0.0, 1.0);
+}
+
+void main(void) {
+  vec3 radiance = texture(tex_unit, out_tex_coord).rgb;
+  out_colour = vec4(linear_to_srgb(aces_film(EXPOSURE * radiance)), 1.0);
+}
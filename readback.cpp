@@ -0,0 +1,106 @@
+#include "readback.h"
+#include <stdio.h>
+#include <string.h>
+
+namespace {
+
+size_t image_bytes(const Readback *readback) {
+  return size_t(readback->width) * readback->height * 4 * sizeof(float);
+}
+
+// Finishes the oldest readback in flight. Returns false if it has not arrived
+// yet and wait is not set.
+bool finish_oldest(Readback *readback, bool wait) {
+  ReadbackSlot &slot = readback->slots[readback->oldest];
+  // Flushing makes sure the fence reaches the GPU, or a blocking wait could
+  // wait forever
+  GLenum status = wait ? glClientWaitSync(slot.fence, GL_SYNC_FLUSH_COMMANDS_BIT,
+                                          GL_TIMEOUT_IGNORED)
+                       : glClientWaitSync(slot.fence, 0, 0);
+  if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED) {
+    if (status == GL_WAIT_FAILED) {
+      fprintf(stderr, "Waiting for a readback failed\n");
+    }
+    return false;
+  }
+  glDeleteSync(slot.fence);
+  slot.fence = 0;
+
+  Image image(readback->width, readback->height, 4);
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.pbo);
+  void *data =
+      glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, image_bytes(readback), GL_MAP_READ_BIT);
+  if (data) {
+    memcpy(image.pixels.data(), data, image_bytes(readback));
+    glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+  } else {
+    fprintf(stderr, "Could not map a readback buffer\n");
+  }
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+  readback->oldest = (readback->oldest + 1) % readback->slots.size();
+  readback->in_flight--;
+  // Taken out of the slot first, as done may start another readback
+  std::function<void(Image &&)> done = std::move(slot.done);
+  slot.done = nullptr;
+  if (data) {
+    done(std::move(image));
+  }
+  return true;
+}
+
+} // namespace
+
+Readback *create_readback(int width, int height, int ring_size) {
+  Readback *readback = new Readback();
+  readback->width = width;
+  readback->height = height;
+  readback->slots.resize(std::max(ring_size, 1));
+  readback->oldest = 0;
+  readback->in_flight = 0;
+  for (ReadbackSlot &slot : readback->slots) {
+    glGenBuffers(1, &slot.pbo);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.pbo);
+    glBufferData(GL_PIXEL_PACK_BUFFER, image_bytes(readback), NULL, GL_STREAM_READ);
+    slot.fence = 0;
+  }
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+  printError("create readback");
+  return readback;
+}
+
+void dispose_readback(Readback *readback) {
+  poll_readback(readback, true);
+  for (ReadbackSlot &slot : readback->slots) {
+    glDeleteBuffers(1, &slot.pbo);
+  }
+  delete readback;
+}
+
+void start_readback(Readback *readback, GLuint fb, GLenum attachment,
+                    std::function<void(Image &&)> done) {
+  if (readback->in_flight == (int)readback->slots.size()) {
+    finish_oldest(readback, true);
+  }
+  int index = (readback->oldest + readback->in_flight) % readback->slots.size();
+  ReadbackSlot &slot = readback->slots[index];
+
+  glBindFramebuffer(GL_READ_FRAMEBUFFER, fb);
+  glReadBuffer(attachment);
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.pbo);
+  // With a pack buffer bound the last argument is an offset into it, and the
+  // call returns without waiting for the GPU
+  glReadPixels(0, 0, readback->width, readback->height, GL_RGBA, GL_FLOAT, 0);
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+  glReadBuffer(fb == 0 ? GL_BACK : GL_COLOR_ATTACHMENT0);
+  glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+  slot.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+  slot.done = std::move(done);
+  readback->in_flight++;
+  printError("start readback");
+}
+
+void poll_readback(Readback *readback, bool wait) {
+  while (readback->in_flight > 0 && finish_oldest(readback, wait)) {
+  }
+}
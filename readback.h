@@ -0,0 +1,41 @@
+/*
+ * Asynchronous readback of framebuffers through a ring of pixel pack buffers.
+ * glReadPixels into a bound pack buffer only queues the copy, and a fence
+ * placed after it tells when the data has arrived, so the readback of one
+ * frame overlaps the rendering of the next ones instead of stalling the
+ * pipeline. Results are handed over oldest first.
+ */
+#pragma once
+#include <functional>
+#include <vector>
+#include "GL_utilities.h"
+#include "image.h"
+
+struct ReadbackSlot {
+  GLuint pbo;
+  GLsync fence;
+  std::function<void(Image &&)> done;
+};
+
+struct Readback {
+  int width;
+  int height;
+  std::vector<ReadbackSlot> slots;
+  int oldest;    // Slot of the oldest readback in flight
+  int in_flight;
+};
+
+// Every readback is an RGBA float image of width x height
+Readback *create_readback(int width, int height, int ring_size = 3);
+// Waits for the readbacks in flight and hands them over first
+void dispose_readback(Readback *readback);
+
+// Queues a copy of attachment of framebuffer fb, which is GL_BACK or GL_FRONT
+// for the window. If every buffer of the ring is in flight, it first waits for
+// the oldest one. done is called from poll_readback() on the GL thread.
+void start_readback(Readback *readback, GLuint fb, GLenum attachment,
+                    std::function<void(Image &&)> done);
+
+// Hands over every readback that has arrived. With wait set, blocks until all
+// of them have.
+void poll_readback(Readback *readback, bool wait = false);
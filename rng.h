@@ -0,0 +1,48 @@
+/*
+ * Counter-based random numbers, the CPU side of the generator in tracer.frag.
+ * A draw is a pure function of (pixel index, sample index, bounce, dimension),
+ * so results do not depend on thread count, tile order or how many frames the
+ * samples were spread over, and CPU code reproduces the GPU's numbers exactly.
+ */
+#pragma once
+#include <stdint.h>
+
+// Bounce number used for the camera ray, path bounces are counted from 1
+const uint32_t RNG_CAMERA_BOUNCE = 0;
+
+// PCG4D hash from Jarzynski and Olano, "Hash Functions for GPU Rendering" (2020)
+inline void pcg4d(uint32_t v[4]) {
+  for (int i = 0; i < 4; i++) {
+    v[i] = v[i] * 1664525u + 1013904223u;
+  }
+  v[0] += v[1] * v[3]; v[1] += v[2] * v[0]; v[2] += v[0] * v[1]; v[3] += v[1] * v[2];
+  for (int i = 0; i < 4; i++) {
+    v[i] ^= v[i] >> 16;
+  }
+  v[0] += v[1] * v[3]; v[1] += v[2] * v[0]; v[2] += v[0] * v[1]; v[3] += v[1] * v[2];
+}
+
+struct Rng {
+  uint32_t pixel;
+  uint32_t sample;
+  uint32_t bounce;
+  uint32_t dimension;
+
+  Rng(uint32_t pixel, uint32_t sample)
+      : pixel{pixel}, sample{sample}, bounce{RNG_CAMERA_BOUNCE}, dimension{0} {}
+
+  void set_bounce(int b) {
+    bounce = uint32_t(b) + 1;
+    dimension = 0;
+  }
+
+  uint32_t next_uint() {
+    uint32_t v[4] = {pixel, sample, bounce, dimension};
+    pcg4d(v);
+    dimension++;
+    return v[0];
+  }
+
+  // In [0, 1), with the same 24 bit precision as the shader
+  float next_float() { return float(next_uint() >> 8) * (1.0f / 16777216.0f); }
+};
@@ -0,0 +1,154 @@
+#include "sequence.h"
+#include <algorithm>
+#include <stdio.h>
+#include <string.h>
+
+namespace {
+
+vec3 catmull_rom(vec3 p0, vec3 p1, vec3 p2, vec3 p3, float t) {
+  float t2 = t * t, t3 = t2 * t;
+  return 0.5f * ((2.0f * p1) + (p2 - p0) * t +
+                 (2.0f * p0 - 5.0f * p1 + 4.0f * p2 - p3) * t2 +
+                 (3.0f * p1 - p0 - 3.0f * p2 + p3) * t3);
+}
+
+float lerp(float a, float b, float t) { return a + (b - a) * t; }
+
+// Finds the segment of keys[first, last) holding frame. The keys before and
+// after it are clamped to the range, so the spline runs flat at the ends.
+template <typename Key>
+void find_segment(const std::vector<Key> &keys, size_t first, size_t last,
+                  float frame, size_t seg[4], float &t) {
+  size_t i = first;
+  while (i + 1 < last && keys[i + 1].frame <= frame) {
+    i++;
+  }
+  size_t next = std::min(i + 1, last - 1);
+  seg[0] = i > first ? i - 1 : i;
+  seg[1] = i;
+  seg[2] = next;
+  seg[3] = std::min(next + 1, last - 1);
+  int span = keys[next].frame - keys[i].frame;
+  t = span > 0 ? std::min(std::max((frame - keys[i].frame) / span, 0.0f), 1.0f)
+               : 0.0f;
+}
+
+vec3 sphere_pos_at(const std::vector<SphereKey> &keys, size_t first,
+                   size_t last, float frame, float &radius) {
+  size_t s[4];
+  float t;
+  find_segment(keys, first, last, frame, s, t);
+  radius = lerp(keys[s[1]].radius, keys[s[2]].radius, t);
+  return catmull_rom(keys[s[0]].pos, keys[s[1]].pos, keys[s[2]].pos,
+                     keys[s[3]].pos, t);
+}
+
+} // namespace
+
+bool read_sequence(const char *filename, Sequence &sequence) {
+  FILE *file = fopen(filename, "r");
+  if (!file) {
+    fprintf(stderr, "Could not open %s\n", filename);
+    return false;
+  }
+  sequence = Sequence();
+  char line[512];
+  int line_number = 0;
+  bool ok = true;
+  while (ok && fgets(line, sizeof(line), file)) {
+    line_number++;
+    char *comment = strchr(line, '#');
+    if (comment) {
+      *comment = '\0';
+    }
+    char keyword[16], text[400];
+    if (sscanf(line, "%15s", keyword) != 1) {
+      continue; // Blank line
+    }
+    CameraKey c;
+    SphereKey s;
+    if (strcmp(keyword, "frames") == 0) {
+      ok = sscanf(line, "%*s %d", &sequence.frames) == 1 && sequence.frames > 0;
+    } else if (strcmp(keyword, "samples") == 0) {
+      ok = sscanf(line, "%*s %d", &sequence.samples_per_pixel) == 1 &&
+           sequence.samples_per_pixel > 0;
+    } else if (strcmp(keyword, "output") == 0) {
+      ok = sscanf(line, "%*s %399s", text) == 1;
+      sequence.output = text;
+    } else if (strcmp(keyword, "log") == 0) {
+      ok = sscanf(line, "%*s %399s", text) == 1;
+      sequence.log = text;
+    } else if (strcmp(keyword, "camera") == 0) {
+      ok = sscanf(line, "%*s %d %f %f %f %f %f %f %f %f", &c.frame, &c.pos.x,
+                  &c.pos.y, &c.pos.z, &c.look_at.x, &c.look_at.y, &c.look_at.z,
+                  &c.focus_dist, &c.defocus_angle) == 9;
+      sequence.camera_keys.push_back(c);
+    } else if (strcmp(keyword, "sphere") == 0) {
+      ok = sscanf(line, "%*s %d %u %f %f %f %f", &s.frame, &s.sphere, &s.pos.x,
+                  &s.pos.y, &s.pos.z, &s.radius) == 6;
+      sequence.sphere_keys.push_back(s);
+    } else {
+      ok = false;
+    }
+  }
+  fclose(file);
+  if (!ok) {
+    fprintf(stderr, "%s:%d: could not parse line\n", filename, line_number);
+    return false;
+  }
+  if (sequence.frames == 0 || sequence.samples_per_pixel == 0 ||
+      sequence.output.empty() || sequence.camera_keys.empty()) {
+    fprintf(stderr, "%s needs frames, samples, output and a camera key\n",
+            filename);
+    return false;
+  }
+
+  std::stable_sort(sequence.camera_keys.begin(), sequence.camera_keys.end(),
+                   [](const CameraKey &a, const CameraKey &b) {
+                     return a.frame < b.frame;
+                   });
+  std::stable_sort(sequence.sphere_keys.begin(), sequence.sphere_keys.end(),
+                   [](const SphereKey &a, const SphereKey &b) {
+                     return a.sphere != b.sphere ? a.sphere < b.sphere
+                                                 : a.frame < b.frame;
+                   });
+  return true;
+}
+
+CameraKey camera_at(const Sequence &sequence, int frame) {
+  const std::vector<CameraKey> &keys = sequence.camera_keys;
+  size_t s[4];
+  float t;
+  find_segment(keys, 0, keys.size(), frame, s, t);
+  CameraKey camera;
+  camera.frame = frame;
+  camera.pos = catmull_rom(keys[s[0]].pos, keys[s[1]].pos, keys[s[2]].pos,
+                           keys[s[3]].pos, t);
+  camera.look_at = catmull_rom(keys[s[0]].look_at, keys[s[1]].look_at,
+                               keys[s[2]].look_at, keys[s[3]].look_at, t);
+  camera.focus_dist = lerp(keys[s[1]].focus_dist, keys[s[2]].focus_dist, t);
+  camera.defocus_angle =
+      lerp(keys[s[1]].defocus_angle, keys[s[2]].defocus_angle, t);
+  return camera;
+}
+
+std::vector<GLuint> place_spheres(const Sequence &sequence, int frame,
+                                  std::vector<Sphere> &spheres) {
+  const std::vector<SphereKey> &keys = sequence.sphere_keys;
+  std::vector<GLuint> placed;
+  for (size_t first = 0; first < keys.size();) {
+    size_t last = first + 1;
+    while (last < keys.size() && keys[last].sphere == keys[first].sphere) {
+      last++;
+    }
+    Sphere &sphere = spheres[keys[first].sphere];
+    float radius_before;
+    vec3 before = sphere_pos_at(keys, first, last, frame - 1, radius_before);
+    vec3 now = sphere_pos_at(keys, first, last, frame, sphere.radius);
+    sphere.pos = before;
+    sphere.pos_end = now;
+    placed.push_back(keys[first].sphere);
+    first = last;
+  }
+  return placed;
+}
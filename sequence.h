@@ -0,0 +1,58 @@
+/*
+ * Keyframed camera and sphere animation for rendering image sequences. A
+ * sequence file is plain text with one setting or key per line, # starting a
+ * comment:
+ *
+ *   frames 120                    number of frames to render
+ *   samples 500                   samples per pixel of every frame
+ *   output shots/frame_%04d.png   printf pattern, .png/.tga or .exr/.pfm
+ *   log shots/timing.csv          per frame timings and noise, optional
+ *   camera <frame> <px py pz> <look at x y z> <focus dist> <defocus angle>
+ *   sphere <frame> <index> <x y z> <radius>
+ *
+ * Sphere indices refer to the spheres of the scene set up in main.cpp. Camera
+ * and sphere positions follow a Catmull-Rom spline through the keys, the other
+ * values are interpolated linearly. Before the first and after the last key the
+ * value of that key is held.
+ */
+#pragma once
+#include <string>
+#include <vector>
+#include "sphere.h"
+
+struct CameraKey {
+  int frame;
+  vec3 pos;
+  vec3 look_at;
+  float focus_dist;
+  float defocus_angle;
+};
+
+struct SphereKey {
+  int frame;
+  GLuint sphere;
+  vec3 pos;
+  float radius;
+};
+
+struct Sequence {
+  int frames = 0;
+  int samples_per_pixel = 0;
+  std::string output;
+  std::string log;
+  std::vector<CameraKey> camera_keys; // Sorted by frame
+  std::vector<SphereKey> sphere_keys; // Sorted by sphere, then frame
+};
+
+// Prints why and returns false if the file can not be read, or lacks the
+// frame count, sample count, output pattern or camera keys
+bool read_sequence(const char *filename, Sequence &sequence);
+
+CameraKey camera_at(const Sequence &sequence, int frame);
+
+// Moves and resizes the keyed spheres to where they are at frame. The shutter
+// is open since the previous frame, so pos is set to the position one frame
+// earlier and pos_end to the one at frame. Returns the indices of the spheres
+// with keys, which must all be less than spheres.size().
+std::vector<GLuint> place_spheres(const Sequence &sequence, int frame,
+                                  std::vector<Sphere> &spheres);
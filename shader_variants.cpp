@@ -0,0 +1,483 @@
+#include "shader_variants.h"
+#include <GL/glext.h>
+#include <GL/glx.h>
+#include <mutex>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+
+struct BackgroundCompiler {
+  std::thread thread;
+  std::mutex mutex;
+  std::vector<std::string> queued;  // Keys of new variants to compile
+  std::vector<std::string> known;   // Keys of every variant, for reloads
+  std::vector<std::pair<std::string, GLuint>> finished;
+  bool stopping = false;
+
+  Display *display;
+  GLXContext context;
+  GLXPbuffer pbuffer;
+  int inotify = -1;
+};
+
+namespace {
+
+// Ends in a format version. Binaries only make sense to the driver that made
+// them, so the rest of the file is just the binary format and the binary.
+const char MAGIC[8] = {'R', 'T', 'P', 'R', 'O', 'G', '0', '1'};
+
+bool read_text(const std::string &filename, std::string &text) {
+  FILE *file = fopen(filename.c_str(), "rb");
+  if (!file) {
+    fprintf(stderr, "Could not open %s\n", filename.c_str());
+    return false;
+  }
+  text.clear();
+  char buffer[4096];
+  size_t n;
+  while ((n = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+    text.append(buffer, n);
+  }
+  fclose(file);
+  return true;
+}
+
+// Inserts the defines after the #version line, which has to stay first. A
+// #line directive keeps the line numbers in compiler messages those of the
+// file.
+std::string insert_defines(const std::string &source,
+                           const std::vector<std::string> &defines) {
+  size_t version = source.find("#version");
+  if (version == std::string::npos || defines.empty()) {
+    return source;
+  }
+  size_t line_end = source.find('\n', version);
+  if (line_end == std::string::npos) {
+    line_end = source.size();
+  }
+  int next_line = 2;
+  for (size_t i = 0; i < version; i++) {
+    next_line += source[i] == '\n';
+  }
+  std::string result = source.substr(0, line_end) + "\n";
+  for (const std::string &define : defines) {
+    result += "#define " + define + "\n";
+  }
+  result += "#line " + std::to_string(next_line) + "\n";
+  if (line_end < source.size()) {
+    result += source.substr(line_end + 1);
+  }
+  return result;
+}
+
+GLuint compile_shader(GLenum type, const std::string &source,
+                      const std::string &filename) {
+  GLuint shader = glCreateShader(type);
+  const char *text = source.c_str();
+  glShaderSource(shader, 1, &text, NULL);
+  glCompileShader(shader);
+  GLint ok = GL_FALSE;
+  glGetShaderiv(shader, GL_COMPILE_STATUS, &ok);
+  if (!ok) {
+    char log[4096];
+    glGetShaderInfoLog(shader, sizeof(log), NULL, log);
+    fprintf(stderr, "Could not compile %s:\n%s\n", filename.c_str(), log);
+    glDeleteShader(shader);
+    return 0;
+  }
+  return shader;
+}
+
+// FNV-1a, plenty to tell sources apart
+uint64_t hash_text(const std::string &text, uint64_t hash = 14695981039346656037ull) {
+  for (unsigned char c : text) {
+    hash = (hash ^ c) * 1099511628211ull;
+  }
+  return hash;
+}
+
+std::string gl_string(GLenum name) {
+  const GLubyte *s = glGetString(name);
+  return s ? (const char *)s : "";
+}
+
+bool binaries_supported() {
+  GLint formats = 0;
+  glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+  return formats > 0;
+}
+
+// Returns 0 if there is no usable binary in filename
+GLuint load_binary(const std::string &filename) {
+  FILE *file = fopen(filename.c_str(), "rb");
+  if (!file) {
+    return 0;
+  }
+  char magic[sizeof(MAGIC)];
+  uint32_t format;
+  std::vector<char> binary;
+  bool ok = fread(magic, 1, sizeof(magic), file) == sizeof(magic) &&
+            memcmp(magic, MAGIC, sizeof(MAGIC)) == 0 &&
+            fread(&format, sizeof(format), 1, file) == 1;
+  char buffer[65536];
+  size_t n;
+  while (ok && (n = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+    binary.insert(binary.end(), buffer, buffer + n);
+  }
+  fclose(file);
+  if (!ok || binary.empty()) {
+    return 0;
+  }
+  GLuint program = glCreateProgram();
+  glProgramBinary(program, format, binary.data(), binary.size());
+  GLint linked = GL_FALSE;
+  glGetProgramiv(program, GL_LINK_STATUS, &linked);
+  if (!linked) {
+    // An unknown format also raises GL_INVALID_ENUM, which is expected here
+    glGetError();
+    glDeleteProgram(program);
+    return 0;
+  }
+  return program;
+}
+
+// Written under a temporary name and renamed, so a program running at the
+// same time never reads half a file
+void save_binary(GLuint program, const std::string &filename) {
+  GLint length = 0;
+  glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+  if (length <= 0) {
+    return;
+  }
+  std::vector<char> binary(length);
+  GLenum format;
+  glGetProgramBinary(program, length, NULL, &format, binary.data());
+  uint32_t format32 = format;
+
+  std::string tmp_name = filename + ".tmp";
+  FILE *file = fopen(tmp_name.c_str(), "wb");
+  if (!file) {
+    fprintf(stderr, "Could not create %s\n", tmp_name.c_str());
+    return;
+  }
+  bool ok = fwrite(MAGIC, 1, sizeof(MAGIC), file) == sizeof(MAGIC) &&
+            fwrite(&format32, sizeof(format32), 1, file) == 1 &&
+            fwrite(binary.data(), 1, binary.size(), file) == binary.size();
+  ok = fclose(file) == 0 && ok;
+  if (!ok || rename(tmp_name.c_str(), filename.c_str()) != 0) {
+    fprintf(stderr, "Could not write %s\n", filename.c_str());
+    remove(tmp_name.c_str());
+  }
+}
+
+GLuint link_program(const ShaderVariants *variants,
+                    const std::string &vertex_source,
+                    const std::string &fragment_source, bool retrievable) {
+  GLuint vertex = compile_shader(GL_VERTEX_SHADER, vertex_source,
+                                 variants->vertex_file);
+  GLuint fragment = compile_shader(GL_FRAGMENT_SHADER, fragment_source,
+                                   variants->fragment_file);
+  GLuint program = 0;
+  if (vertex && fragment) {
+    program = glCreateProgram();
+    if (retrievable) {
+      glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+    }
+    glAttachShader(program, vertex);
+    glAttachShader(program, fragment);
+    glLinkProgram(program);
+    GLint ok = GL_FALSE;
+    glGetProgramiv(program, GL_LINK_STATUS, &ok);
+    if (!ok) {
+      char log[4096];
+      glGetProgramInfoLog(program, sizeof(log), NULL, log);
+      fprintf(stderr, "Could not link %s and %s:\n%s\n",
+              variants->vertex_file.c_str(), variants->fragment_file.c_str(),
+              log);
+      glDeleteProgram(program);
+      program = 0;
+    }
+  }
+  // The program keeps what it needs from the shaders once linked
+  glDeleteShader(vertex);
+  glDeleteShader(fragment);
+  return program;
+}
+
+// Loads the variant from the disk cache, or compiles it and adds it there
+GLuint build_variant(const ShaderVariants *variants,
+                     const std::vector<std::string> &defines) {
+  std::string vertex_source, fragment_source;
+  if (!read_text(variants->vertex_file, vertex_source) ||
+      !read_text(variants->fragment_file, fragment_source)) {
+    return 0;
+  }
+  fragment_source = insert_defines(fragment_source, defines);
+
+  bool cached = !variants->cache_dir.empty() && binaries_supported();
+  std::string cache_file;
+  if (cached) {
+    uint64_t hash = hash_text(vertex_source);
+    hash = hash_text(std::string(1, '\0') + fragment_source, hash);
+    for (GLenum name : {GL_VENDOR, GL_RENDERER, GL_VERSION}) {
+      hash = hash_text(std::string(1, '\0') + gl_string(name), hash);
+    }
+    char name[32];
+    snprintf(name, sizeof(name), "/%016llx.bin", (unsigned long long)hash);
+    cache_file = variants->cache_dir + name;
+    GLuint program = load_binary(cache_file);
+    if (program) {
+      return program;
+    }
+  }
+
+  GLuint program = link_program(variants, vertex_source, fragment_source, cached);
+  if (program && cached) {
+    save_binary(program, cache_file);
+  }
+  return program;
+}
+
+std::vector<std::string> split_key(const std::string &key) {
+  std::vector<std::string> defines;
+  size_t start = 0, end;
+  while ((end = key.find('\n', start)) != std::string::npos) {
+    defines.push_back(key.substr(start, end - start));
+    start = end + 1;
+  }
+  return defines;
+}
+
+std::string file_name(const std::string &path) {
+  size_t slash = path.rfind('/');
+  return slash == std::string::npos ? path : path.substr(slash + 1);
+}
+
+std::string directory(const std::string &path) {
+  size_t slash = path.rfind('/');
+  return slash == std::string::npos ? "." : path.substr(0, slash);
+}
+
+// Drains the inotify events and returns true if one of them was about a
+// shader source. Editors often save by writing a new file and renaming it
+// over the old one, which is why the directories are watched.
+bool sources_changed(const ShaderVariants *variants, int fd) {
+  bool changed = false;
+  alignas(inotify_event) char buffer[4096];
+  ssize_t length;
+  while ((length = read(fd, buffer, sizeof(buffer))) > 0) {
+    for (char *p = buffer; p < buffer + length;) {
+      const inotify_event *event = (const inotify_event *)p;
+      if (event->len > 0 && (event->name == file_name(variants->vertex_file) ||
+                             event->name == file_name(variants->fragment_file))) {
+        changed = true;
+      }
+      p += sizeof(inotify_event) + event->len;
+    }
+  }
+  return changed;
+}
+
+void compiler_loop(ShaderVariants *variants) {
+  BackgroundCompiler *background = variants->background;
+  glXMakeContextCurrent(background->display, background->pbuffer,
+                        background->pbuffer, background->context);
+  while (true) {
+    // Sleeping in poll() keeps the thread idle between saves, and the
+    // timeout bounds how long queued variants wait
+    pollfd watch = {background->inotify, POLLIN, 0};
+    bool reload = false;
+    if (poll(&watch, 1, 50) > 0 && sources_changed(variants, background->inotify)) {
+      // A save may come as several events, let them all arrive first
+      usleep(50 * 1000);
+      sources_changed(variants, background->inotify);
+      reload = true;
+    }
+
+    std::vector<std::string> keys;
+    {
+      std::lock_guard<std::mutex> lock(background->mutex);
+      if (background->stopping) {
+        break;
+      }
+      keys = reload ? background->known : background->queued;
+      background->queued.clear();
+    }
+    if (reload) {
+      printf("Recompiling %s\n", variants->fragment_file.c_str());
+    }
+    for (const std::string &key : keys) {
+      GLuint program = build_variant(variants, split_key(key));
+      if (program) {
+        // The render thread may only use it once it is complete
+        glFinish();
+        std::lock_guard<std::mutex> lock(background->mutex);
+        background->finished.push_back({key, program});
+      }
+    }
+  }
+  // The display may be closed already when the program exits, so the
+  // context is left for the process exit to clean up
+}
+
+} // namespace
+
+ShaderVariants *create_shader_variants(const char *vertex_file,
+                                       const char *fragment_file,
+                                       const char *cache_dir) {
+  ShaderVariants *variants = new ShaderVariants();
+  variants->vertex_file = vertex_file;
+  variants->fragment_file = fragment_file;
+  if (cache_dir) {
+    mkdir(cache_dir, 0755); // Fails harmlessly if it exists
+    variants->cache_dir = cache_dir;
+  }
+  return variants;
+}
+
+void dispose_shader_variants(ShaderVariants *variants) {
+  BackgroundCompiler *background = variants->background;
+  if (background) {
+    stop_background_compiler(variants);
+    for (const auto &entry : background->finished) {
+      glDeleteProgram(entry.second);
+    }
+    delete background;
+  }
+  for (const auto &entry : variants->programs) {
+    glDeleteProgram(entry.second);
+  }
+  delete variants;
+}
+
+GLuint get_shader_variant(ShaderVariants *variants,
+                          const std::vector<std::string> &defines) {
+  std::string key;
+  for (const std::string &define : defines) {
+    key += define + "\n";
+  }
+  auto found = variants->programs.find(key);
+  if (found != variants->programs.end()) {
+    return found->second;
+  }
+  BackgroundCompiler *background = variants->background;
+  if (background) {
+    std::lock_guard<std::mutex> lock(background->mutex);
+    background->queued.push_back(key);
+    background->known.push_back(key);
+    variants->programs[key] = 0;
+    return 0;
+  }
+  GLuint program = build_variant(variants, defines);
+  variants->programs[key] = program;
+  return program;
+}
+
+bool start_background_compiler(ShaderVariants *variants) {
+  Display *display = glXGetCurrentDisplay();
+  GLXContext shared = glXGetCurrentContext();
+  auto create_context = (PFNGLXCREATECONTEXTATTRIBSARBPROC)glXGetProcAddress(
+      (const GLubyte *)"glXCreateContextAttribsARB");
+  if (!display || !shared || !create_context) {
+    fprintf(stderr, "No GLX context to share, shaders compile in the foreground\n");
+    return false;
+  }
+
+  // A context like the render thread's, drawing to a tiny pbuffer it never
+  // uses, as a context can only be current with a drawable
+  int config_id = 0;
+  glXQueryContext(display, shared, GLX_FBCONFIG_ID, &config_id);
+  int config_attribs[] = {GLX_FBCONFIG_ID, config_id, None};
+  int count = 0;
+  GLXFBConfig *configs = glXChooseFBConfig(display, XDefaultScreen(display),
+                                           config_attribs, &count);
+  GLint major = 3, minor = 3;
+  glGetIntegerv(GL_MAJOR_VERSION, &major);
+  glGetIntegerv(GL_MINOR_VERSION, &minor);
+  int context_attribs[] = {GLX_CONTEXT_MAJOR_VERSION_ARB, major,
+                           GLX_CONTEXT_MINOR_VERSION_ARB, minor,
+                           GLX_CONTEXT_PROFILE_MASK_ARB,
+                           GLX_CONTEXT_CORE_PROFILE_BIT_ARB, None};
+  int pbuffer_attribs[] = {GLX_PBUFFER_WIDTH, 1, GLX_PBUFFER_HEIGHT, 1, None};
+  GLXContext context = NULL;
+  GLXPbuffer pbuffer = 0;
+  if (configs && count > 0) {
+    context = create_context(display, configs[0], shared, True, context_attribs);
+    pbuffer = glXCreatePbuffer(display, configs[0], pbuffer_attribs);
+  }
+  if (configs) {
+    XFree(configs);
+  }
+  int inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (!context || !pbuffer || inotify < 0) {
+    fprintf(stderr, "Could not set up background shader compiling\n");
+    if (context) {
+      glXDestroyContext(display, context);
+    }
+    if (pbuffer) {
+      glXDestroyPbuffer(display, pbuffer);
+    }
+    if (inotify >= 0) {
+      close(inotify);
+    }
+    return false;
+  }
+  for (const std::string &file : {variants->vertex_file, variants->fragment_file}) {
+    inotify_add_watch(inotify, directory(file).c_str(),
+                      IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE);
+  }
+
+  BackgroundCompiler *background = new BackgroundCompiler();
+  background->display = display;
+  background->context = context;
+  background->pbuffer = pbuffer;
+  background->inotify = inotify;
+  for (const auto &entry : variants->programs) {
+    background->known.push_back(entry.first);
+  }
+  variants->background = background;
+  background->thread = std::thread(compiler_loop, variants);
+  return true;
+}
+
+void stop_background_compiler(ShaderVariants *variants) {
+  BackgroundCompiler *background = variants->background;
+  if (!background || background->inotify < 0) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(background->mutex);
+    background->stopping = true;
+  }
+  background->thread.join();
+  close(background->inotify);
+  background->inotify = -1;
+}
+
+bool update_shader_variants(ShaderVariants *variants) {
+  BackgroundCompiler *background = variants->background;
+  if (!background) {
+    return false;
+  }
+  std::vector<std::pair<std::string, GLuint>> finished;
+  {
+    std::lock_guard<std::mutex> lock(background->mutex);
+    finished.swap(background->finished);
+  }
+  bool replaced = false;
+  for (const auto &entry : finished) {
+    GLuint &program = variants->programs[entry.first];
+    if (program) {
+      // GL keeps a program that is still in use until it is done with it
+      glDeleteProgram(program);
+      replaced = true;
+    }
+    program = entry.second;
+  }
+  return replaced;
+}
@@ -0,0 +1,67 @@
+/*
+ * Specialised variants of a shader program. Each variant is compiled from the
+ * same source files with a list of #defines inserted right after the
+ * #version line, so values that are constant for a scene become compile-time
+ * constants: loops with a fixed count can be unrolled and code behind a
+ * disabled feature is compiled out. Variants are compiled on first use and
+ * kept, so going back to an earlier configuration costs nothing.
+ *
+ * Linked programs are also saved to cache_dir with glGetProgramBinary, so
+ * later runs load them in an instant instead of compiling again. A cache
+ * file is named by a hash of the sources with the defines inserted and the
+ * GL vendor, renderer and version, so any change to those simply misses the
+ * cache. A binary the driver still refuses is compiled from source again.
+ *
+ * Once start_background_compiler() has been called, new variants are
+ * compiled on a thread with a GL context of its own that shares objects with
+ * the render thread's, and the source files are watched with inotify. When
+ * one changes, every variant is rebuilt there. The render thread picks up
+ * finished programs in update_shader_variants() and never waits for the
+ * compiler; a variant that fails to rebuild keeps its old program.
+ */
+#pragma once
+#include <map>
+#include <string>
+#include <vector>
+#include "GL_utilities.h"
+
+struct BackgroundCompiler;
+
+struct ShaderVariants {
+  std::string vertex_file;
+  std::string fragment_file;
+  std::string cache_dir;  // Empty if programs are not cached on disk
+  // By key, 0 if compiling failed or is still going on in the background
+  std::map<std::string, GLuint> programs;
+  BackgroundCompiler *background = nullptr;
+};
+
+// cache_dir is created if it does not exist. Pass NULL to not cache.
+ShaderVariants *create_shader_variants(const char *vertex_file,
+                                       const char *fragment_file,
+                                       const char *cache_dir = "shader_cache");
+// Stops the background compiler and deletes every compiled program
+void dispose_shader_variants(ShaderVariants *variants);
+
+// Returns the program compiled with defines, each of the form "NAME value" or
+// just "NAME", compiling it if it is new. Prints why and returns 0 if it does
+// not compile, which is remembered so it is not tried again until the sources
+// change. With the background compiler running, a new variant returns 0
+// until it has been compiled and picked up.
+GLuint get_shader_variant(ShaderVariants *variants,
+                          const std::vector<std::string> &defines);
+
+// Starts compiling in the background and watching the source files. Must be
+// called on the render thread with its context current; XInitThreads() must
+// have been called before the display was opened. Prints why and returns
+// false if no shared context could be made, in which case compiling stays on
+// the render thread.
+bool start_background_compiler(ShaderVariants *variants);
+
+// Stops the background compiler without touching GL, for when the render
+// thread's context is already gone
+void stop_background_compiler(ShaderVariants *variants);
+
+// Swaps in the programs finished in the background since the last call.
+// Returns true if a program that was in use has been replaced.
+bool update_shader_variants(ShaderVariants *variants);
@@ -0,0 +1,65 @@
+#pragma once
+#include "VectorUtils4.h"
+#include "bvh.h"
+
+// Flat and boxy primitives, each with storage of its own next to the spheres.
+// NB! Make sure the order of the members are the same as in get_plane(),
+// get_quad() and get_box() in tracer.frag. Unlike spheres they never move.
+// Planes and quads are two-sided and have no inside, so a ray hitting either
+// side sees a front face.
+
+// The infinite plane of points p with dot(normal, p) == offset. It has no
+// bounds, so planes are tested on their own rather than through the BVH, and
+// a scene should only have a few of them, like a ground. One vec4 texel.
+struct Plane {
+  vec3 normal; // Unit length
+  GLfloat offset;
+
+  Plane(vec3 normal, vec3 point)
+      : normal{normalize(normal)}, offset{dot(normalize(normal), point)} {}
+};
+
+// The parallelogram spanned by the edges u and v from corner. Three vec4
+// texels, the w of each is unused.
+struct Quad {
+  vec3 corner;
+  GLfloat padding0;
+  vec3 u;
+  GLfloat padding1;
+  vec3 v;
+  GLfloat padding2;
+
+  Quad(vec3 corner, vec3 u, vec3 v)
+      : corner{corner}, padding0{0.0}, u{u}, padding1{0.0}, v{v},
+        padding2{0.0} {}
+
+  // Grown a little so a quad lying in an axis plane still has a box with
+  // some thickness
+  AABB bounds() const {
+    AABB b;
+    b.grow(corner);
+    b.grow(corner + u);
+    b.grow(corner + v);
+    b.grow(corner + u + v);
+    const float pad = 1e-4f;
+    b.min = b.min - vec3(pad);
+    b.max = b.max + vec3(pad);
+    return b;
+  }
+};
+
+// An axis-aligned box. Two vec4 texels, the w of each is unused.
+struct Box {
+  vec3 min;
+  GLfloat padding0;
+  vec3 max;
+  GLfloat padding1;
+
+  Box(vec3 min, vec3 max) : min{min}, padding0{0.0}, max{max}, padding1{0.0} {}
+
+  AABB bounds() const { return AABB(min, max); }
+};
+
+static_assert(sizeof(Plane) == 16, "Plane must match tracer.frag");
+static_assert(sizeof(Quad) == 48, "Quad must match tracer.frag");
+static_assert(sizeof(Box) == 32, "Box must match tracer.frag");
@@ -1,18 +1,34 @@
 #pragma once
 #include "VectorUtils4.h"
-#include "material.h"
+#include "bvh.h"
 
-// NB! Make sure the order of the members are the same as the sphere struct
-// in tracer.frag!
-// Padding needed as the struct needs to have the aligment of a vec4 i.e. 4
-// GLfloats
+// NB! Make sure the order of the members are the same as in get_sphere() in
+// tracer.frag! Each sphere takes two vec4 sized texels.
+// The sphere moves linearly from pos to pos_end while the shutter is open,
+// for a static sphere they are the same. Materials are kept in a table of
+// their own, with the index for each sphere in a parallel array, see
+// material.h.
 struct Sphere {
-  Material material;
-  vec4 pos;
+  vec3 pos;
   GLfloat radius;
-  GLfloat padding[3];
-  Sphere(vec3 pos, GLfloat radius, Material material)
-      : material{material}, pos{vec4(pos, 0.0)}, radius{radius} {}
+  vec3 pos_end;
+  GLfloat padding;
+  Sphere(vec3 pos, GLfloat radius)
+      : pos{pos}, radius{radius}, pos_end{pos}, padding{0.0} {}
 
-  Sphere() : material{Material::init_zero()}, pos{vec4(0.0)}, radius{0.0} {}
+  Sphere(vec3 pos, vec3 pos_end, GLfloat radius)
+      : pos{pos}, radius{radius}, pos_end{pos_end}, padding{0.0} {}
+
+  Sphere() : pos{vec3(0.0)}, radius{0.0}, pos_end{vec3(0.0)}, padding{0.0} {}
+
+  // Covers the sphere over the whole shutter interval
+  AABB bounds() const {
+    AABB b(vec3(pos.x - radius, pos.y - radius, pos.z - radius),
+           vec3(pos.x + radius, pos.y + radius, pos.z + radius));
+    b.grow(AABB(vec3(pos_end.x - radius, pos_end.y - radius, pos_end.z - radius),
+                vec3(pos_end.x + radius, pos_end.y + radius, pos_end.z + radius)));
+    return b;
+  }
 };
+
+static_assert(sizeof(Sphere) == 32, "Sphere must match tracer.frag");
@@ -0,0 +1,112 @@
+#include "textures.h"
+#include <math.h>
+#include <stdio.h>
+#include "LoadTGA.h"
+
+namespace {
+
+float srgb_encode(float linear) {
+  return linear <= 0.0031308f ? 12.92f * linear
+                              : 1.055f * powf(linear, 1.0f / 2.4f) - 0.055f;
+}
+
+int wrap(int i, int n) { return ((i % n) + n) % n; }
+
+// Bilinear lookup of channel c at texel coordinates (x, y), wrapping around
+// the edges since textures repeat
+float sample(const unsigned char *rgba, int width, int height, float x,
+             float y, int c) {
+  int x0 = (int)floorf(x), y0 = (int)floorf(y);
+  float fx = x - x0, fy = y - y0;
+  auto texel = [&](int tx, int ty) {
+    return float(rgba[(wrap(ty, height) * width + wrap(tx, width)) * 4 + c]);
+  };
+  float bottom = texel(x0, y0) * (1.0f - fx) + texel(x0 + 1, y0) * fx;
+  float top = texel(x0, y0 + 1) * (1.0f - fx) + texel(x0 + 1, y0 + 1) * fx;
+  return bottom * (1.0f - fy) + top * fy;
+}
+
+} // namespace
+
+TextureArray *create_texture_array(int size) {
+  TextureArray *textures = new TextureArray();
+  textures->size = size;
+  return textures;
+}
+
+void dispose_texture_array(TextureArray *textures) {
+  glDeleteTextures(1, &textures->tex);
+  delete textures;
+}
+
+GLint add_texture(TextureArray *textures, int width, int height,
+                  const unsigned char *rgba, bool colour) {
+  int size = textures->size;
+  GLint layer = textures->layer_count();
+  size_t base = textures->texels.size();
+  textures->texels.resize(base + 4 * size_t(size) * size);
+  unsigned char *out = &textures->texels[base];
+
+  float scale_x = float(width) / size, scale_y = float(height) / size;
+  for (int y = 0; y < size; y++) {
+    for (int x = 0; x < size; x++) {
+      for (int c = 0; c < 4; c++) {
+        float v = sample(rgba, width, height, (x + 0.5f) * scale_x - 0.5f,
+                         (y + 0.5f) * scale_y - 0.5f, c) / 255.0f;
+        if (!colour && c < 3) {
+          v = srgb_encode(v);
+        }
+        *out++ = (unsigned char)lrintf(fminf(fmaxf(v, 0.0f), 1.0f) * 255.0f);
+      }
+    }
+  }
+  return layer;
+}
+
+GLint add_texture(TextureArray *textures, const char *filename, bool colour) {
+  auto found = textures->files.find(filename);
+  if (found != textures->files.end()) {
+    return found->second;
+  }
+  TextureData data;
+  if (!LoadTGATextureData(filename, &data)) {
+    fprintf(stderr, "Could not load texture %s\n", filename);
+    return -1;
+  }
+  int width = data.width, height = data.height, channels = data.bpp / 8;
+  std::vector<unsigned char> rgba(4 * size_t(width) * height);
+  for (size_t i = 0; i < size_t(width) * height; i++) {
+    const unsigned char *in = &data.imageData[i * channels];
+    rgba[4 * i] = in[0];
+    rgba[4 * i + 1] = in[channels >= 3 ? 1 : 0];
+    rgba[4 * i + 2] = in[channels >= 3 ? 2 : 0];
+    rgba[4 * i + 3] = channels == 4 ? in[3] : 255;
+  }
+  free(data.imageData);
+
+  GLint layer = add_texture(textures, width, height, rgba.data(), colour);
+  textures->files[filename] = layer;
+  return layer;
+}
+
+void upload_texture_array(TextureArray *textures) {
+  int size = textures->size;
+  if (textures->texels.empty()) {
+    textures->texels.assign(4 * size_t(size) * size, 255);
+  }
+  if (!textures->tex) {
+    glGenTextures(1, &textures->tex);
+  }
+  glBindTexture(GL_TEXTURE_2D_ARRAY, textures->tex);
+  glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_SRGB8_ALPHA8, size, size,
+               textures->layer_count(), 0, GL_RGBA, GL_UNSIGNED_BYTE,
+               textures->texels.data());
+  glGenerateMipmap(GL_TEXTURE_2D_ARRAY);
+  glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER,
+                  GL_LINEAR_MIPMAP_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_REPEAT);
+  glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_REPEAT);
+  glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+  printError("upload textures");
+}
@@ -0,0 +1,41 @@
+/*
+ * Material textures, packed into the layers of one GL_TEXTURE_2D_ARRAY so a
+ * single sampler covers every texture in the scene. The layers of an array
+ * share one size, so every image is resampled to it when added. The texels
+ * are stored as sRGB, which suits colour textures. Textures holding plain
+ * values, like roughness, are encoded on the way in so that sampling returns
+ * the values they started as. Mip maps are generated on upload; the tracer
+ * picks a level per hit with ray cones.
+ */
+#pragma once
+#include <map>
+#include <string>
+#include <vector>
+#include "GL_utilities.h"
+
+struct TextureArray {
+  int size;                          // Width and height of every layer
+  std::vector<unsigned char> texels; // RGBA, one layer after the other
+  std::map<std::string, GLint> files; // Layer by file name
+  GLuint tex = 0;
+
+  int layer_count() const { return texels.size() / (4 * size * size); }
+};
+
+TextureArray *create_texture_array(int size = 512);
+void dispose_texture_array(TextureArray *textures);
+
+// Adds a layer from width x height RGBA texels, rows from the bottom up, and
+// returns its index. colour tells sRGB colours from plain values.
+GLint add_texture(TextureArray *textures, int width, int height,
+                  const unsigned char *rgba, bool colour = true);
+
+// Returns the layer holding the TGA file, loading it the first time it is
+// asked for. Greyscale files fill red, green and blue. Prints why and
+// returns -1 if it can not be loaded.
+GLint add_texture(TextureArray *textures, const char *filename,
+                  bool colour = true);
+
+// Uploads every layer and builds the mip maps. An empty array still gets a
+// single layer, so the sampler is always complete.
+void upload_texture_array(TextureArray *textures);
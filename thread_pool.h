@@ -0,0 +1,119 @@
+/*
+ * Minimal fixed size thread pool for data parallel loops on the CPU. The
+ * calling thread takes part in the work, so a pool of size 1 runs everything
+ * inline.
+ */
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class ThreadPool {
+public:
+  explicit ThreadPool(unsigned num_threads = std::thread::hardware_concurrency()) {
+    num_threads = std::max(num_threads, 1u);
+    for (unsigned i = 1; i < num_threads; i++) {
+      workers.emplace_back([this] { worker_loop(); });
+    }
+  }
+
+  ~ThreadPool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    wake.notify_all();
+    for (std::thread &t : workers) {
+      t.join();
+    }
+  }
+
+  // Shared pool sized to the machine, created on first use
+  static ThreadPool &global() {
+    static ThreadPool pool;
+    return pool;
+  }
+
+  unsigned size() const { return workers.size() + 1; }
+
+  // Calls body(begin, end) on disjoint chunks of [0, count) of at most grain
+  // items each, and returns once all of them have finished. Must not be called
+  // from inside another parallel_for on the same pool.
+  void parallel_for(size_t count, size_t grain,
+                    const std::function<void(size_t, size_t)> &body) {
+    grain = std::max<size_t>(grain, 1);
+    size_t num_chunks = (count + grain - 1) / grain;
+    if (num_chunks <= 1 || workers.empty()) {
+      if (count > 0) {
+        body(0, count);
+      }
+      return;
+    }
+
+    std::atomic<size_t> next_chunk{0};
+    std::atomic<size_t> chunks_done{0};
+    std::mutex done_mutex;
+    std::condition_variable done;
+    auto run_chunks = [&] {
+      size_t c;
+      while ((c = next_chunk.fetch_add(1)) < num_chunks) {
+        body(c * grain, std::min(count, (c + 1) * grain));
+        if (chunks_done.fetch_add(1) + 1 == num_chunks) {
+          std::lock_guard<std::mutex> lock(done_mutex);
+          done.notify_all();
+        }
+      }
+    };
+
+    size_t helpers = std::min<size_t>(workers.size(), num_chunks - 1);
+    std::atomic<size_t> helpers_running{helpers};
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      for (size_t i = 0; i < helpers; i++) {
+        jobs.push_back([&] {
+          run_chunks();
+          helpers_running.fetch_sub(1);
+        });
+      }
+    }
+    wake.notify_all();
+    run_chunks();
+
+    // The helpers reference this stack frame, so also wait for every one of
+    // them to have returned, not only for the chunks to be done
+    std::unique_lock<std::mutex> lock(done_mutex);
+    done.wait(lock, [&] { return chunks_done.load() == num_chunks; });
+    lock.unlock();
+    while (helpers_running.load() > 0) {
+      std::this_thread::yield();
+    }
+  }
+
+private:
+  void worker_loop() {
+    while (true) {
+      std::function<void()> job;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        wake.wait(lock, [this] { return stopping || !jobs.empty(); });
+        if (stopping && jobs.empty()) {
+          return;
+        }
+        job = std::move(jobs.front());
+        jobs.pop_front();
+      }
+      job();
+    }
+  }
+
+  std::vector<std::thread> workers;
+  std::deque<std::function<void()>> jobs;
+  std::mutex mutex;
+  std::condition_variable wake;
+  bool stopping = false;
+};
@@ -1,8 +1,9 @@
-#version 150
+#version 330
 
 struct Ray {
   vec3 pos;
   vec3 dir;
+  float time;  // In [0, 1) over the shutter interval, kept through bounces
 };
 
 struct Material {
@@ -19,8 +20,12 @@ struct Material {
   float refraction_roughness;
   float f0;
   float f90;
+  int albedo_texture;  // Layers of TEXTURES, -1 for none
+  int roughness_texture;
+  int emission_texture;
 };
 
+// Filled in for the closest hit only, once traversal has found it
 struct Hit {
   bool did_hit;
   vec3 pos;
@@ -28,31 +33,79 @@ struct Hit {
   float dist;
   bool front_face;
   Material material;
+  vec2 uv;        // Texture coordinates, only with textures
+  float uv_size;  // World size of a unit square of texture coordinates
 };
 
 struct Sphere {
-  Material material;
-  vec4 pos;
+  vec3 pos;  // Position at the time of the ray it was fetched for
   float radius;
 };
 
+struct Quad {
+  vec3 corner;
+  vec3 u;
+  vec3 v;
+};
+
+struct Box {
+  vec3 min;
+  vec3 max;
+};
+
 // Shader parameters ----------------------------------------------------------
 
 in vec2 out_tex_coord;
-out vec4 out_colour;
+
+// Accumulated linear radiance, with the mean squared luminance of the samples
+// in alpha, from which the denoiser estimates the noise level. The first hit's
+// normal, view depth and albedo of this frame guide the denoiser.
+layout(location = 0) out vec4 out_colour;
+layout(location = 1) out vec4 out_normal_depth;
+layout(location = 2) out vec4 out_albedo;
 
 // Screen parameters
 uniform uvec2 SCREEN_RESOLUTION;
 uniform float ASPECT_RATIO;
-uniform int FRAME;  // Frame number, used for rng seed and averaging frames
+uniform int SAMPLE_OFFSET;  // Samples per pixel accumulated before this frame
 uniform sampler2D prev_frame;
 
 
-// Uniforms for storing objects that rays can interact with
-uniform int NUM_SPHERES;
-layout (std140) uniform SphereBlock {
-  Sphere spheres[10];
-};
+// Objects that rays can interact with, stored in buffer textures. Spheres
+// take 2 texels each, in the same order as the members of Sphere in sphere.h.
+// Planes take 1, quads 3 and boxes 2, as laid out in shapes.h. Primitives are
+// numbered spheres first, then quads, boxes and planes, and PRIM_MATERIALS
+// holds the material index of each in that order. Materials take 7 texels
+// each, as laid out in material.h. The BVH is the 8-wide compressed BVH from
+// bvh8.h, 5 texels per node, over the spheres, quads and boxes. Planes are
+// unbounded and tested on their own.
+uniform samplerBuffer SPHERES;
+uniform samplerBuffer PLANES;
+uniform samplerBuffer QUADS;
+uniform samplerBuffer BOXES;
+uniform usamplerBuffer PRIM_MATERIALS;
+uniform samplerBuffer MATERIALS;
+uniform usamplerBuffer BVH_NODES;
+uniform usamplerBuffer BVH_PRIM_INDICES;
+uniform int SPHERE_COUNT;
+uniform int QUAD_COUNT;
+uniform int BOX_COUNT;
+uniform int PLANE_COUNT;
+
+// Every texture of the scene, one per layer, see textures.h
+uniform sampler2DArray TEXTURES;
+
+// Lat-long HDR environment map lighting the scene instead of the sky
+// gradient, and the alias table for sampling it, see environment.h
+uniform bool USE_ENVIRONMENT_MAP;
+uniform sampler2D ENVIRONMENT;
+uniform sampler2D ENVIRONMENT_SAMPLING;
+
+// Entries of the BVH traversal stack, which needs one per level of the tree.
+// The tracer is compiled with room for the scene's BVH, see main.cpp.
+#ifndef BVH_STACK_SIZE
+#define BVH_STACK_SIZE 32
+#endif
 
 // Parameters for camera
 uniform vec3 CAM_POS;
@@ -62,96 +115,99 @@ uniform vec3 CAM_RIGHT;
 uniform float VFOV;
 uniform float DEFOCUS_ANGLE;
 uniform float FOCUS_DIST;
-uniform float EXPOSURE;
 
-// Parameters for rays
+// Parameters for rays. Either can be #defined as a constant instead, see
+// shader_variants.h.
+#ifndef SAMPLES_PER_PIXEL
 uniform int SAMPLES_PER_PIXEL;
+#endif
+#ifndef MAX_BOUNCE_COUNT
 uniform int MAX_BOUNCE_COUNT;
+#endif
+
+// Paths are only ended by Russian roulette from bounce RR_MIN_DEPTH on, and
+// with SPLIT_COUNT above 1 they go on from their first diffuse hit as that
+// many branches, see trace()
+uniform int RR_MIN_DEPTH;
+uniform int SPLIT_COUNT;
+
+// Material features used by the scene, a mask of the bits in material.h.
+// Code for features no material uses is compiled out.
+#ifndef MATERIAL_FEATURES
+#define MATERIAL_FEATURES 15
+#endif
+const bool HAS_SPECULAR = (MATERIAL_FEATURES & 1) != 0;
+const bool HAS_REFRACTION = (MATERIAL_FEATURES & 2) != 0;
+const bool HAS_EMISSION = (MATERIAL_FEATURES & 4) != 0;
+const bool HAS_TEXTURES = (MATERIAL_FEATURES & 8) != 0;
 
 // Functions for randomness ---------------------------------------------------
-uint wang_hash(inout uint rng_state) {
-  rng_state = uint(rng_state ^ uint(61)) ^ uint(rng_state >> uint(16));
-  rng_state *= uint(9);
-  rng_state = rng_state ^ (rng_state >> 4);
-  rng_state *= uint(0x27d4eb2d);
-  rng_state = rng_state ^ (rng_state >> 15);
-  return rng_state;
+// Random numbers come from a counter-based hash instead of a sequential
+// generator. The state is the key (pixel index, sample index, bounce, dimension)
+// and each draw hashes it and bumps the dimension, so any sample of any pixel
+// can be reproduced on its own no matter in which order pixels, tiles or frames
+// are traced. rng.h mirrors this bit for bit on the CPU.
+#define RNG_CAMERA_BOUNCE 0u
+
+// PCG4D hash from Jarzynski and Olano, "Hash Functions for GPU Rendering" (2020)
+uvec4 pcg4d(uvec4 v) {
+  v = v * 1664525u + 1013904223u;
+  v.x += v.y * v.w; v.y += v.z * v.x; v.z += v.x * v.y; v.w += v.y * v.z;
+  v ^= v >> 16u;
+  v.x += v.y * v.w; v.y += v.z * v.x; v.z += v.x * v.y; v.w += v.y * v.z;
+  return v;
+}
+
+uvec4 rng_key(uint pixel_index, uint sample_index) {
+  return uvec4(pixel_index, sample_index, RNG_CAMERA_BOUNCE, 0u);
+}
+
+// Moves on to the dimensions of the given bounce, counted from 1 since the
+// camera ray uses bounce 0
+void rng_set_bounce(inout uvec4 rng, int bounce) {
+  rng.z = uint(bounce) + 1u;
+  rng.w = 0u;
 }
 
-// Returns random float in the range [0, 1]
-float random_float(inout uint state) {
-  return float(wang_hash(state)) / 4294967296.0;
+// Returns random float in the range [0, 1). Only the top 24 bits are used so
+// the result is exact and never rounds up to 1.
+float random_float(inout uvec4 rng) {
+  uint bits = pcg4d(rng).x;
+  rng.w++;
+  return float(bits >> 8u) * (1.0 / 16777216.0);
 }
 
 // Returns a random float in the range [0, 1] using a normal distribution
-float random_float_normal_distribution(inout uint rng_state) {
-  float theta = 2.0 * 3.141592654 * random_float(rng_state);
-  float rho = sqrt(-2.0 * log(random_float(rng_state)));
+float random_float_normal_distribution(inout uvec4 rng) {
+  float theta = 2.0 * 3.141592654 * random_float(rng);
+  float rho = sqrt(-2.0 * log(1.0 - random_float(rng)));
   return rho * cos(theta);
 }
 
-vec3 random_direction(inout uint rng_state) {
-  float x = random_float_normal_distribution(rng_state);
-  float y = random_float_normal_distribution(rng_state);
-  float z = random_float_normal_distribution(rng_state);
+vec3 random_direction(inout uvec4 rng) {
+  float x = random_float_normal_distribution(rng);
+  float y = random_float_normal_distribution(rng);
+  float z = random_float_normal_distribution(rng);
   return normalize(vec3(x, y, z));
  }
 
-vec3 random_hemisphere_direction(vec3 normal, inout uint rng_state) {
-  vec3 dir = random_direction(rng_state);
+vec3 random_hemisphere_direction(vec3 normal, inout uvec4 rng) {
+  vec3 dir = random_direction(rng);
   return dir * sign(dot(normal, dir));
 }
 
 // Returns random point on unit square
-vec2 sample_square(inout uint rng_state) {
-  return vec2(random_float(rng_state)-0.5, random_float(rng_state)-0.5);
+vec2 sample_square(inout uvec4 rng) {
+  return vec2(random_float(rng)-0.5, random_float(rng)-0.5);
 }
 
 // Returns random point on unit circle
-vec2 sample_circle(inout uint rng_state) {
-  float angle = random_float(rng_state) * 2.0 * 3.141592654; 
+vec2 sample_circle(inout uvec4 rng) {
+  float angle = random_float(rng) * 2.0 * 3.141592654; 
   vec2 point_on_circle = vec2(cos(angle), sin(angle));
-  return point_on_circle * sqrt(random_float(rng_state));
-}
-
-
-// Functions for colour correction --------------------------------------------
-vec3 less_than(vec3 v, float value) {
-  return vec3(
-    float(v.x < value),
-    float(v.y < value),
-    float(v.z < value)
-  );
-}
-
-vec3 linear_to_srgb(vec3 rgb) {
-  rgb = clamp(rgb, vec3(0.0), vec3(1.0));  
-  return mix(
-    pow(rgb, vec3(1.0/2.4)) * 1.055 - 0.055,
-    rgb * 12.92,
-    less_than(rgb, 0.0031308)
-  );
+  return point_on_circle * sqrt(random_float(rng));
 }
 
-vec3 srgb_to_linear(vec3 rgb) {
-  rgb = clamp(rgb, vec3(0.0), vec3(1.0));  
-  return mix(
-    pow(((rgb+0.055) / 1.055), vec3(2.4)),
-    rgb / 12.92,
-    less_than(rgb, 0.04045)
-  );
-}
-
-// Tone maps an HDR colour to LDR according to a luminance only fit
-// Code made by Krzysztof Narkowicz
-vec3 aces_film(vec3 hdr) {
-  float a = 2.51;
-  float b = 0.03;
-  float c = 2.43;
-  float d = 0.59;
-  float e = 0.14;
-  return clamp((hdr*(a*hdr + b)) / (hdr*(c*hdr + d) + e), 0.0, 1.0);
-}
 
 // Functions for creating rays and handling their collisions ------------------
 
@@ -159,37 +215,141 @@ vec3 aces_film(vec3 hdr) {
 // directed toward a randomly jittered sample around the viewport pixel position 
 // for this fragmet.
 Ray get_ray_sample(vec3 pixel_down_left, vec3 pixel_delta_u, vec3 pixel_delta_v,
-vec3 defocus_u, vec3 defocus_v, inout uint rng_state) {
+vec3 defocus_u, vec3 defocus_v, inout uvec4 rng) {
   vec3 ij = vec3(out_tex_coord * vec2(SCREEN_RESOLUTION), 0.0); // Pixel indices
 
   // Add some jittering for anti-aliasing
-  vec3 jittered_ij = ij + vec3(sample_square(rng_state), 0.0);
+  vec3 jittered_ij = ij + vec3(sample_square(rng), 0.0);
   vec3 pixel_world_pos = pixel_down_left + jittered_ij.x * pixel_delta_u + jittered_ij.y * pixel_delta_v;
 
-  vec2 p = sample_circle(rng_state);
+  vec2 p = sample_circle(rng);
 
   Ray ray;
   ray.pos = CAM_POS + p.x*defocus_u + p.y*defocus_v;
   ray.dir = normalize(pixel_world_pos-ray.pos);
+
+  // Pick a moment while the shutter is open for motion blur
+  ray.time = random_float(rng);
   return ray;
 }
 
+// Texture coordinates of a direction in the environment map: s goes around
+// the y axis, t from straight down to straight up
+vec2 direction_to_lat_long(vec3 dir) {
+  return vec2(0.5 + atan(dir.z, dir.x) / (2.0 * 3.141592654),
+              1.0 - acos(clamp(dir.y, -1.0, 1.0)) / 3.141592654);
+}
+
+vec3 lat_long_to_direction(vec2 st) {
+  float phi = 2.0 * 3.141592654 * (st.x - 0.5);
+  float theta = 3.141592654 * (1.0 - st.y);
+  return vec3(sin(theta) * cos(phi), cos(theta), sin(theta) * sin(phi));
+}
+
+// Density over solid angle of sampling dir with sample_environment(), from
+// the texel's relative probability. Texels map to patches of (s, t) that
+// cover 2 pi^2 sin(theta) steradians per unit area.
+float environment_pdf(vec3 dir, float relative_probability) {
+  float sin_theta = sqrt(max(1.0 - dir.y * dir.y, 0.0));
+  return relative_probability / (2.0 * 3.141592654 * 3.141592654 * max(sin_theta, 1e-6));
+}
+
+float environment_pdf(vec3 dir) {
+  ivec2 size = textureSize(ENVIRONMENT_SAMPLING, 0);
+  ivec2 texel = min(ivec2(direction_to_lat_long(dir) * vec2(size)), size - 1);
+  return environment_pdf(dir, texelFetch(ENVIRONMENT_SAMPLING, texel, 0).z);
+}
+
+// Picks a direction with a density proportional to the environment's
+// luminance: a texel from the alias table, then a point within it
+vec3 sample_environment(inout uvec4 rng, out float pdf) {
+  ivec2 size = textureSize(ENVIRONMENT_SAMPLING, 0);
+  int count = size.x * size.y;
+  int i = min(int(random_float(rng) * float(count)), count - 1);
+  vec4 entry = texelFetch(ENVIRONMENT_SAMPLING, ivec2(i % size.x, i / size.x), 0);
+  if (random_float(rng) >= entry.x) {
+    i = int(entry.y);
+    entry = texelFetch(ENVIRONMENT_SAMPLING, ivec2(i % size.x, i / size.x), 0);
+  }
+  vec2 st = (vec2(i % size.x, i / size.x) +
+             vec2(random_float(rng), random_float(rng))) / vec2(size);
+  vec3 dir = lat_long_to_direction(st);
+  pdf = environment_pdf(dir, entry.z);
+  return dir;
+}
+
 // Gets the background colour for a ray that does not hit any objects
 vec3 get_background_light(Ray ray) {
+  if (USE_ENVIRONMENT_MAP) {
+    return textureLod(ENVIRONMENT, direction_to_lat_long(normalize(ray.dir)), 0.0).xyz;
+  }
   // Calculate a background colour as a nice white to blue gradient along y
   float a = 0.5*(normalize(ray.dir).y+1.0);
   return (1.0-a)*vec3(1.0, 1.0, 1.0)+a*vec3(0.5,0.7,1.0);
 }
 
-// Calculates whether a given ray intersects with a given sphere
-Hit ray_sphere_intersect(Ray ray, Sphere sphere) {
-  Hit hit;
-  hit.did_hit = false;
+Material get_material(int i) {
+  int base = 7 * i;
+  Material material;
+  material.albedo = texelFetch(MATERIALS, base);
+  material.emission_colour = texelFetch(MATERIALS, base + 1);
+  vec4 t2 = texelFetch(MATERIALS, base + 2);
+  material.emission_strength = t2.x;
+  material.specular_chance = t2.y;
+  material.specular_roughness = t2.z;
+  material.specular_fuzz = t2.w;
+  material.specular_colour = texelFetch(MATERIALS, base + 3);
+  material.refraction_colour = texelFetch(MATERIALS, base + 4);
+  vec4 t5 = texelFetch(MATERIALS, base + 5);
+  material.ior = t5.x;
+  material.refraction_chance = t5.y;
+  material.refraction_roughness = t5.z;
+  material.f0 = t5.w;
+  vec4 t6 = texelFetch(MATERIALS, base + 6);
+  material.f90 = t6.x;
+  material.albedo_texture = floatBitsToInt(t6.y);
+  material.roughness_texture = floatBitsToInt(t6.z);
+  material.emission_texture = floatBitsToInt(t6.w);
+  return material;
+}
+
+// Fetches sphere i, moved to where it is at the given shutter time
+Sphere get_sphere(int i, float time) {
+  vec4 start = texelFetch(SPHERES, 2 * i);
+  vec4 end = texelFetch(SPHERES, 2 * i + 1);
+  Sphere sphere;
+  sphere.pos = mix(start.xyz, end.xyz, time);
+  sphere.radius = start.w;
+  return sphere;
+}
+
+// Fetches plane i, its unit normal in xyz and its offset along it in w
+vec4 get_plane(int i) {
+  return texelFetch(PLANES, i);
+}
+
+Quad get_quad(int i) {
+  Quad quad;
+  quad.corner = texelFetch(QUADS, 3 * i).xyz;
+  quad.u = texelFetch(QUADS, 3 * i + 1).xyz;
+  quad.v = texelFetch(QUADS, 3 * i + 2).xyz;
+  return quad;
+}
+
+Box get_box(int i) {
+  Box box;
+  box.min = texelFetch(BOXES, 2 * i).xyz;
+  box.max = texelFetch(BOXES, 2 * i + 1).xyz;
+  return box;
+}
 
+// Calculates whether a given ray intersects with a given sphere. Returns the
+// distance along the ray to the intersection, or -1 if there is none, and
+// whether the ray hits the outside of the sphere there.
+float ray_sphere_intersect(Ray ray, Sphere sphere, out bool front_face) {
   // Sphere equation: dot(offs, offs) - r^2 = 0,
   // offs = sphere.center - ray.dir * t 
   // Rewritten as quadratic equation in t with coefficients a, b, c
-  // Ignore the w component of sphere.pos as it is used just for byte alignment
   //vec3 offs = sphere.pos.xyz-ray.pos;
   vec3 offs = sphere.pos.xyz - ray.pos;
   float a = dot(ray.dir, ray.dir);
@@ -199,42 +359,274 @@ Hit ray_sphere_intersect(Ray ray, Sphere sphere) {
   // Discriminant of quadratic equation gives number of solutions i.e. num hits 
   // negative = no hit, 0 = 1 hit on edge, positive = 2 hits through sphere
   float discriminant = b * b - 4.0 * a * c;
-  if (discriminant >= 0) {
-
-    // 0.001 dist threshold rather than 0.0 is to combat shadow acne caused by 
-    // floating point inaccuracy
-    float sqrtd = sqrt(discriminant);
-    bool front_face = true;
-    float dist = (-b-sqrtd) / (2.0 * a);
-    if (dist <= -0.001) {
-      dist = (-b+sqrtd) / (2.0 * a);
-      front_face = false;
+  front_face = true;
+  if (discriminant < 0) {
+    return -1.0;
+  }
+
+  // 0.001 dist threshold rather than 0.0 is to combat shadow acne caused by 
+  // floating point inaccuracy
+  float sqrtd = sqrt(discriminant);
+  float dist = (-b-sqrtd) / (2.0 * a);
+  if (dist <= -0.001) {
+    dist = (-b+sqrtd) / (2.0 * a);
+    front_face = false;
+  }
+  return dist >= 0.001 ? dist : -1.0;
+}
+
+// The distance along the ray to the plane, or -1 if it is parallel or behind
+float ray_plane_intersect(Ray ray, vec4 plane) {
+  float denom = dot(plane.xyz, ray.dir);
+  if (denom == 0.0) {
+    return -1.0;
+  }
+  float dist = (plane.w - dot(plane.xyz, ray.pos)) / denom;
+  return dist >= 0.001 ? dist : -1.0;
+}
+
+// The distance along the ray to the quad, or -1 if it misses. The hit is
+// expressed in the quad's edges as corner + a * u + b * v, and lies on the
+// quad if both a and b are in [0, 1].
+float ray_quad_intersect(Ray ray, Quad quad) {
+  vec3 n = cross(quad.u, quad.v);
+  float denom = dot(n, ray.dir);
+  if (denom == 0.0) {
+    return -1.0;
+  }
+  float dist = dot(n, quad.corner - ray.pos) / denom;
+  vec3 p = ray.pos + ray.dir * dist - quad.corner;
+  vec3 w = n / dot(n, n);
+  float a = dot(w, cross(p, quad.v));
+  float b = dot(w, cross(quad.u, p));
+  bool inside = a >= 0.0 && a <= 1.0 && b >= 0.0 && b <= 1.0;
+  return inside && dist >= 0.001 ? dist : -1.0;
+}
+
+// Slab test against the box, returning the distance like
+// ray_sphere_intersect(). inv_dir is the reciprocal of the ray direction.
+float ray_box_intersect(Ray ray, Box box, vec3 inv_dir, out bool front_face) {
+  vec3 t0 = (box.min - ray.pos) * inv_dir;
+  vec3 t1 = (box.max - ray.pos) * inv_dir;
+  vec3 t_near = min(t0, t1);
+  vec3 t_far = max(t0, t1);
+  float dist = max(max(t_near.x, t_near.y), t_near.z);
+  float t_exit = min(min(t_far.x, t_far.y), t_far.z);
+  front_face = true;
+  if (dist > t_exit) {
+    return -1.0;
+  }
+  if (dist <= -0.001) {
+    dist = t_exit;
+    front_face = false;
+  }
+  return dist >= 0.001 ? dist : -1.0;
+}
+
+// Outward normal of the face of the box that pos lies on
+vec3 box_normal(Box box, vec3 pos) {
+  vec3 half_size = max(0.5 * (box.max - box.min), vec3(1e-6));
+  vec3 d = (pos - 0.5 * (box.min + box.max)) / half_size;
+  vec3 a = abs(d);
+  if (a.x >= a.y && a.x >= a.z) {
+    return vec3(sign(d.x), 0.0, 0.0);
+  }
+  return a.y >= a.z ? vec3(0.0, sign(d.y), 0.0) : vec3(0.0, 0.0, sign(d.z));
+}
+
+// Intersects primitive prim of the BVH, a sphere, quad or box
+float ray_prim_intersect(Ray ray, int prim, vec3 inv_dir, out bool front_face) {
+  if (prim < SPHERE_COUNT) {
+    return ray_sphere_intersect(ray, get_sphere(prim, ray.time), front_face);
+  }
+  prim -= SPHERE_COUNT;
+  if (prim < QUAD_COUNT) {
+    front_face = true;
+    return ray_quad_intersect(ray, get_quad(prim));
+  }
+  return ray_box_intersect(ray, get_box(prim - QUAD_COUNT), inv_dir, front_face);
+}
+
+// Fills in the position, normal and material of a hit on primitive prim at
+// dist along the ray, and its texture coordinates if there are textures. The
+// normal points to the side the ray came from.
+Hit prim_hit(Ray ray, int prim, float dist, bool front_face) {
+  Hit hit;
+  hit.did_hit = true;
+  hit.pos = ray.pos + ray.dir * dist;
+  hit.dist = dist;
+  hit.front_face = front_face;
+  hit.material = get_material(int(texelFetch(PRIM_MATERIALS, prim).r));
+
+  // Index of the primitive among those of its own kind
+  int quad = prim - SPHERE_COUNT;
+  int box = quad - QUAD_COUNT;
+  int plane = box - BOX_COUNT;
+  vec3 outward;
+  if (prim < SPHERE_COUNT) {
+    Sphere sphere = get_sphere(prim, ray.time);
+    outward = normalize(hit.pos - sphere.pos);
+    if (HAS_TEXTURES) {
+      // Longitude and latitude
+      hit.uv = vec2(0.5 + atan(outward.z, outward.x) / (2.0 * 3.141592654),
+                    acos(clamp(-outward.y, -1.0, 1.0)) / 3.141592654);
+      hit.uv_size = sqrt(2.0) * 3.141592654 * sphere.radius;
+    }
+  }
+  else if (quad < QUAD_COUNT) {
+    Quad q = get_quad(quad);
+    vec3 n = cross(q.u, q.v);
+    outward = faceforward(normalize(n), ray.dir, n);
+    if (HAS_TEXTURES) {
+      // Along the edges, as in ray_quad_intersect()
+      vec3 w = n / dot(n, n);
+      vec3 p = hit.pos - q.corner;
+      hit.uv = vec2(dot(w, cross(p, q.v)), dot(w, cross(q.u, p)));
+      hit.uv_size = sqrt(length(n));
     }
-    if (dist >= 0.001) {
-      hit.did_hit = true;
-      hit.pos = ray.pos + ray.dir * dist; 
-      //hit.normal = normalize(hit.pos - sphere.pos.xyz); // Outward pointing normals
-      hit.normal = normalize(hit.pos - sphere.pos.xyz) * (front_face ? 1.0 : -1.0);
-      hit.dist = dist;
-      hit.material = sphere.material;
-      //hit.front_face = dot(ray.dir, hit.normal) <= 0.0;
-      hit.front_face = front_face;
+  }
+  else if (box < BOX_COUNT) {
+    Box b = get_box(box);
+    outward = box_normal(b, hit.pos);
+    if (HAS_TEXTURES) {
+      // Each face is covered by the texture once
+      vec3 size = max(b.max - b.min, vec3(1e-6));
+      vec3 p = (hit.pos - b.min) / size;
+      vec3 a = abs(outward);
+      vec2 face = a.x > 0.5 ? size.zy : (a.y > 0.5 ? size.xz : size.xy);
+      hit.uv = a.x > 0.5 ? p.zy : (a.y > 0.5 ? p.xz : p.xy);
+      hit.uv_size = sqrt(face.x * face.y);
+    }
+  }
+  else {
+    vec3 n = get_plane(plane).xyz;
+    outward = faceforward(n, ray.dir, n);
+    if (HAS_TEXTURES) {
+      // World units along two directions in the plane, so textures repeat
+      // every unit
+      vec3 t = normalize(cross(n, abs(n.y) < 0.999 ? vec3(0.0, 1.0, 0.0)
+                                                    : vec3(1.0, 0.0, 0.0)));
+      hit.uv = vec2(dot(hit.pos, t), dot(hit.pos, cross(n, t)));
+      hit.uv_size = 1.0;
     }
   }
+  hit.normal = outward * (front_face ? 1.0 : -1.0);
   return hit;
 }
 
+// Number of set bits in the lowest byte of v
+uint bit_count8(uint v) {
+  v = v - ((v >> 1) & 0x55u);
+  v = (v & 0x33u) + ((v >> 2) & 0x33u);
+  return (v + (v >> 4)) & 0x0fu;
+}
+
+uint get_byte(uint word, int i) {
+  return (word >> (8 * i)) & 0xffu;
+}
+
+// Finds the closest hit along the ray. Traversal keeps only the distance,
+// primitive and side of the closest intersection so far, and the rest of the
+// hit is fetched once at the end.
 Hit ray_collision(Ray ray) {
-    Hit closest_hit;
-    closest_hit.did_hit = false;
-    closest_hit.dist = 9999999999.0;
-    for (int i = 0; i < NUM_SPHERES; i++) {
-      Hit hit = ray_sphere_intersect(ray, spheres[i]);
-      if (hit.did_hit && hit.dist < closest_hit.dist) {
-        closest_hit = hit;
+    float closest_dist = 9999999999.0;
+    int closest_prim = -1;
+    bool closest_front_face = true;
+
+    vec3 safe_dir = mix(ray.dir, vec3(1e-20), lessThan(abs(ray.dir), vec3(1e-20)));
+    vec3 inv_dir = 1.0 / safe_dir;
+
+    // Planes go first, a ground plane hit lets traversal skip everything
+    // below it
+    int plane_base = SPHERE_COUNT + QUAD_COUNT + BOX_COUNT;
+    for (int i = 0; i < PLANE_COUNT; i++) {
+      float dist = ray_plane_intersect(ray, get_plane(i));
+      if (dist > 0.0 && dist < closest_dist) {
+        closest_dist = dist;
+        closest_prim = plane_base + i;
+        closest_front_face = true;
+      }
+    }
+
+    // Each stack entry is a group of children of one node: x is the index of
+    // the node's first interior child, the low byte of y marks the slots still
+    // to visit and the next byte marks which slots are interior
+    uvec2 stack[BVH_STACK_SIZE];
+    int stack_size = 1;
+    stack[0] = uvec2(0u, 0x0101u);
+    while (stack_size > 0) {
+      uvec2 group = stack[stack_size - 1];
+      uint slot_bit = group.y & (~group.y + 1u);
+      uint remaining = group.y & 0xffu & ~slot_bit;
+      if (remaining == 0u) {
+        stack_size--;
+      }
+      else {
+        stack[stack_size - 1].y = remaining | (group.y & 0xff00u);
+      }
+      uint node_index = group.x + bit_count8((group.y >> 8) & (slot_bit - 1u));
+
+      int base = 5 * int(node_index);
+      uvec4 n0 = texelFetch(BVH_NODES, base);
+      uvec4 n1 = texelFetch(BVH_NODES, base + 1);
+      uvec4 n2 = texelFetch(BVH_NODES, base + 2);
+      uvec4 n3 = texelFetch(BVH_NODES, base + 3);
+      uvec4 n4 = texelFetch(BVH_NODES, base + 4);
+      uint q[12] = uint[12](n2.x, n2.y, n2.z, n2.w, n3.x, n3.y, n3.z, n3.w,
+                            n4.x, n4.y, n4.z, n4.w);
+      uint imask = n0.w >> 24;
+
+      // Slab distances straight from the quantized child boxes:
+      // t = (origin - ray.pos) / dir + q * scale / dir
+      vec3 o = (uintBitsToFloat(n0.xyz) - ray.pos) * inv_dir;
+      vec3 s = uintBitsToFloat(uvec3(n0.w & 0xffu, (n0.w >> 8) & 0xffu,
+                                     (n0.w >> 16) & 0xffu) << 23) * inv_dir;
+
+      uint child_hits = 0u;
+      for (int i = 0; i < 8; i++) {
+        uint meta = get_byte(i < 4 ? n1.z : n1.w, i & 3);
+        if (meta == 0u) continue;
+
+        int w = i >> 2;
+        int b = i & 3;
+        vec3 q_lo = vec3(get_byte(q[w], b), get_byte(q[2 + w], b), get_byte(q[4 + w], b));
+        vec3 q_hi = vec3(get_byte(q[6 + w], b), get_byte(q[8 + w], b), get_byte(q[10 + w], b));
+        vec3 t0 = o + q_lo * s;
+        vec3 t1 = o + q_hi * s;
+        vec3 t_near = min(t0, t1);
+        vec3 t_far = max(t0, t1);
+        float t_enter = max(max(t_near.x, t_near.y), max(t_near.z, 0.0));
+        float t_exit = min(min(t_far.x, t_far.y), min(t_far.z, closest_dist));
+        if (t_enter > t_exit) continue;
+
+        if (((imask >> i) & 1u) != 0u) {
+          child_hits |= 1u << i;
+        }
+        else {
+          // Leaf, meta holds the primitive count and offset from prim_base
+          uint first = n1.y + (meta & 31u);
+          for (uint p = first; p < first + (meta >> 5); p++) {
+            int prim = int(texelFetch(BVH_PRIM_INDICES, int(p)).r);
+            bool front_face;
+            float dist = ray_prim_intersect(ray, prim, inv_dir, front_face);
+            if (dist > 0.0 && dist < closest_dist) {
+              closest_dist = dist;
+              closest_prim = prim;
+              closest_front_face = front_face;
+            }
+          }
+        }
+      }
+      if (child_hits != 0u && stack_size < BVH_STACK_SIZE) {
+        stack[stack_size++] = uvec2(n1.x, child_hits | (imask << 8));
       }
     }
-    return closest_hit;
+    if (closest_prim < 0) {
+      Hit miss;
+      miss.did_hit = false;
+      return miss;
+    }
+    return prim_hit(ray, closest_prim, closest_dist, closest_front_face);
 }
 
 
@@ -263,121 +655,381 @@ float fresnel_reflectance(float ior_outer, float ior_inner, vec3 n, vec3 ray_dir
   return mix(f0, f90, ret);
 }
 
-// Returns the incoming light from this ray
-vec3 trace(Ray ray, inout uint rng_state) {
-  vec3 incoming_light = vec3(0.0);
-  vec3 ray_colour = vec3(1.0);
+// GGX microfacet lobes for rough reflection and refraction, the same as
+// microfacet.h which has the details. alpha is the square of the material's
+// roughness, n the normal and v the direction towards the viewer. Fresnel is
+// left out, it already picks which lobe a ray takes.
+#define GGX_MIN_ALPHA 1e-3
 
-  for (int b = 0; b < MAX_BOUNCE_COUNT; b++) {
-    Hit hit = ray_collision(ray);
+float ggx_alpha(float roughness) {
+  return max(roughness * roughness, GGX_MIN_ALPHA);
+}
 
-    if (hit.did_hit) {
-      ray.pos = hit.pos;
-      Material material = hit.material;
+float ggx_lambda(float cos_theta, float alpha) {
+  float cos2 = cos_theta * cos_theta;
+  float tan2 = max(1.0 - cos2, 0.0) / max(cos2, 1e-8);
+  return 0.5 * (sqrt(1.0 + alpha * alpha * tan2) - 1.0);
+}
 
-      // Absorption when the ray hits inside an object
-      // Uses Beer's law
-      if (!hit.front_face) {
-        ray_colour *= exp(-material.refraction_colour.xyz * hit.dist);
-      }
+float ggx_d(float cos_m, float alpha) {
+  float a2 = alpha * alpha;
+  float d = cos_m * cos_m * (a2 - 1.0) + 1.0;
+  return a2 / (3.141592654 * d * d);
+}
 
-      // Calculate chances for a diffuse bounce, specular bounce or refraction
-      float specular_chance = material.specular_chance;
-      float refraction_chance = material.refraction_chance;
-      float ray_probability = 1.0;
-      if (specular_chance > 0.0) {
-        specular_chance = fresnel_reflectance(
-          // mix(material.ior_outer, material.ior_inner, float(!hit.front_face)),
-          // mix(material.ior_outer, material.ior_inner, float(hit.front_face)),
-          mix(material.ior, 1.0, float(hit.front_face)),
-          mix(material.ior, 1.0, float(!hit.front_face)),
-          hit.normal,
-          ray.dir,
-          material.specular_chance,
-          material.f90
-        );
-        float chance_multiplier = (1.0-specular_chance) / (1.0 - material.specular_chance);
-        refraction_chance *= chance_multiplier;
-      }
+float ggx_g1(float cos_v, float alpha) {
+  return 1.0 / (1.0 + ggx_lambda(cos_v, alpha));
+}
 
-      // Choose which type of bounce to do for the ray
-      float do_specular = 0.0;
-      float do_refraction = 0.0;
-      float rng_roll = random_float(rng_state);
-      if (specular_chance > 0.0 && rng_roll < specular_chance) {
-        do_specular = 1.0;
-        ray_probability = specular_chance;
-      }
-      else if (refraction_chance > 0.0 && rng_roll < specular_chance + refraction_chance) {
-        do_refraction = 1.0;
-        ray_probability = refraction_chance;
-      }
-      else {
-        ray_probability = 1.0 - specular_chance - refraction_chance;
-      }
+// A microfacet normal picked from those visible from v, after Heitz,
+// "Sampling the GGX Distribution of Visible Normals" (2018)
+vec3 sample_ggx_vndf(vec3 n, vec3 v, float alpha, inout uvec4 rng) {
+  float z_sign = n.z >= 0.0 ? 1.0 : -1.0;
+  float a = -1.0 / (z_sign + n.z);
+  float b = n.x * n.y * a;
+  vec3 t1 = vec3(1.0 + z_sign * n.x * n.x * a, z_sign * b, -z_sign * n.x);
+  vec3 t2 = vec3(b, z_sign + n.y * n.y * a, -n.y);
+
+  vec3 vh = normalize(vec3(alpha * dot(v, t1), alpha * dot(v, t2), dot(v, n)));
+  float len2 = vh.x * vh.x + vh.y * vh.y;
+  vec3 b1 = len2 > 0.0 ? vec3(-vh.y, vh.x, 0.0) / sqrt(len2) : vec3(1.0, 0.0, 0.0);
+  vec3 b2 = cross(vh, b1);
+  float r = sqrt(random_float(rng));
+  float phi = 2.0 * 3.141592654 * random_float(rng);
+  float p1 = r * cos(phi);
+  float p2 = r * sin(phi);
+  float s = 0.5 * (1.0 + vh.z);
+  p2 = (1.0 - s) * sqrt(max(1.0 - p1 * p1, 0.0)) + s * p2;
+  vec3 nh = p1 * b1 + p2 * b2 + sqrt(max(1.0 - p1 * p1 - p2 * p2, 0.0)) * vh;
+  vec3 m = normalize(vec3(alpha * nh.x, alpha * nh.y, max(nh.z, 0.0)));
+  return m.x * t1 + m.y * t2 + m.z * n;
+}
 
-      // Avoid divide by zero
-      ray_probability = max(ray_probability, 0.001);
+// Throughput G2 / G1(v) of l, reflected or refracted about m from
+// sample_ggx_vndf(). 0 when l ends up on the wrong side of the surface.
+float ggx_sample_weight(vec3 n, vec3 v, vec3 m, vec3 l, float alpha) {
+  float cos_l = dot(n, l);
+  if (cos_l * dot(m, l) <= 0.0) {
+    return 0.0;
+  }
+  float lambda_v = ggx_lambda(dot(n, v), alpha);
+  float lambda_l = ggx_lambda(abs(cos_l), alpha);
+  return (1.0 + lambda_v) / (1.0 + lambda_v + lambda_l);
+}
 
-      // Nudge the ray position slightly along the surface normal to avoid 
-      // incorrect intersections when the ray bounces
-      if (do_refraction == 1.0) {
-        ray.pos -= hit.normal * 0.01;
-      }
-      else {
-        ray.pos += hit.normal * 0.01;
-      }
+// Reflections narrower than this are too sharp for directions picked from the
+// environment to land in, so only their own bounce gathers its light
+#define GLOSSY_MIN_ALPHA 0.01
 
-      // Calculate ray direction for a diffuse bounce
-      vec3 diffuse_dir = normalize(hit.normal + random_direction(rng_state));
-
-      // Calculate ray direction for reflection bounce -> specularity
-      vec3 specular_fuzz = material.specular_fuzz * random_direction(rng_state);
-      vec3 specular_dir = normalize(reflect(ray.dir, hit.normal) + specular_fuzz);
-      specular_dir = normalize(mix(specular_dir, diffuse_dir, material.specular_roughness * material.specular_roughness));
-
-      // Calculate ray direction for refraction (-> transparency)
-      // float r_i = material.ior_outer / material.ior_inner;
-      // r_i = mix(1.0/r_i, r_i, float(hit.front_face));
-      float r_i = mix(material.ior, 1.0/material.ior, float(hit.front_face));
-      vec3 refract_dir = refract(ray.dir, hit.normal, r_i);
-      vec3 refraction_fuzz = normalize(-hit.normal + random_direction(rng_state));
-      refract_dir = normalize(mix(refract_dir, refraction_fuzz, material.refraction_roughness*material.refraction_roughness));
-
-      // Set the ray direction depending on bounce type
-      ray.dir = mix(diffuse_dir, specular_dir, do_specular);
-      ray.dir = mix(ray.dir, refract_dir, do_refraction);
-
-      // Try to catch bad ray directions that would lead to NaN or infinity
-      float tol = 0.000001;
-      if (abs(ray.dir.x) < tol && abs(ray.dir.y) < tol && abs(ray.dir.z) < tol) {
-        ray.dir = hit.normal;
-      }
+// The reflection lobe times the cosine at l
+float ggx_reflection(vec3 n, vec3 v, vec3 l, float alpha) {
+  float cos_v = dot(n, v), cos_l = dot(n, l);
+  if (cos_v <= 0.0 || cos_l <= 0.0) {
+    return 0.0;
+  }
+  vec3 m = normalize(v + l);
+  float g2 = 1.0 / (1.0 + ggx_lambda(cos_v, alpha) + ggx_lambda(cos_l, alpha));
+  return ggx_d(dot(n, m), alpha) * g2 / (4.0 * cos_v);
+}
 
-      // Update light, discard the w component of the vec4 material colours 
-      // as it is only used for proper byte aligment
-      vec3 emitted_light = material.emission_colour.xyz * material.emission_strength;
-      incoming_light += emitted_light * ray_colour;
+// Density over solid angle of reflecting v to l about a sampled normal
+float ggx_reflection_pdf(vec3 n, vec3 v, vec3 l, float alpha) {
+  float cos_v = dot(n, v), cos_l = dot(n, l);
+  if (cos_v <= 0.0 || cos_l <= 0.0) {
+    return 0.0;
+  }
+  vec3 m = normalize(v + l);
+  return ggx_g1(cos_v, alpha) * ggx_d(dot(n, m), alpha) / (4.0 * cos_v);
+}
 
-      // Ray colour is only affected by refraction when hitting the next face 
-      // This is to be able to do absorption over distance within an object
-      if (do_refraction == 0.0) {
-        ray_colour *= mix(material.albedo.xyz, material.specular_colour.xyz, do_specular);
-      }
+// Distance and albedo reported for rays that miss everything
+#define MISS_DEPTH 1e9
 
-      ray_colour /= ray_probability;
+// Texture mip levels are picked with ray cones, after Akenine-Moller et al.,
+// "Texture Level of Detail Strategies for Real-Time Ray Tracing" (2019). A
+// camera ray's cone covers its pixel, and every bounce widens it by the
+// square of the roughness times this many radians, so lookups after a
+// diffuse bounce read coarse levels.
+#define DIFFUSE_CONE_SPREAD 1.0
 
-      // Random early termination of rays for better performance
-      float p = max(ray_colour.x, max(ray_colour.y, ray_colour.z));
-      if (random_float(rng_state) > p) break;
+// Weight of a sample from one of two strategies with the given densities,
+// by the power heuristic
+float mis_weight(float pdf, float other_pdf) {
+  return pdf * pdf / (pdf * pdf + other_pdf * other_pdf);
+}
 
-      // Make up for 'energy loss' from early termination 
-      ray_colour *= 1.0/max(p, 0.001);
+// Multiplies the albedo, specular roughness and emission of the hit's
+// material by its textures, at the mip level covered by a cone of the given
+// width
+void apply_textures(inout Hit hit, vec3 ray_dir, float cone_width) {
+  float texels = float(textureSize(TEXTURES, 0).x);
+  float cos_theta = max(abs(dot(hit.normal, ray_dir)), 0.05);
+  float lod = log2(cone_width * texels / (hit.uv_size * cos_theta));
+  Material material = hit.material;
+  if (material.albedo_texture >= 0) {
+    vec3 coord = vec3(hit.uv, float(material.albedo_texture));
+    hit.material.albedo.xyz *= textureLod(TEXTURES, coord, lod).xyz;
+  }
+  if (material.roughness_texture >= 0) {
+    vec3 coord = vec3(hit.uv, float(material.roughness_texture));
+    hit.material.specular_roughness *= textureLod(TEXTURES, coord, lod).x;
+  }
+  if (material.emission_texture >= 0) {
+    vec3 coord = vec3(hit.uv, float(material.emission_texture));
+    hit.material.emission_colour.xyz *= textureLod(TEXTURES, coord, lod).xyz;
+  }
+}
+
+// Returns the incoming light from this ray, along with the normal, view depth
+// and albedo where it first hits something
+vec3 trace(Ray ray, inout uvec4 rng, out vec4 normal_depth, out vec3 albedo) {
+  vec3 incoming_light = vec3(0.0);
+  vec3 ray_colour = vec3(1.0);
+  normal_depth = vec4(-ray.dir, MISS_DEPTH);
+  albedo = vec3(1.0);
+  float cone_width = 0.0;
+  float cone_spread = 2.0 * tan(radians(VFOV) * 0.5) / float(SCREEN_RESOLUTION.y);
+
+  // An environment map is sampled directly at every diffuse and glossy
+  // bounce, and combined with the rays the bounces send out by multiple
+  // importance sampling. This is the density of the last bounce's direction,
+  // 0 if it had no direct sample to share the light.
+  float bounce_pdf = 0.0;
+
+  // Splitting: at the first hit on a material that only scatters diffusely
+  // the path is split into SPLIT_COUNT branches, each carrying an equal share
+  // of its light. Whether to split must not depend on which lobe a path
+  // picks, hence the whole material. Every branch takes that hit's bounce
+  // with random numbers of its own, from the state saved here.
+  int branch_count = 1;
+  int split_bounce = 0;
+  Ray split_ray = ray;
+  Hit split_hit;
+  split_hit.did_hit = false;
+  vec3 split_colour = ray_colour;
+  float split_cone_width = cone_width;
+  float split_cone_spread = cone_spread;
+
+  for (int branch = 0; branch < branch_count; branch++) {
+    if (branch > 0) {
+      ray = split_ray;
+      ray_colour = split_colour;
+      cone_width = split_cone_width;
+      cone_spread = split_cone_spread;
     }
-    else {
-      // Ray bounced off into the sky/void
-      incoming_light += get_background_light(ray) * ray_colour;
-      break;
+    for (int b = branch > 0 ? split_bounce : 0; b < MAX_BOUNCE_COUNT; b++) {
+      rng_set_bounce(rng, b + branch * MAX_BOUNCE_COUNT);
+      Hit hit = branch > 0 && b == split_bounce ? split_hit : ray_collision(ray);
+      if (SPLIT_COUNT > 1 && branch_count == 1 && hit.did_hit &&
+          (!HAS_SPECULAR || hit.material.specular_chance == 0.0) &&
+          (!HAS_REFRACTION || hit.material.refraction_chance == 0.0)) {
+        branch_count = SPLIT_COUNT;
+        split_bounce = b;
+        split_ray = ray;
+        split_hit = hit;
+        ray_colour /= float(SPLIT_COUNT);
+        split_colour = ray_colour;
+        split_cone_width = cone_width;
+        split_cone_spread = cone_spread;
+      }
+      if (HAS_TEXTURES && hit.did_hit) {
+        cone_width += cone_spread * hit.dist;
+        apply_textures(hit, ray.dir, cone_width);
+      }
+
+      if (hit.did_hit && b == 0 && branch == 0) {
+        normal_depth = vec4(hit.normal, hit.dist * dot(ray.dir, -CAM_FORWARD));
+        albedo = mix(hit.material.albedo.xyz, hit.material.specular_colour.xyz,
+                     hit.material.specular_chance);
+      }
+
+      if (hit.did_hit) {
+        ray.pos = hit.pos;
+        Material material = hit.material;
+
+        // Absorption when the ray hits inside an object
+        // Uses Beer's law
+        if (HAS_REFRACTION && !hit.front_face) {
+          ray_colour *= exp(-material.refraction_colour.xyz * hit.dist);
+        }
+
+        // Calculate chances for a diffuse bounce, specular bounce or refraction
+        float specular_chance = HAS_SPECULAR ? material.specular_chance : 0.0;
+        float refraction_chance = HAS_REFRACTION ? material.refraction_chance : 0.0;
+        float ray_probability = 1.0;
+        if (HAS_SPECULAR && specular_chance > 0.0) {
+          specular_chance = fresnel_reflectance(
+            // mix(material.ior_outer, material.ior_inner, float(!hit.front_face)),
+            // mix(material.ior_outer, material.ior_inner, float(hit.front_face)),
+            mix(material.ior, 1.0, float(hit.front_face)),
+            mix(material.ior, 1.0, float(!hit.front_face)),
+            hit.normal,
+            ray.dir,
+            material.specular_chance,
+            material.f90
+          );
+          float chance_multiplier = (1.0-specular_chance) / (1.0 - material.specular_chance);
+          refraction_chance *= chance_multiplier;
+        }
+
+        // Choose which type of bounce to do for the ray
+        float do_specular = 0.0;
+        float do_refraction = 0.0;
+        float rng_roll = random_float(rng);
+        if (specular_chance > 0.0 && rng_roll < specular_chance) {
+          do_specular = 1.0;
+          ray_probability = specular_chance;
+        }
+        else if (refraction_chance > 0.0 && rng_roll < specular_chance + refraction_chance) {
+          do_refraction = 1.0;
+          ray_probability = refraction_chance;
+        }
+        else {
+          ray_probability = 1.0 - specular_chance - refraction_chance;
+        }
+
+        // Avoid divide by zero
+        ray_probability = max(ray_probability, 0.001);
+
+        // Calculate ray direction for a diffuse bounce
+        vec3 diffuse_dir = normalize(hit.normal + random_direction(rng));
+        vec3 view = -ray.dir;
+
+        // Calculate ray direction for reflection bounce -> specularity. Rough
+        // reflections scatter about a microfacet normal, and the fuzz widens
+        // the lobe further.
+        vec3 specular_dir = diffuse_dir;
+        vec3 specular_normal = hit.normal;
+        float specular_alpha = 1.0;
+        if (HAS_SPECULAR) {
+          specular_alpha = ggx_alpha(length(vec2(material.specular_roughness, material.specular_fuzz)));
+          specular_normal = sample_ggx_vndf(hit.normal, view, specular_alpha, rng);
+          specular_dir = reflect(ray.dir, specular_normal);
+        }
+
+        // Calculate ray direction for refraction (-> transparency)
+        vec3 refract_dir = diffuse_dir;
+        vec3 refract_normal = hit.normal;
+        float refraction_alpha = 1.0;
+        if (HAS_REFRACTION) {
+          // float r_i = material.ior_outer / material.ior_inner;
+          // r_i = mix(1.0/r_i, r_i, float(hit.front_face));
+          float r_i = mix(material.ior, 1.0/material.ior, float(hit.front_face));
+          refraction_alpha = ggx_alpha(material.refraction_roughness);
+          refract_normal = sample_ggx_vndf(hit.normal, view, refraction_alpha, rng);
+          refract_dir = refract(ray.dir, refract_normal, r_i);
+          // refract() gives a zero vector on total internal reflection, which
+          // would turn into NaN below and spread through the mix()es even when
+          // refraction is not picked
+          if (dot(refract_dir, refract_dir) == 0.0) {
+            refract_dir = reflect(ray.dir, refract_normal);
+          }
+        }
+
+        // Set the ray direction depending on bounce type. Microfacet bounces
+        // carry the share of light that is not shadowed or masked on the way.
+        ray.dir = mix(diffuse_dir, specular_dir, do_specular);
+        ray.dir = mix(ray.dir, refract_dir, do_refraction);
+        float lobe_weight = 1.0;
+        if (do_specular == 1.0) {
+          lobe_weight = ggx_sample_weight(hit.normal, view, specular_normal, ray.dir, specular_alpha);
+        }
+        else if (do_refraction == 1.0) {
+          lobe_weight = ggx_sample_weight(hit.normal, view, refract_normal, ray.dir, refraction_alpha);
+        }
+        if (HAS_TEXTURES) {
+          float alpha = mix(mix(1.0, specular_alpha, do_specular),
+                            refraction_alpha, do_refraction);
+          cone_spread += DIFFUSE_CONE_SPREAD * alpha;
+        }
+
+        // Try to catch bad ray directions that would lead to NaN or infinity
+        float tol = 0.000001;
+        if (abs(ray.dir.x) < tol && abs(ray.dir.y) < tol && abs(ray.dir.z) < tol) {
+          ray.dir = hit.normal;
+        }
+
+        // Nudge the ray position slightly along the surface normal to avoid
+        // incorrect intersections when the ray bounces, to the side the ray
+        // leaves on
+        ray.pos += hit.normal * (dot(ray.dir, hit.normal) < 0.0 ? -0.01 : 0.01);
+
+        // Update light, discard the w component of the vec4 material colours 
+        // as it is only used for proper byte aligment
+        if (HAS_EMISSION) {
+          vec3 emitted_light = material.emission_colour.xyz * material.emission_strength;
+          incoming_light += emitted_light * ray_colour;
+        }
+
+        // Ray colour is only affected by refraction when hitting the next face 
+        // This is to be able to do absorption over distance within an object
+        vec3 lobe_colour = vec3(1.0);
+        if (do_refraction == 0.0) {
+          lobe_colour = mix(material.albedo.xyz, material.specular_colour.xyz, do_specular);
+        }
+        ray_colour *= lobe_colour / ray_probability;
+
+        // Random early termination of rays for better performance. Past the
+        // first bounces a path goes on with a chance given by the luminance of
+        // its colour relative to its share of the light, 1 or 1 / SPLIT_COUNT
+        // for a branch. Dim paths, like those off a dark ground, end early,
+        // while clear glass keeps its paths going.
+        float share = 1.0 / float(branch_count);
+        if (b >= RR_MIN_DEPTH) {
+          float p = min(dot(ray_colour, vec3(0.2126, 0.7152, 0.0722)) / share, 1.0);
+          if (random_float(rng) >= p) break;
+
+          // Make up for 'energy loss' from early termination
+          ray_colour /= p;
+        }
+
+        // Light straight from the environment, towards a direction picked by
+        // its brightness, for diffuse bounces and reflections rough enough
+        // for a direction picked that way to land in them. It comes after the
+        // early termination so it is weighted just like the light the bounced
+        // ray finds. The diffuse lobe is cosine weighted, so its density and
+        // its value times the cosine are both cos / pi.
+        bool diffuse = do_specular == 0.0 && do_refraction == 0.0;
+        bool glossy = do_specular == 1.0 && specular_alpha >= GLOSSY_MIN_ALPHA;
+        bounce_pdf = 0.0;
+        if (diffuse) {
+          bounce_pdf = max(dot(hit.normal, ray.dir), 0.0) / 3.141592654;
+        }
+        else if (glossy) {
+          bounce_pdf = ggx_reflection_pdf(hit.normal, view, ray.dir, specular_alpha);
+        }
+        if (USE_ENVIRONMENT_MAP && (diffuse || glossy)) {
+          Ray shadow_ray;
+          float light_pdf;
+          shadow_ray.pos = ray.pos;
+          shadow_ray.dir = sample_environment(rng, light_pdf);
+          shadow_ray.time = ray.time;
+          float cos_light = dot(hit.normal, shadow_ray.dir);
+          if (cos_light > 0.0 && light_pdf > 0.0 && !ray_collision(shadow_ray).did_hit) {
+            float lobe = cos_light / 3.141592654;
+            float lobe_pdf = lobe;
+            if (glossy) {
+              lobe = ggx_reflection(hit.normal, view, shadow_ray.dir, specular_alpha);
+              lobe_pdf = ggx_reflection_pdf(hit.normal, view, shadow_ray.dir, specular_alpha);
+            }
+            incoming_light += get_background_light(shadow_ray) * ray_colour * lobe /
+                              light_pdf * mis_weight(light_pdf, lobe_pdf);
+          }
+        }
+
+        ray_colour *= lobe_weight;
+        if (lobe_weight == 0.0) break;
+      }
+      else {
+        // Ray bounced off into the sky/void. After a diffuse or glossy bounce
+        // the environment's direct sample shares this light.
+        float weight = 1.0;
+        if (USE_ENVIRONMENT_MAP && bounce_pdf > 0.0) {
+          weight = mis_weight(bounce_pdf, environment_pdf(normalize(ray.dir)));
+        }
+        incoming_light += get_background_light(ray) * ray_colour * weight;
+        break;
+      }
     }
   }
 
@@ -385,11 +1037,11 @@ vec3 trace(Ray ray, inout uint rng_state) {
 }
 
 void main(void) {
-  // Generate a seed for rng using the view position and frame number
-  // This gives each fragment an own unique rng seed that changes every frame
+  // Random numbers are keyed on the pixel and on the sample's index among all
+  // samples accumulated into it, so every frame continues the same sequence
   uvec2 pixel_coord = uvec2(out_tex_coord * vec2(SCREEN_RESOLUTION));
   uint pixel_index = pixel_coord.y * SCREEN_RESOLUTION.x + pixel_coord.x;
-  uint rng_state = pixel_index + uint(FRAME) * uint(719393);
+  uint first_sample = uint(SAMPLE_OFFSET);
 
   // Calculate viewport dimensions depending on FOV and aspect ratio
   float fov_angle_rad = VFOV * 3.141592654 / 180.0;
@@ -417,27 +1069,45 @@ void main(void) {
 
   // Generate and trace several sample rays for this fragment
   vec3 incoming_light = vec3(0.0);
+  float luminance_sq = 0.0;
+  vec4 normal_depth = vec4(0.0);
+  vec3 albedo = vec3(0.0);
   for (int s = 0; s < SAMPLES_PER_PIXEL; s++) {
+    uvec4 rng = rng_key(pixel_index, first_sample + uint(s));
     Ray ray = get_ray_sample(
       pixel_dow_left,
       pixel_delta_u,
       pixel_delta_v,
       defocus_u,
       defocus_v,
-      rng_state);
-    incoming_light += trace(ray, rng_state);
+      rng);
+    vec4 sample_normal_depth;
+    vec3 sample_albedo;
+    vec3 sample_light = trace(ray, rng, sample_normal_depth, sample_albedo);
+    incoming_light += sample_light;
+    luminance_sq += pow(dot(sample_light, vec3(0.2126, 0.7152, 0.0722)), 2.0);
+    normal_depth += sample_normal_depth;
+    albedo += sample_albedo;
   }
 
-  // Combine resulting fragment colour from each sample ray
-  vec3 res_colour = incoming_light.xyz / float(SAMPLES_PER_PIXEL);
-
-  // Apply exposure, tone map then correct the colours to sRGB to display properly
-  res_colour = aces_film(EXPOSURE * res_colour);
-  vec4 res_srgb_colour = vec4(linear_to_srgb(res_colour), 1.0);
-
-
-  // Accumulate an average colour of this fragment using the previous frame
-  float weight = 1.0 / float(FRAME + 1);
-  vec4 prev_colour = texture(prev_frame, out_tex_coord);
-  out_colour = mix(prev_colour, res_srgb_colour, weight);
+  // Combine resulting fragment colour from each sample ray. The squared
+  // luminance is averaged as well, so the spread of the samples can be told
+  // however few of them each frame has.
+  float n = float(SAMPLES_PER_PIXEL);
+  vec4 frame_colour = vec4(incoming_light / n, luminance_sq / n);
+
+  // Accumulate an average of this fragment over all samples so far, in linear
+  // space, weighting frames by their sample counts. Tone mapping happens when
+  // presenting. A restart ignores whatever is left in prev_frame, as mixing
+  // with a weight of 0 would still keep a NaN or infinity from before.
+  if (SAMPLE_OFFSET == 0) {
+    out_colour = frame_colour;
+  } else {
+    vec4 prev_colour = texture(prev_frame, out_tex_coord);
+    out_colour = mix(prev_colour, frame_colour,
+                     n / float(SAMPLE_OFFSET + SAMPLES_PER_PIXEL));
+  }
+  out_normal_depth = vec4(normal_depth.xyz / max(length(normal_depth.xyz), 1e-6),
+                          normal_depth.w / n);
+  out_albedo = vec4(albedo / n, 1.0);
 }